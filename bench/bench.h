@@ -0,0 +1,280 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+/* Helpers shared by the benchmark programs in this directory: allocation
+ * counting, syscall counting, a clock, a small PRNG and the generated
+ * topics and payload sizes.
+ *
+ * Allocations are counted by interposing malloc/calloc/realloc/free on top
+ * of the glibc allocator, so this header must be included by exactly one
+ * translation unit of each benchmark binary. Sanitizer builds keep their own
+ * allocator and report no allocations. */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+/* ------------------------------------------------------------- */
+/* allocation counting */
+
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#  define BENCH_NO_ALLOC_COUNT
+#endif
+
+static uint64_t bench_alloc_count = 0;
+static uint64_t bench_alloc_bytes = 0;
+
+#ifndef BENCH_NO_ALLOC_COUNT
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+	__atomic_fetch_add(&bench_alloc_count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&bench_alloc_bytes, size, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_fetch_add(&bench_alloc_count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&bench_alloc_bytes, nmemb*size, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_fetch_add(&bench_alloc_count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&bench_alloc_bytes, size, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#endif
+
+struct bench_allocs {
+	uint64_t count;
+	uint64_t bytes;
+};
+
+static inline void bench_allocs_get(struct bench_allocs *a)
+{
+	a->count = __atomic_load_n(&bench_alloc_count, __ATOMIC_RELAXED);
+	a->bytes = __atomic_load_n(&bench_alloc_bytes, __ATOMIC_RELAXED);
+}
+
+/* ------------------------------------------------------------- */
+/* syscall counting
+ *
+ * Uses the raw_syscalls:sys_enter tracepoint through perf when the kernel
+ * allows it (perf_event_paranoid / CAP_PERFMON). Otherwise falls back to
+ * the read/write syscall counters of /proc/self/io, which miss open, stat,
+ * mkdir and close; bench_syscalls_label() tells which one is in use. */
+
+static int bench_perf_fd = -1;
+
+static inline long bench_tracepoint_id(void)
+{
+	const char *paths[] = {
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+	};
+	FILE *fptr;
+	long id;
+	size_t i;
+
+	for(i=0; i<sizeof(paths)/sizeof(paths[0]); i++){
+		fptr = fopen(paths[i], "r");
+		if(!fptr) continue;
+		if(fscanf(fptr, "%ld", &id) != 1){
+			id = -1;
+		}
+		fclose(fptr);
+		return id;
+	}
+	return -1;
+}
+
+static inline void bench_syscalls_init(void)
+{
+	struct perf_event_attr attr;
+	long id;
+
+	id = bench_tracepoint_id();
+	if(id < 0) return;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.size = sizeof(attr);
+	attr.config = (uint64_t)id;
+	attr.inherit = 1;
+	attr.exclude_kernel = 0;
+	bench_perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static inline const char *bench_syscalls_label(void)
+{
+	return bench_perf_fd < 0 ? "rw-syscalls" : "syscalls";
+}
+
+static inline uint64_t bench_syscalls_get(void)
+{
+	uint64_t count = 0;
+	unsigned long long syscr = 0, syscw = 0;
+	char line[128];
+	FILE *fptr;
+
+	if(bench_perf_fd >= 0){
+		if(read(bench_perf_fd, &count, sizeof(count)) != sizeof(count)){
+			count = 0;
+		}
+		return count;
+	}
+
+	fptr = fopen("/proc/self/io", "r");
+	if(!fptr) return 0;
+	while(fgets(line, sizeof(line), fptr)){
+		sscanf(line, "syscr: %llu", &syscr);
+		sscanf(line, "syscw: %llu", &syscw);
+	}
+	fclose(fptr);
+	return syscr + syscw;
+}
+
+/* ------------------------------------------------------------- */
+
+static inline uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* xorshift64*, deterministic so runs are comparable */
+static inline uint64_t bench_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* ------------------------------------------------------------- */
+/* generated traffic */
+
+/* Payload sizes, fixed or uniform/log-uniform between min and max. */
+struct bench_size {
+	int min;
+	int max;
+	bool log;
+};
+
+static inline int bench_parse_size(struct bench_size *size, const char *arg)
+{
+	char mode[8] = {0};
+	int n;
+
+	n = sscanf(arg, "%d:%d:%7s", &size->min, &size->max, mode);
+	if(n == 1){
+		size->max = size->min;
+	}
+	if(n < 1 || size->min < 0 || size->max < size->min){
+		fprintf(stderr, "Error: Invalid payload size \"%s\".\n", arg);
+		return 1;
+	}
+	if(n == 3){
+		if(strcmp(mode, "log")){
+			fprintf(stderr, "Error: Invalid payload size distribution \"%s\".\n", mode);
+			return 1;
+		}
+		size->log = true;
+	}
+	return 0;
+}
+
+static inline int bench_pick_size(const struct bench_size *size, uint64_t *rng)
+{
+	double lo, hi;
+
+	if(size->min == size->max){
+		return size->min;
+	}
+	if(size->log){
+		lo = log((double)size->min + 1);
+		hi = log((double)size->max + 1);
+		return (int)(exp(lo + (hi - lo) * ((bench_rand(rng) >> 11) * (1.0 / 9007199254740992.0)))) - 1;
+	}
+	return size->min + (int)(bench_rand(rng) % (uint64_t)(size->max - size->min + 1));
+}
+
+/* count topics bench/g<a>/g<b>/.../dev<i> of depth levels, sharing
+ * prefixes like a real device tree */
+static inline char **bench_make_topics(int count, int depth)
+{
+	char **topics;
+	char buf[256];
+	int i, k, len;
+	unsigned int n;
+
+	topics = calloc(count, sizeof(char *));
+	if(!topics) return NULL;
+
+	for(i=0; i<count; i++){
+		len = snprintf(buf, sizeof(buf), "bench");
+		n = (unsigned int)i;
+		for(k=1; k<depth && len < (int)sizeof(buf)-32; k++){
+			len += snprintf(buf+len, sizeof(buf)-len, "/g%u", n % 8);
+			n /= 8;
+		}
+		snprintf(buf+len, sizeof(buf)-len, "/dev%d", i);
+		topics[i] = strdup(buf);
+		if(!topics[i]) return NULL;
+	}
+	return topics;
+}
+
+static inline void bench_free_topics(char **topics, int count)
+{
+	int i;
+
+	for(i=0; i<count; i++){
+		free(topics[i]);
+	}
+	free(topics);
+}
+
+#endif
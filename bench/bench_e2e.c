@@ -0,0 +1,927 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+/* Loopback end-to-end benchmark.
+ *
+ * Runs mqtt-dirpub's main() in process, connected through client_connect()
+ * and the libmosquitto network loop to a minimal MQTT broker stand-in on
+ * 127.0.0.1, which sends generated PUBLISH packets with the QoS 1 and 2
+ * handshakes of a broker. With -b the messages go through a real broker
+ * (e.g. a local mosquitto) instead, the stand-in then connects to it as a
+ * publisher and drops are the broker's as well.
+ *
+ * Every payload starts with the time it was sent. The output functions are
+ * wrapped, so a message counts as delivered once it is written (and synced
+ * with --fsync), and its latency covers the network, libmosquitto, the
+ * pipeline, the writer queue and the disk. Messages never written, filtered
+ * out, sampled out or lost, count as dropped.
+ *
+ * Build from mosquitto-<ver>/client/bench, next to the other sources:
+ *
+ *   cc -O2 -I.. -I../.. -I../../include -I../../lib -o bench_e2e \
+ *      bench_e2e.c ../sub_client_output.c ../sub_client_queue.c \
+ *      ../sub_client_dedup.c ../sub_client_sample.c ../sub_client_rollup.c \
+ *      ../sub_client_intern.c ../sub_client_pool.c ../sub_client_affinity.c \
+ *      ../sub_client_capture.c ../sub_client_topk.c ../sub_client_stats.c \
+ *      ../client_shared.c ../client_props.c -lmosquitto -lm -lpthread
+ *
+ * Usage:
+ *   bench_e2e [-n count] [-w warmup] [-T topics] [-d depth]
+ *             [-s size | -s min:max[:log]] [-q qos] [-r rate] [-m inflight]
+ *             [-i idle] [-b host[:port]] [-o file]
+ *             -- <mosquitto_sub options>
+ *
+ * Everything after "--" is parsed by client_config_load(); -h, -p, -t and
+ * -q are set by the benchmark. The results are one JSON object on a line,
+ * appended to -o or written to stdout, e.g.
+ *   bench_e2e -n 200000 -q 1 -o e2e.jsonl -- --fmask '/dev/shm/e2e/@topic' --writers 2
+ */
+
+#include <mosquitto.h>
+
+/* the hooks below, see e2e_written() and e2e_subscribe_callback_set() */
+#define main mqtt_dirpub_main
+#define print_message e2e_print_message
+#define print_message_file e2e_print_message_file
+#define mosquitto_subscribe_callback_set e2e_subscribe_callback_set
+void e2e_subscribe_callback_set(struct mosquitto *mosq, void (*on_subscribe)(struct mosquitto *, void *, int, int, const int *));
+#include "../sub_client.c"
+#undef main
+#undef print_message
+#undef print_message_file
+#undef mosquitto_subscribe_callback_set
+
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "bench.h"
+
+int print_message(struct mosq_config *cfg, const struct mosquitto_message *message);
+int print_message_file(struct mosq_config *cfg, const struct mosquitto_message *message);
+
+#define E2E_STAMP_LEN 17              /* phase and 16 hex digits of the send time */
+#define E2E_IN_MAX 65536
+#define E2E_OUT_MAX (256*1024)        /* sent ahead of the socket, keeps the timestamps honest */
+#define E2E_PING_NS (30*1000000000ULL)
+
+struct e2e_opts {
+	long count;
+	long warmup;
+	int topics;
+	int depth;
+	struct bench_size size;
+	int qos;
+	long rate;
+	int inflight;
+	int idle_ms;
+	const char *host;     /* broker, NULL for the stand-in */
+	int port;
+	const char *output;
+};
+
+/* One MQTT connection: the stand-in's to mqtt-dirpub, or the publisher's
+ * to the broker with -b. */
+struct e2e_conn {
+	int sock;
+	int version;          /* 4 (3.1.1) or 5 */
+	bool connected;
+	bool closed;
+	char in[E2E_IN_MAX];
+	size_t inlen;
+	char *out;
+	size_t outlen;
+	size_t outoff;
+	uint64_t out_ns;      /* last packet queued */
+	int inflight;
+	uint16_t mid;
+	uint64_t acked;
+};
+
+struct e2e_run {
+	const struct e2e_opts *opts;
+	int listen_sock;
+	char **topics;
+	char *payload;
+	uint64_t rng;
+	uint64_t sent;        /* measured messages */
+	uint64_t sent_bytes;
+	uint64_t acked;
+	uint64_t t0;          /* first measured message sent */
+	int error;
+};
+
+/* shared with the writing threads */
+static long e2e_count;
+static uint64_t *e2e_latency;
+static uint64_t e2e_delivered;
+static uint64_t e2e_delivered_bytes;
+static uint64_t e2e_warm_delivered;
+static uint64_t e2e_errors;
+static uint64_t e2e_last_ns;
+static int e2e_subscribed;
+static int e2e_stop;
+
+static void (*e2e_on_subscribe)(struct mosquitto *, void *, int, int, const int *);
+
+
+static void e2e_usage(void)
+{
+	fprintf(stderr, "Usage: bench_e2e [-n count] [-w warmup] [-T topics] [-d depth]\n");
+	fprintf(stderr, "                 [-s size | -s min:max[:log]] [-q qos] [-r rate] [-m inflight]\n");
+	fprintf(stderr, "                 [-i idle] [-b host[:port]] [-o file]\n");
+	fprintf(stderr, "                 -- <mosquitto_sub options>\n");
+	fprintf(stderr, " -n : messages to measure. Defaults to 100000.\n");
+	fprintf(stderr, " -w : messages sent before measuring, to create directories/files. Defaults to 1000.\n");
+	fprintf(stderr, " -T : number of distinct topics. Defaults to 100.\n");
+	fprintf(stderr, " -d : topic depth (levels). Defaults to 3.\n");
+	fprintf(stderr, " -s : payload size, fixed or uniform/log-uniform between min:max, at least %d.\n", E2E_STAMP_LEN);
+	fprintf(stderr, "      Defaults to 64.\n");
+	fprintf(stderr, " -q : qos of the messages and the subscription. Defaults to 0.\n");
+	fprintf(stderr, " -r : messages per second to send, 0 for as fast as they are taken. Defaults to 0.\n");
+	fprintf(stderr, " -m : QoS 1/2 messages in flight at most. Defaults to 20.\n");
+	fprintf(stderr, " -i : milliseconds without progress after which unwritten messages count as dropped.\n");
+	fprintf(stderr, "      Defaults to 2000.\n");
+	fprintf(stderr, " -b : go through the broker at host:port (port defaults to 1883) instead of\n");
+	fprintf(stderr, "      the built in stand-in.\n");
+	fprintf(stderr, " -o : append the JSON results to file instead of writing them to stdout.\n");
+}
+
+
+static int e2e_parse_opts(struct e2e_opts *opts, int argc, char *argv[], int *next)
+{
+	static char host[256];
+	char *colon;
+	int i;
+
+	for(i=1; i<argc; i++){
+		if(!strcmp(argv[i], "--")){
+			i++;
+			break;
+		}
+		if(i == argc-1){
+			e2e_usage();
+			return 1;
+		}
+		if(!strcmp(argv[i], "-n")){
+			opts->count = atol(argv[++i]);
+		}else if(!strcmp(argv[i], "-w")){
+			opts->warmup = atol(argv[++i]);
+		}else if(!strcmp(argv[i], "-T")){
+			opts->topics = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-d")){
+			opts->depth = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-s")){
+			if(bench_parse_size(&opts->size, argv[++i])) return 1;
+		}else if(!strcmp(argv[i], "-q")){
+			opts->qos = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-r")){
+			opts->rate = atol(argv[++i]);
+		}else if(!strcmp(argv[i], "-m")){
+			opts->inflight = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-i")){
+			opts->idle_ms = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-b")){
+			snprintf(host, sizeof(host), "%s", argv[++i]);
+			colon = strrchr(host, ':');
+			if(colon){
+				*colon = '\0';
+				opts->port = atoi(colon+1);
+			}
+			opts->host = host;
+		}else if(!strcmp(argv[i], "-o")){
+			opts->output = argv[++i];
+		}else{
+			e2e_usage();
+			return 1;
+		}
+	}
+	if(opts->count < 1 || opts->warmup < 0 || opts->topics < 1 || opts->depth < 1
+			|| opts->qos < 0 || opts->qos > 2 || opts->rate < 0 || opts->inflight < 1
+			|| opts->inflight > 65535 || opts->idle_ms < 1 || opts->port < 1 || opts->port > 65535){
+		e2e_usage();
+		return 1;
+	}
+	if(opts->size.min < E2E_STAMP_LEN){
+		fprintf(stderr, "Error: Payloads need at least %d bytes for the timestamp.\n", E2E_STAMP_LEN);
+		return 1;
+	}
+	*next = i;
+	return 0;
+}
+
+
+/* ------------------------------------------------------------- */
+/* hooks into mqtt-dirpub */
+
+/* A message left the output stage, rc as returned by it. */
+static void e2e_written(const struct mosquitto_message *message, int rc)
+{
+	const char *p = message->payload;
+	uint64_t now, sent = 0, last;
+	uint64_t i;
+	int k;
+
+	if(message->payloadlen < E2E_STAMP_LEN || (p[0] != 'M' && p[0] != 'W')){
+		/* not ours, e.g. a --rollup record */
+		return;
+	}
+	if(rc){
+		__atomic_add_fetch(&e2e_errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if(p[0] == 'W'){
+		__atomic_add_fetch(&e2e_warm_delivered, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	now = bench_now_ns();
+	for(k=1; k<E2E_STAMP_LEN; k++){
+		sent = sent << 4 | (uint64_t)(p[k] <= '9' ? p[k] - '0' : p[k] - 'a' + 10);
+	}
+	i = __atomic_fetch_add(&e2e_delivered, 1, __ATOMIC_RELAXED);
+	if(i < (uint64_t)e2e_count){
+		/* a QoS 1 redelivery may come on top */
+		e2e_latency[i] = now - sent;
+	}
+	__atomic_add_fetch(&e2e_delivered_bytes, (uint64_t)message->payloadlen, __ATOMIC_RELAXED);
+
+	last = __atomic_load_n(&e2e_last_ns, __ATOMIC_RELAXED);
+	while(now > last){
+		if(__atomic_compare_exchange_n(&e2e_last_ns, &last, now, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+			break;
+		}
+	}
+}
+
+int e2e_print_message(struct mosq_config *cfg, const struct mosquitto_message *message)
+{
+	int rc;
+
+	rc = print_message(cfg, message);
+	e2e_written(message, rc);
+	return rc;
+}
+
+int e2e_print_message_file(struct mosq_config *cfg, const struct mosquitto_message *message)
+{
+	int rc;
+
+	rc = print_message_file(cfg, message);
+	e2e_written(message, rc);
+	return rc;
+}
+
+static void e2e_subscribed_cb(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
+{
+	e2e_on_subscribe(mosq, obj, mid, qos_count, granted_qos);
+	__atomic_store_n(&e2e_subscribed, 1, __ATOMIC_RELEASE);
+}
+
+/* Sending starts once mqtt-dirpub has its SUBACK. */
+void e2e_subscribe_callback_set(struct mosquitto *mosq, void (*on_subscribe)(struct mosquitto *, void *, int, int, const int *))
+{
+	e2e_on_subscribe = on_subscribe;
+	mosquitto_subscribe_callback_set(mosq, e2e_subscribed_cb);
+}
+
+
+/* ------------------------------------------------------------- */
+/* MQTT packets */
+
+static size_t e2e_put_varint(char *buf, size_t len)
+{
+	size_t n = 0;
+
+	do{
+		buf[n] = (char)(len % 128);
+		len /= 128;
+		if(len) buf[n] |= (char)0x80;
+		n++;
+	}while(len);
+	return n;
+}
+
+static size_t e2e_put_u16(char *buf, unsigned int v)
+{
+	buf[0] = (char)(v >> 8);
+	buf[1] = (char)(v & 0xFF);
+	return 2;
+}
+
+/* Queue a packet of type with the variable header and payload in body. */
+static void e2e_packet(struct e2e_conn *conn, uint8_t type, const char *body, size_t len)
+{
+	char *p = conn->out + conn->outlen;
+
+	*p++ = (char)type;
+	p += e2e_put_varint(p, len);
+	memcpy(p, body, len);
+	conn->outlen = (size_t)(p - conn->out) + len;
+	conn->out_ns = bench_now_ns();
+}
+
+/* Queue a PUBLISH of the generated payload, stamped with the time and the
+ * phase, 'W' for warm up or 'M' measured. Returns 1 when the buffer is full. */
+static int e2e_publish(struct e2e_conn *conn, struct e2e_run *run, char phase, int *len)
+{
+	const struct e2e_opts *opts = run->opts;
+	const char *topic;
+	size_t tlen, rlen;
+	char *p;
+	int plen;
+
+	topic = run->topics[bench_rand(&run->rng) % (uint64_t)opts->topics];
+	tlen = strlen(topic);
+	plen = bench_pick_size(&opts->size, &run->rng);
+	rlen = 2 + tlen + (opts->qos ? 2 : 0) + (conn->version == 5 ? 1 : 0) + (size_t)plen;
+	if(conn->outlen + rlen + 5 > E2E_OUT_MAX){
+		return 1;
+	}
+
+	p = conn->out + conn->outlen;
+	*p++ = (char)(0x30 | opts->qos << 1);
+	p += e2e_put_varint(p, rlen);
+	p += e2e_put_u16(p, (unsigned int)tlen);
+	memcpy(p, topic, tlen);
+	p += tlen;
+	if(opts->qos){
+		if(++conn->mid == 0) conn->mid = 1;
+		p += e2e_put_u16(p, conn->mid);
+		conn->inflight++;
+	}
+	if(conn->version == 5){
+		*p++ = 0; /* no properties */
+	}
+	conn->out_ns = bench_now_ns();
+	snprintf(p, E2E_STAMP_LEN+1, "%c%016llx", phase, (unsigned long long)conn->out_ns);
+	memcpy(p + E2E_STAMP_LEN, run->payload, (size_t)plen - E2E_STAMP_LEN);
+	conn->outlen = (size_t)(p - conn->out) + (size_t)plen;
+	*len = plen;
+	return 0;
+}
+
+/* Handle one packet from mqtt-dirpub or the broker. */
+static int e2e_handle(struct e2e_conn *conn, uint8_t type, const char *body, size_t len)
+{
+	char reply[1024];
+	size_t n, pos;
+	unsigned int mid = 0;
+	unsigned int flen;
+
+	if(len >= 2){
+		mid = (unsigned int)((uint8_t)body[0] << 8 | (uint8_t)body[1]);
+	}
+	switch(type >> 4){
+		case 1: /* CONNECT, "MQTT" and the protocol level */
+			if(len < 7) return 1;
+			conn->version = (uint8_t)body[6] == 5 ? 5 : 4;
+			reply[0] = 0;
+			reply[1] = 0;
+			reply[2] = 0;
+			e2e_packet(conn, 0x20, reply, conn->version == 5 ? 3 : 2);
+			conn->connected = true;
+			break;
+		case 2: /* CONNACK */
+			if(len < 2 || body[1] != 0){
+				fprintf(stderr, "Error: The broker refused the connection (%d).\n", len < 2 ? -1 : (uint8_t)body[1]);
+				return 1;
+			}
+			conn->connected = true;
+			break;
+		case 4: /* PUBACK */
+		case 7: /* PUBCOMP */
+			conn->inflight--;
+			conn->acked++;
+			break;
+		case 5: /* PUBREC */
+			e2e_packet(conn, 0x62, body, 2);
+			break;
+		case 8: /* SUBSCRIBE, granted what was asked */
+			n = e2e_put_u16(reply, mid);
+			pos = 2;
+			if(conn->version == 5){
+				/* skip the properties */
+				flen = 0;
+				while(pos < len && (uint8_t)body[pos] & 0x80){
+					flen = (flen << 7) | ((uint8_t)body[pos++] & 0x7F);
+				}
+				pos += 1 + (flen << 7 | ((uint8_t)body[pos] & 0x7F));
+				reply[n++] = 0;
+			}
+			while(pos + 3 <= len && n < sizeof(reply)){
+				flen = (unsigned int)((uint8_t)body[pos] << 8 | (uint8_t)body[pos+1]);
+				pos += 2 + flen;
+				if(pos >= len) break;
+				reply[n++] = (char)((uint8_t)body[pos] & 0x03);
+				pos++;
+			}
+			e2e_packet(conn, 0x90, reply, n);
+			break;
+		case 12: /* PINGREQ */
+			e2e_packet(conn, 0xD0, NULL, 0);
+			break;
+		case 14: /* DISCONNECT */
+			conn->closed = true;
+			break;
+		default:
+			/* PINGRESP, UNSUBSCRIBE, ... */
+			break;
+	}
+	return 0;
+}
+
+/* Send what is queued and handle what arrived, waiting up to timeout_ms.
+ * Returns 1 once the connection is gone. */
+static int e2e_pump(struct e2e_conn *conn, int timeout_ms)
+{
+	struct pollfd pfd;
+	ssize_t n;
+	size_t pos, len, hdr;
+	int shift;
+
+	if(conn->closed){
+		return 1;
+	}
+	pfd.fd = conn->sock;
+	pfd.events = POLLIN | (conn->outoff < conn->outlen ? POLLOUT : 0);
+	pfd.revents = 0;
+	if(poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR){
+		return 1;
+	}
+
+	if(pfd.revents & POLLOUT){
+		n = send(conn->sock, conn->out + conn->outoff, conn->outlen - conn->outoff, MSG_NOSIGNAL);
+		if(n < 0 && errno != EAGAIN && errno != EINTR){
+			conn->closed = true;
+			return 1;
+		}
+		if(n > 0){
+			conn->outoff += (size_t)n;
+			if(conn->outoff == conn->outlen){
+				conn->outoff = conn->outlen = 0;
+			}
+		}
+	}
+
+	if(pfd.revents & (POLLIN | POLLHUP | POLLERR)){
+		n = recv(conn->sock, conn->in + conn->inlen, sizeof(conn->in) - conn->inlen, 0);
+		if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)){
+			conn->closed = true;
+			return 1;
+		}
+		if(n > 0){
+			conn->inlen += (size_t)n;
+		}
+	}
+
+	/* whole packets, keeping room for the replies */
+	pos = 0;
+	while(pos + 2 <= conn->inlen && conn->outlen + 2048 < E2E_OUT_MAX){
+		len = 0;
+		shift = 0;
+		hdr = 1;
+		do{
+			if(pos + hdr >= conn->inlen || hdr > 4){
+				goto partial;
+			}
+			len |= (size_t)((uint8_t)conn->in[pos + hdr] & 0x7F) << shift;
+			shift += 7;
+		}while((uint8_t)conn->in[pos + hdr++] & 0x80);
+		if(hdr + len > sizeof(conn->in)){
+			fprintf(stderr, "Error: Packet of %zu bytes too large.\n", len);
+			conn->closed = true;
+			return 1;
+		}
+		if(pos + hdr + len > conn->inlen){
+			break;
+		}
+		if(e2e_handle(conn, (uint8_t)conn->in[pos], conn->in + pos + hdr, len)){
+			conn->closed = true;
+			return 1;
+		}
+		pos += hdr + len;
+	}
+partial:
+	memmove(conn->in, conn->in + pos, conn->inlen - pos);
+	conn->inlen -= pos;
+	return conn->closed;
+}
+
+/* Connect as a publisher to the broker of -b. */
+static int e2e_connect(struct e2e_conn *conn, const struct e2e_opts *opts)
+{
+	struct addrinfo hints, *ai, *a;
+	char port[16];
+	char body[64];
+	size_t n;
+	int len;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%d", opts->port);
+	if(getaddrinfo(opts->host, port, &hints, &ai)){
+		fprintf(stderr, "Error: Unable to resolve %s.\n", opts->host);
+		return 1;
+	}
+	conn->sock = -1;
+	for(a=ai; a; a=a->ai_next){
+		conn->sock = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+		if(conn->sock < 0) continue;
+		if(connect(conn->sock, a->ai_addr, a->ai_addrlen) == 0) break;
+		close(conn->sock);
+		conn->sock = -1;
+	}
+	freeaddrinfo(ai);
+	if(conn->sock < 0){
+		fprintf(stderr, "Error: Unable to connect to %s:%d: %s.\n", opts->host, opts->port, strerror(errno));
+		return 1;
+	}
+
+	/* MQTT 3.1.1, clean session, keepalive 60 */
+	conn->version = 4;
+	n = e2e_put_u16(body, 4);
+	memcpy(body + n, "MQTT", 4);
+	n += 4;
+	body[n++] = 4;
+	body[n++] = 0x02;
+	n += e2e_put_u16(body + n, 60);
+	len = snprintf(body + n + 2, sizeof(body) - n - 2, "bench_e2e_%d", (int)getpid());
+	n += e2e_put_u16(body + n, (unsigned int)len) + (size_t)len;
+	e2e_packet(conn, 0x10, body, n);
+	return 0;
+}
+
+
+/* ------------------------------------------------------------- */
+/* the run */
+
+/* Pump until done() or, when idle is set, until nothing was written for
+ * idle milliseconds. Returns 1 if the connection is gone or the run was
+ * stopped. */
+static int e2e_wait(struct e2e_conn *conn, struct e2e_run *run, bool (*done)(struct e2e_conn *, struct e2e_run *), int idle_ms)
+{
+	uint64_t seen = UINT64_MAX, now, since = 0;
+	uint64_t progress;
+
+	while(!done(conn, run)){
+		if(e2e_pump(conn, 10) || __atomic_load_n(&e2e_stop, __ATOMIC_ACQUIRE)){
+			return 1;
+		}
+		now = bench_now_ns();
+		if(idle_ms){
+			progress = __atomic_load_n(&e2e_delivered, __ATOMIC_RELAXED)
+				+ __atomic_load_n(&e2e_warm_delivered, __ATOMIC_RELAXED)
+				+ __atomic_load_n(&e2e_errors, __ATOMIC_RELAXED) + conn->acked;
+			if(progress != seen){
+				seen = progress;
+				since = now;
+			}else if(now - since > (uint64_t)idle_ms * 1000000ULL){
+				return 0;
+			}
+		}
+		if(run->opts->host && conn->outlen == 0 && now - conn->out_ns > E2E_PING_NS){
+			e2e_packet(conn, 0xC0, NULL, 0);
+		}
+	}
+	return 0;
+}
+
+static bool e2e_ready(struct e2e_conn *conn, struct e2e_run *run)
+{
+	UNUSED(run);
+	return conn->connected && __atomic_load_n(&e2e_subscribed, __ATOMIC_ACQUIRE);
+}
+
+static bool e2e_warm(struct e2e_conn *conn, struct e2e_run *run)
+{
+	return conn->inflight == 0
+		&& __atomic_load_n(&e2e_warm_delivered, __ATOMIC_RELAXED) >= (uint64_t)run->opts->warmup;
+}
+
+static bool e2e_delivered_all(struct e2e_conn *conn, struct e2e_run *run)
+{
+	return conn->inflight == 0 && conn->outlen == 0
+		&& __atomic_load_n(&e2e_delivered, __ATOMIC_RELAXED) >= run->sent;
+}
+
+static bool e2e_never(struct e2e_conn *conn, struct e2e_run *run)
+{
+	UNUSED(conn);
+	UNUSED(run);
+	return false;
+}
+
+/* Send count messages of phase, at -r and within -m in flight. */
+static int e2e_send(struct e2e_conn *conn, struct e2e_run *run, char phase, long count)
+{
+	const struct e2e_opts *opts = run->opts;
+	uint64_t start, allowed;
+	long i = 0;
+	int len;
+
+	start = bench_now_ns();
+	while(i < count){
+		allowed = opts->rate ? (bench_now_ns() - start) * (uint64_t)opts->rate / 1000000000ULL + 1 : UINT64_MAX;
+		while(i < count && (uint64_t)i < allowed && (!opts->qos || conn->inflight < opts->inflight)){
+			if(e2e_publish(conn, run, phase, &len)){
+				break;
+			}
+			if(phase == 'M'){
+				if(i == 0) run->t0 = conn->out_ns;
+				run->sent++;
+				run->sent_bytes += (uint64_t)len;
+			}
+			i++;
+		}
+		if(e2e_pump(conn, opts->rate ? 1 : 10) || __atomic_load_n(&e2e_stop, __ATOMIC_ACQUIRE)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void *e2e_thread(void *obj)
+{
+	struct e2e_run *run = obj;
+	const struct e2e_opts *opts = run->opts;
+	struct e2e_conn *conn;
+	struct pollfd pfd;
+	uint64_t acked;
+	int one = 1;
+
+	conn = calloc(1, sizeof(struct e2e_conn));
+	if(!conn || !(conn->out = malloc(E2E_OUT_MAX))){
+		run->error = 1;
+		goto stop;
+	}
+	conn->sock = -1;
+
+	if(opts->host){
+		if(e2e_connect(conn, opts)){
+			run->error = 1;
+			goto stop;
+		}
+	}else{
+		pfd.fd = run->listen_sock;
+		pfd.events = POLLIN;
+		while(poll(&pfd, 1, 100) <= 0){
+			if(__atomic_load_n(&e2e_stop, __ATOMIC_ACQUIRE)) goto stop;
+		}
+		conn->sock = accept(run->listen_sock, NULL, NULL);
+		if(conn->sock < 0){
+			run->error = 1;
+			goto stop;
+		}
+	}
+	setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(conn->sock, F_SETFL, fcntl(conn->sock, F_GETFL) | O_NONBLOCK);
+
+	if(e2e_wait(conn, run, e2e_ready, 10000) || !e2e_ready(conn, run)){
+		fprintf(stderr, "Error: mqtt-dirpub did not connect and subscribe.\n");
+		run->error = 1;
+		goto stop;
+	}
+	if(e2e_send(conn, run, 'W', opts->warmup) || e2e_wait(conn, run, e2e_warm, opts->idle_ms)){
+		run->error = 1;
+		goto stop;
+	}
+	acked = conn->acked;
+	if(e2e_send(conn, run, 'M', opts->count) || e2e_wait(conn, run, e2e_delivered_all, opts->idle_ms)){
+		run->error = 1;
+		goto stop;
+	}
+	run->acked = conn->acked - acked;
+
+stop:
+	/* ends mqtt-dirpub's event loop, then wait for it to disconnect */
+	if(!__atomic_load_n(&e2e_stop, __ATOMIC_ACQUIRE)){
+		kill(getpid(), SIGTERM);
+	}
+	if(conn && conn->sock >= 0){
+		if(opts->host){
+			e2e_packet(conn, 0xE0, NULL, 0);
+			while(conn->outlen && !e2e_pump(conn, 100)){
+			}
+		}else{
+			e2e_wait(conn, run, e2e_never, 5000);
+		}
+		close(conn->sock);
+	}
+	if(conn){
+		free(conn->out);
+		free(conn);
+	}
+	return NULL;
+}
+
+
+/* ------------------------------------------------------------- */
+/* results */
+
+static int e2e_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double e2e_percentile(const uint64_t *sorted, uint64_t n, double pct)
+{
+	uint64_t i;
+
+	if(n == 0) return 0.0;
+	i = (uint64_t)(n * pct / 100.0 + 0.5);
+	if(i < 1) i = 1;
+	if(i > n) i = n;
+	return sorted[i-1] / 1000.0;
+}
+
+/* s escaped for a JSON string */
+static void e2e_json_escape(FILE *fptr, const char *s)
+{
+	for(; *s; s++){
+		if(*s == '"' || *s == '\\'){
+			fprintf(fptr, "\\%c", *s);
+		}else if((unsigned char)*s < 0x20){
+			fprintf(fptr, "\\u%04x", (unsigned char)*s);
+		}else{
+			fputc(*s, fptr);
+		}
+	}
+}
+
+static void e2e_report(FILE *fptr, const struct e2e_opts *opts, const struct e2e_run *run,
+		int argc, char *argv[], int next, int rc)
+{
+	uint64_t delivered, n, last;
+	double secs;
+	int i;
+
+	delivered = __atomic_load_n(&e2e_delivered, __ATOMIC_RELAXED);
+	last = __atomic_load_n(&e2e_last_ns, __ATOMIC_ACQUIRE);
+	n = delivered < (uint64_t)opts->count ? delivered : (uint64_t)opts->count;
+	qsort(e2e_latency, n, sizeof(uint64_t), e2e_cmp);
+	secs = last > run->t0 && delivered ? (last - run->t0) / 1e9 : 0.0;
+
+	fprintf(fptr, "{\"bench\":\"e2e\",\"time\":%lld,\"version\":\"%s\",\"broker\":",
+			(long long)time(NULL), VERSION);
+	if(opts->host){
+		fputc('"', fptr);
+		e2e_json_escape(fptr, opts->host);
+		fprintf(fptr, ":%d\"", opts->port);
+	}else{
+		fprintf(fptr, "\"stand-in\"");
+	}
+	fprintf(fptr, ",\"options\":\"");
+	for(i=next; i<argc; i++){
+		if(i > next) fputc(' ', fptr);
+		e2e_json_escape(fptr, argv[i]);
+	}
+	fputc('"', fptr);
+	fprintf(fptr, ",\"qos\":%d,\"messages\":%ld,\"warmup\":%ld,\"topics\":%d,\"depth\":%d"
+			",\"size_min\":%d,\"size_max\":%d,\"size_log\":%s,\"rate\":%ld,\"inflight\":%d",
+			opts->qos, opts->count, opts->warmup, opts->topics, opts->depth,
+			opts->size.min, opts->size.max, opts->size.log ? "true" : "false", opts->rate, opts->inflight);
+	fprintf(fptr, ",\"sent\":%llu,\"delivered\":%llu,\"errors\":%llu,\"acked\":%llu,\"drop_rate\":%.6f",
+			(unsigned long long)run->sent, (unsigned long long)delivered,
+			(unsigned long long)__atomic_load_n(&e2e_errors, __ATOMIC_RELAXED),
+			(unsigned long long)run->acked,
+			run->sent ? (run->sent > delivered ? (double)(run->sent - delivered) / run->sent : 0.0) : 1.0);
+	fprintf(fptr, ",\"elapsed_s\":%.6f,\"msgs_per_s\":%.1f,\"mb_per_s\":%.3f",
+			secs, secs > 0 ? delivered / secs : 0.0,
+			secs > 0 ? __atomic_load_n(&e2e_delivered_bytes, __ATOMIC_RELAXED) / secs / 1e6 : 0.0);
+	fprintf(fptr, ",\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p99_9\":%.1f,\"max\":%.1f}",
+			e2e_percentile(e2e_latency, n, 50.0), e2e_percentile(e2e_latency, n, 90.0),
+			e2e_percentile(e2e_latency, n, 99.0), e2e_percentile(e2e_latency, n, 99.9),
+			n ? e2e_latency[n-1] / 1000.0 : 0.0);
+	fprintf(fptr, ",\"status\":%d}\n", rc);
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct e2e_opts opts = { 100000, 1000, 100, 3, { 64, 64, false }, 0, 0, 20, 2000, NULL, 1883, NULL };
+	struct e2e_run run;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	pthread_t thread;
+	sigset_t sigs;
+	char port[16];
+	char qos[4];
+	char **cargv;
+	FILE *fptr;
+	int cargc;
+	int next;
+	int rc;
+	int i;
+
+	if(e2e_parse_opts(&opts, argc, argv, &next)){
+		return 1;
+	}
+
+	memset(&run, 0, sizeof(run));
+	run.opts = &opts;
+	run.listen_sock = -1;
+	run.rng = 0x9E3779B97F4A7C15ULL;
+	run.topics = bench_make_topics(opts.topics, opts.depth);
+	run.payload = malloc(opts.size.max + 1);
+	e2e_count = opts.count;
+	e2e_latency = calloc(opts.count, sizeof(uint64_t));
+	if(!run.topics || !run.payload || !e2e_latency){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	for(i=0; i<opts.size.max; i++){
+		run.payload[i] = (char)('a' + i % 26);
+	}
+
+	if(!opts.host){
+		run.listen_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if(run.listen_sock < 0
+				|| bind(run.listen_sock, (struct sockaddr *)&addr, sizeof(addr))
+				|| listen(run.listen_sock, 1)
+				|| getsockname(run.listen_sock, (struct sockaddr *)&addr, &addrlen)){
+			fprintf(stderr, "Error: Unable to listen on the loopback: %s.\n", strerror(errno));
+			return 1;
+		}
+		opts.port = ntohs(addr.sin_port);
+	}
+
+	/* mqtt-dirpub reads these from a signalfd, they must not reach the
+	 * stand-in's thread */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGALRM);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	cargv = calloc(argc - next + 10, sizeof(char *));
+	if(!cargv) return 1;
+	snprintf(port, sizeof(port), "%d", opts.port);
+	snprintf(qos, sizeof(qos), "%d", opts.qos);
+	cargc = 0;
+	cargv[cargc++] = argv[0];
+	cargv[cargc++] = "-h";
+	cargv[cargc++] = opts.host ? (char *)opts.host : "127.0.0.1";
+	cargv[cargc++] = "-p";
+	cargv[cargc++] = port;
+	cargv[cargc++] = "-t";
+	cargv[cargc++] = "bench/#";
+	cargv[cargc++] = "-q";
+	cargv[cargc++] = qos;
+	for(i=next; i<argc; i++){
+		cargv[cargc++] = argv[i];
+	}
+
+	if(pthread_create(&thread, NULL, e2e_thread, &run)){
+		fprintf(stderr, "Error: Unable to start thread.\n");
+		return 1;
+	}
+	rc = mqtt_dirpub_main(cargc, cargv);
+	__atomic_store_n(&e2e_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	if(run.error && !rc){
+		rc = 1;
+	}
+
+	fptr = opts.output ? fopen(opts.output, "a") : stdout;
+	if(!fptr){
+		fprintf(stderr, "Error: Unable to open %s: %s.\n", opts.output, strerror(errno));
+		return 1;
+	}
+	e2e_report(fptr, &opts, &run, argc, argv, next, rc);
+	if(fptr != stdout){
+		fclose(fptr);
+	}
+
+	if(run.listen_sock >= 0){
+		close(run.listen_sock);
+	}
+	bench_free_topics(run.topics, opts.topics);
+	free(run.payload);
+	free(e2e_latency);
+	free(cargv);
+	return rc;
+}
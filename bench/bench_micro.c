@@ -0,0 +1,210 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+/* Microbenchmarks of the hot path functions of sub_client_output.c.
+ *
+ * The output code is included directly so its static functions can be
+ * called with fixed inputs. Each benchmark reports ns/op, allocations/op
+ * and bytes allocated/op, to compare builds across mosquitto rebases.
+ *
+ * Build from mosquitto-<ver>/client/bench, next to the other sources:
+ *
+ *   cc -O2 -I.. -I../.. -I../../include -I../../lib -o bench_micro \
+ *      bench_micro.c ../sub_client_dedup.c ../sub_client_intern.c ../sub_client_stats.c \
+ *      ../client_shared.c ../client_props.c -lmosquitto
+ *
+ * Usage:
+ *   bench_micro [-t millisecs] [-d dir] [name ...]
+ */
+
+#include "../sub_client_output.c"
+
+#include "bench.h"
+#include "../sub_client_intern.h"
+
+struct mosq_config cfg;
+
+#define BENCH_MASK "@year/@month/@day/@topic/@hour@min"
+#define BENCH_FORMAT "%I %t %l %p"
+#define BENCH_TOPIC "site1/floor2/room3/sensor4/temperature"
+#define BENCH_PAYLOAD "{\"temp\":21.5,\"unit\":\"C\",\"ok\":true,\"note\":\"tab\\there\"}"
+
+struct bench_ctx {
+	struct mosquitto_message message;
+	char mask[256];
+	char token[64];
+	char dir[256];
+};
+
+struct bench_case {
+	const char *name;
+	void (*run)(struct bench_ctx *ctx);
+};
+
+
+static void bench_fmask(struct bench_ctx *ctx)
+{
+	render.topic = ctx->message.topic;
+	_fmask(&render, ctx->mask, &cfg, &ctx->message);
+}
+
+static void bench_setfmask(struct bench_ctx *ctx)
+{
+	char token[64];
+
+	/* _setfmask() tokenises in place */
+	memcpy(token, ctx->token, sizeof(token));
+	render.topic = ctx->message.topic;
+	render.path_len = 0;
+	_setfmask(&render, token, &cfg);
+}
+
+static void bench_datetime(struct bench_ctx *ctx)
+{
+	UNUSED(ctx);
+	datetime(&render, FMASK_DATETIME);
+}
+
+static void bench_mkpath(struct bench_ctx *ctx)
+{
+	mkpath(&render, ctx->dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+}
+
+static void bench_formatted_print(struct bench_ctx *ctx)
+{
+	formatted_print(stdout, &cfg, &ctx->message);
+}
+
+static void bench_write_json_payload(struct bench_ctx *ctx)
+{
+	write_json_payload(stdout, ctx->message.payload, ctx->message.payloadlen);
+}
+
+static void bench_write_payload_hex(struct bench_ctx *ctx)
+{
+	write_payload(stdout, ctx->message.payload, ctx->message.payloadlen, 1);
+}
+
+static void bench_dedup_message(struct bench_ctx *ctx)
+{
+	dedup_message(&ctx->message, intern_topic(ctx->message.topic));
+}
+
+static const struct bench_case cases[] = {
+	{"fmask", bench_fmask},
+	{"setfmask", bench_setfmask},
+	{"datetime", bench_datetime},
+	{"mkpath", bench_mkpath},
+	{"formatted_print", bench_formatted_print},
+	{"write_json_payload", bench_write_json_payload},
+	{"write_payload_hex", bench_write_payload_hex},
+	{"dedup_message", bench_dedup_message},
+};
+
+
+static void bench_case_run(const struct bench_case *bc, struct bench_ctx *ctx, long millisecs)
+{
+	struct bench_allocs a0, a1;
+	uint64_t t0, t1, deadline;
+	long iters = 0;
+	long batch = 64;
+	long i;
+
+	/* warm up: first directory creation, localtime() tz loading, ... */
+	for(i=0; i<batch; i++){
+		bc->run(ctx);
+		arena_reset(&render);
+	}
+
+	bench_allocs_get(&a0);
+	t0 = bench_now_ns();
+	deadline = t0 + (uint64_t)millisecs*1000000ULL;
+	do{
+		for(i=0; i<batch; i++){
+			bc->run(ctx);
+			/* as print_message_file() does once the message is written */
+			arena_reset(&render);
+		}
+		iters += batch;
+		t1 = bench_now_ns();
+	}while(t1 < deadline);
+	bench_allocs_get(&a1);
+
+	fprintf(stderr, "%-20s %12.1f %12.2f %12.1f\n", bc->name,
+			(double)(t1 - t0) / iters,
+			(double)(a1.count - a0.count) / iters,
+			(double)(a1.bytes - a0.bytes) / iters);
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct bench_ctx ctx;
+	const char *dir = "/tmp/dirpub-bench";
+	long millisecs = 500;
+	size_t c;
+	int first;
+	int i;
+
+	for(first=1; first<argc; first++){
+		if(!strcmp(argv[first], "-t") && first < argc-1){
+			millisecs = atol(argv[++first]);
+		}else if(!strcmp(argv[first], "-d") && first < argc-1){
+			dir = argv[++first];
+		}else{
+			break;
+		}
+	}
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.eol = true;
+	cfg.fmask = BENCH_MASK;
+	cfg.format = BENCH_FORMAT;
+	cfg.idtext = "bench";
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.message.mid = 1;
+	ctx.message.qos = 1;
+	ctx.message.topic = BENCH_TOPIC;
+	ctx.message.payload = BENCH_PAYLOAD;
+	ctx.message.payloadlen = strlen(BENCH_PAYLOAD);
+	snprintf(ctx.mask, sizeof(ctx.mask), "%s/" BENCH_MASK, dir);
+	snprintf(ctx.token, sizeof(ctx.token), "@hour@-@min");
+	snprintf(ctx.dir, sizeof(ctx.dir), "%s/a/b/c/d", dir);
+
+	/* the printing functions write to stdout */
+	if(!freopen("/dev/null", "w", stdout)){
+		perror("freopen");
+		return 1;
+	}
+
+	fprintf(stderr, "%-20s %12s %12s %12s\n", "benchmark", "ns/op", "allocs/op", "bytes/op");
+	for(c=0; c<sizeof(cases)/sizeof(cases[0]); c++){
+		if(first < argc){
+			for(i=first; i<argc; i++){
+				if(!strcmp(argv[i], cases[c].name)) break;
+			}
+			if(i == argc) continue;
+		}
+		/* _fmask() renders through -F when it is set */
+		cfg.format = strcmp(cases[c].name, "formatted_print") ? NULL : BENCH_FORMAT;
+		bench_case_run(&cases[c], &ctx, millisecs);
+	}
+	print_message_cleanup();
+	dedup_cleanup();
+	intern_cleanup();
+	return 0;
+}
@@ -0,0 +1,614 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+/* Broker-less benchmark of the message pipeline.
+ *
+ * Builds struct mosquitto_message instances in memory and feeds them to
+ * my_message_callback(), exactly as libmosquitto would, so the filter,
+ * --fmask expansion, mkpath and file writes are measured without any
+ * network in the way.
+ *
+ * Build from mosquitto-<ver>/client/bench, next to the other sources:
+ *
+ *   cc -O2 -I.. -I../.. -I../../include -I../../lib -o bench_pipeline \
+ *      bench_pipeline.c ../sub_client_output.c ../sub_client_queue.c \
+ *      ../sub_client_dedup.c ../sub_client_sample.c ../sub_client_rollup.c \
+ *      ../sub_client_intern.c ../sub_client_pool.c ../sub_client_affinity.c \
+ *      ../sub_client_capture.c ../sub_client_topk.c ../sub_client_stats.c \
+ *      ../client_shared.c ../client_props.c -lmosquitto -lm -lpthread -ldl
+ *
+ * Usage:
+ *   bench_pipeline [-n count] [-w warmup] [-T topics] [-d depth]
+ *                  [-s size | -s min:max[:log]] [-q qos] [-j threads] [-A max_allocs]
+ *                  [-S seconds [-I seconds] [-R rate] [-G bytes] [-F fds]]
+ *                  -- <mosquitto_sub options>
+ *
+ * Everything after "--" is parsed by client_config_load(), e.g.
+ *   bench_pipeline -n 200000 -T 1000 -s 16:4096 -- --fmask '/dev/shm/b/@topic' --overwrite
+ *   bench_pipeline -T 10 -- --fmask '/var/tmp/b/@year/@month/@topic' -v
+ *
+ * With -j the messages are spread over several threads calling the callback
+ * at once, which stress tests the reentrancy of print_message_file() and
+ * print_message(); run it under -fsanitize=thread to check for races.
+ *
+ * With --writers the callback only queues the messages. The generating
+ * threads then wait whenever the queue is above --queue-high, as the network
+ * thread would, and the measured run includes writing out the whole queue.
+ *
+ * With -A the exit status is 1 when the measured run made more than
+ * max_allocs heap allocations per message; "-A 0" checks that the steady
+ * state pipeline does not allocate at all.
+ *
+ * With -S the run is a soak test instead, generating messages for that many
+ * seconds while RSS, the heap in use (mallinfo2()) and the open fds are
+ * sampled every -I seconds. A least squares fit over the last two thirds of
+ * the samples, after the caches filled up, gives their growth per million
+ * messages; the exit status is 1 when memory grows by more than -G bytes or
+ * the fds by more than -F per million messages. -R runs the wall clock that
+ * many times faster, so the --fmask time buckets, and with them the path and
+ * directory caches, rotate within the run, e.g. a minute per second:
+ *   bench_pipeline -S 600 -R 60 -T 1000 -- --fmask '/dev/shm/s/@min/@topic' --overwrite
+ */
+
+#define main mqtt_dirpub_main
+#include "../sub_client.c"
+#undef main
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include "bench.h"
+
+#define BENCH_SOAK_CHUNK 10000
+
+struct bench_opts {
+	long count;
+	long warmup;
+	int topics;
+	int depth;
+	struct bench_size size;
+	int qos;
+	int threads;
+	double max_allocs;
+	int soak;             /* seconds, 0 for a measured run of count messages */
+	int interval;
+	double clock_rate;
+	double max_growth;    /* bytes per million messages */
+	double max_fds;
+};
+
+struct soak_sample {
+	double elapsed;
+	double messages;
+	double value[3];      /* rss, heap and fds */
+};
+
+struct bench_thread {
+	pthread_t thread;
+	const struct bench_opts *opts;
+	char **topics;
+	char *payload;
+	long warmup;
+	long count;
+	uint64_t rng;
+	uint64_t bytes;
+	pthread_barrier_t *start;
+};
+
+static const char *soak_names[2] = { "RSS", "heap" };
+static uint64_t soak_messages = 0;
+static int soak_stop = 0;
+
+static double clock_rate = 1.0;
+static uint64_t clock_base = 0;
+static int (*clock_gettime_real)(clockid_t clk, struct timespec *ts) = NULL;
+
+
+static void bench_usage(void)
+{
+	fprintf(stderr, "Usage: bench_pipeline [-n count] [-w warmup] [-T topics] [-d depth]\n");
+	fprintf(stderr, "                      [-s size | -s min:max[:log]] [-q qos] [-j threads] [-A max_allocs]\n");
+	fprintf(stderr, "                      [-S seconds [-I seconds] [-R rate] [-G bytes] [-F fds]]\n");
+	fprintf(stderr, "                      -- <mosquitto_sub options>\n");
+	fprintf(stderr, " -n : messages to measure. Defaults to 100000.\n");
+	fprintf(stderr, " -w : messages sent before measuring, to create directories/files. Defaults to 1000.\n");
+	fprintf(stderr, " -T : number of distinct topics. Defaults to 100.\n");
+	fprintf(stderr, " -d : topic depth (levels). Defaults to 3.\n");
+	fprintf(stderr, " -s : payload size, fixed or uniform/log-uniform between min:max. Defaults to 64.\n");
+	fprintf(stderr, " -q : qos of the generated messages. Defaults to 0.\n");
+	fprintf(stderr, " -j : number of threads handling messages concurrently. Defaults to 1.\n");
+	fprintf(stderr, " -A : fail if there are more than max_allocs allocations per message.\n");
+	fprintf(stderr, " -S : soak test for this many seconds instead of -n messages.\n");
+	fprintf(stderr, " -I : seconds between soak samples. Defaults to 1/30 of -S, at least 1.\n");
+	fprintf(stderr, " -R : run the wall clock this many times faster, to rotate time buckets. Defaults to 1.\n");
+	fprintf(stderr, " -G : fail if RSS or heap grow by more than this many bytes per million messages.\n");
+	fprintf(stderr, "      Defaults to 1048576.\n");
+	fprintf(stderr, " -F : fail if more than this many fds per million messages stay open. Defaults to 1.\n");
+}
+
+
+static int bench_parse_opts(struct bench_opts *opts, int argc, char *argv[], int *next)
+{
+	int i;
+
+	for(i=1; i<argc; i++){
+		if(!strcmp(argv[i], "--")){
+			i++;
+			break;
+		}
+		if(i == argc-1){
+			bench_usage();
+			return 1;
+		}
+		if(!strcmp(argv[i], "-n")){
+			opts->count = atol(argv[++i]);
+		}else if(!strcmp(argv[i], "-w")){
+			opts->warmup = atol(argv[++i]);
+		}else if(!strcmp(argv[i], "-T")){
+			opts->topics = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-d")){
+			opts->depth = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-s")){
+			if(bench_parse_size(&opts->size, argv[++i])) return 1;
+		}else if(!strcmp(argv[i], "-q")){
+			opts->qos = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-j")){
+			opts->threads = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-A")){
+			opts->max_allocs = atof(argv[++i]);
+		}else if(!strcmp(argv[i], "-S")){
+			opts->soak = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-I")){
+			opts->interval = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-R")){
+			opts->clock_rate = atof(argv[++i]);
+		}else if(!strcmp(argv[i], "-G")){
+			opts->max_growth = atof(argv[++i]);
+		}else if(!strcmp(argv[i], "-F")){
+			opts->max_fds = atof(argv[++i]);
+		}else{
+			bench_usage();
+			return 1;
+		}
+	}
+	if(opts->count < 1 || opts->warmup < 0 || opts->topics < 1 || opts->depth < 1
+			|| opts->qos < 0 || opts->qos > 2 || opts->threads < 1
+			|| opts->soak < 0 || opts->interval < 0 || opts->clock_rate <= 0){
+		bench_usage();
+		return 1;
+	}
+	*next = i;
+	return 0;
+}
+
+
+/* ------------------------------------------------------------- */
+/* soak clock
+ *
+ * The wall clock of the whole program, time() and CLOCK_REALTIME, runs
+ * clock_rate times faster from the start on (-R). CLOCK_MONOTONIC, and with
+ * it the measurements and --sample windows, is left alone. */
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec*1000000000ULL + (uint64_t)ts->tv_nsec;
+}
+
+int clock_gettime(clockid_t clk, struct timespec *ts)
+{
+	uint64_t ns;
+	int rc;
+
+	if(!clock_gettime_real){
+		clock_gettime_real = (int (*)(clockid_t, struct timespec *))dlsym(RTLD_NEXT, "clock_gettime");
+	}
+	rc = clock_gettime_real(clk, ts);
+	if(rc == 0 && clk == CLOCK_REALTIME && clock_rate != 1.0){
+		ns = clock_base + (uint64_t)((timespec_ns(ts) - clock_base) * clock_rate);
+		ts->tv_sec = (time_t)(ns / 1000000000ULL);
+		ts->tv_nsec = (long)(ns % 1000000000ULL);
+	}
+	return rc;
+}
+
+time_t time(time_t *t)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if(t){
+		*t = ts.tv_sec;
+	}
+	return ts.tv_sec;
+}
+
+static void bench_clock_init(double rate)
+{
+	struct timespec ts;
+
+	clock_rate = 1.0;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	clock_base = timespec_ns(&ts);
+	clock_rate = rate;
+}
+
+
+/* ------------------------------------------------------------- */
+
+static uint64_t bench_run(const struct bench_opts *opts, char **topics, char *payload, long count, uint64_t *rng)
+{
+	struct mosquitto_message message;
+	uint64_t bytes = 0;
+	long i;
+
+	memset(&message, 0, sizeof(message));
+	message.qos = opts->qos;
+
+	for(i=0; i<count; i++){
+		message.mid = (int)(i % 65535) + 1;
+		message.topic = topics[bench_rand(rng) % (uint64_t)opts->topics];
+		message.payload = payload;
+		message.payloadlen = bench_pick_size(&opts->size, rng);
+		bytes += (uint64_t)message.payloadlen;
+
+		my_message_callback(NULL, &cfg, &message, NULL);
+		while(cfg.writers && queue_paused()){
+			queue_wait(10);
+			queue_complete(message_written);
+		}
+	}
+	while(cfg.writers && !queue_idle()){
+		queue_wait(10);
+		queue_complete(message_written);
+	}
+	return bytes;
+}
+
+
+static void *bench_thread_run(void *obj)
+{
+	struct bench_thread *bt = obj;
+
+	bench_run(bt->opts, bt->topics, bt->payload, bt->warmup, &bt->rng);
+	pthread_barrier_wait(bt->start);
+	/* measured run */
+	pthread_barrier_wait(bt->start);
+	if(bt->opts->soak){
+		while(!__atomic_load_n(&soak_stop, __ATOMIC_RELAXED)){
+			bt->bytes += bench_run(bt->opts, bt->topics, bt->payload, BENCH_SOAK_CHUNK, &bt->rng);
+			__atomic_add_fetch(&soak_messages, BENCH_SOAK_CHUNK, __ATOMIC_RELAXED);
+		}
+	}else{
+		bt->bytes = bench_run(bt->opts, bt->topics, bt->payload, bt->count, &bt->rng);
+	}
+	print_message_cleanup();
+	pool_thread_flush();
+	return NULL;
+}
+
+
+/* ------------------------------------------------------------- */
+/* soak test */
+
+static double soak_rss(void)
+{
+	long size = 0, resident = 0;
+	FILE *fptr;
+
+	fptr = fopen("/proc/self/statm", "r");
+	if(!fptr) return 0.0;
+	if(fscanf(fptr, "%ld %ld", &size, &resident) != 2){
+		resident = 0;
+	}
+	fclose(fptr);
+	return (double)resident * sysconf(_SC_PAGESIZE);
+}
+
+static double soak_heap(void)
+{
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 mi = mallinfo2();
+#else
+	struct mallinfo mi = mallinfo();
+#endif
+
+	/* in use, from the arenas and mmap()ed */
+	return (double)mi.uordblks + (double)mi.hblkhd;
+}
+
+static double soak_fds(void)
+{
+	struct dirent *de;
+	DIR *dir;
+	int n = 0;
+
+	dir = opendir("/proc/self/fd");
+	if(!dir) return 0.0;
+	while((de = readdir(dir))){
+		if(de->d_name[0] != '.') n++;
+	}
+	closedir(dir);
+	/* not the one reading the directory */
+	return n - 1;
+}
+
+static void soak_take(struct soak_sample *sample, uint64_t t0)
+{
+	sample->elapsed = (bench_now_ns() - t0) / 1e9;
+	sample->messages = (double)__atomic_load_n(&soak_messages, __ATOMIC_RELAXED);
+	sample->value[0] = soak_rss();
+	sample->value[1] = soak_heap();
+	sample->value[2] = soak_fds();
+	fprintf(stderr, "%-10s %12.1f %12.0f %12.0f %12.0f %12.0f\n", "",
+			sample->elapsed, sample->messages,
+			sample->value[0] / 1024, sample->value[1] / 1024, sample->value[2]);
+}
+
+/* Sample until -S seconds passed, then stop the generating threads.
+ * Returns the number of samples. */
+static int bench_soak(const struct bench_opts *opts, uint64_t t0, struct soak_sample *samples, int max)
+{
+	struct timespec ts;
+	uint64_t next;
+	int interval;
+	int n = 0;
+
+	interval = opts->interval ? opts->interval : (opts->soak >= 60 ? opts->soak / 30 : 1);
+	fprintf(stderr, "%-10s %12s %12s %12s %12s %12s\n",
+			"soak", "elapsed(s)", "messages", "rss(KiB)", "heap(KiB)", "fds");
+	while(1){
+		soak_take(&samples[n++], t0);
+		if(n == max || samples[n-1].elapsed >= opts->soak){
+			break;
+		}
+		next = t0 + (uint64_t)n * (uint64_t)interval * 1000000000ULL;
+		if(next > t0 + (uint64_t)opts->soak * 1000000000ULL){
+			next = t0 + (uint64_t)opts->soak * 1000000000ULL;
+		}
+		ts.tv_sec = (time_t)(next / 1000000000ULL);
+		ts.tv_nsec = (long)(next % 1000000000ULL);
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR){
+		}
+	}
+	__atomic_store_n(&soak_stop, 1, __ATOMIC_RELAXED);
+	return n;
+}
+
+/* Least squares slope of value k per million messages. */
+static double soak_slope(const struct soak_sample *samples, int n, int k)
+{
+	double mx = 0, my = 0, sxy = 0, sxx = 0;
+	double dx;
+	int i;
+
+	for(i=0; i<n; i++){
+		mx += samples[i].messages / 1e6;
+		my += samples[i].value[k];
+	}
+	mx /= n;
+	my /= n;
+	for(i=0; i<n; i++){
+		dx = samples[i].messages / 1e6 - mx;
+		sxy += dx * (samples[i].value[k] - my);
+		sxx += dx * dx;
+	}
+	return sxx > 0 ? sxy / sxx : 0.0;
+}
+
+/* Fit the last two thirds of the samples, returns 1 on too much growth. */
+static int soak_check(const struct bench_opts *opts, const struct soak_sample *samples, int n)
+{
+	double slope[3];
+	double limit;
+	int from = n / 3;
+	int rc = 0;
+	int k;
+
+	if(n - from < 3){
+		fprintf(stderr, "Warning: %d soak samples are too few for a trend, run longer or lower -I.\n", n);
+		return 0;
+	}
+	for(k=0; k<3; k++){
+		slope[k] = soak_slope(samples + from, n - from, k);
+	}
+	fprintf(stderr, "%-10s %12s %12s %12s   (per million messages, last %d samples)\n",
+			"growth", "rss(KiB)", "heap(KiB)", "fds", n - from);
+	fprintf(stderr, "%-10s %12.1f %12.1f %12.2f\n", "", slope[0] / 1024, slope[1] / 1024, slope[2]);
+	for(k=0; k<3; k++){
+		limit = k == 2 ? opts->max_fds : opts->max_growth;
+		if(slope[k] <= limit){
+			continue;
+		}
+		if(k == 2){
+			fprintf(stderr, "Error: fds grow by %.2f per million messages, expected at most %.2f.\n",
+					slope[k], limit);
+		}else{
+			fprintf(stderr, "Error: %s grows by %.1f KiB per million messages, expected at most %.1f KiB.\n",
+					soak_names[k], slope[k] / 1024, limit / 1024);
+		}
+		rc = 1;
+	}
+	return rc;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct bench_opts opts = { 100000, 1000, 100, 3, { 64, 64, false }, 0, 1, -1, 0, 0, 1.0, 1048576, 1 };
+	struct soak_sample *samples = NULL;
+	int sample_count = 0;
+	uint64_t count;
+	struct bench_allocs a0, a1;
+	struct bench_thread *threads;
+	pthread_barrier_t start;
+	uint64_t sc0, sc1, t0, t1;
+	uint64_t bytes = 0;
+	char **topics;
+	char *payload;
+	char **cargv;
+	double secs;
+	double allocs;
+	int rc = 0;
+	int next;
+	int cargc;
+	int i;
+
+	if(bench_parse_opts(&opts, argc, argv, &next)){
+		return 1;
+	}
+	bench_clock_init(opts.clock_rate);
+
+	/* mosquitto_sub options; a subscription is mandatory there but unused here */
+	cargv = calloc(argc - next + 4, sizeof(char *));
+	if(!cargv) return 1;
+	cargc = 0;
+	cargv[cargc++] = argv[0];
+	cargv[cargc++] = "-t";
+	cargv[cargc++] = "#";
+	for(i=next; i<argc; i++){
+		cargv[cargc++] = argv[i];
+	}
+
+	mosquitto_lib_init();
+	if(client_config_load(&cfg, CLIENT_SUB, cargc, cargv)){
+		fprintf(stderr, "\nUse 'mosquitto_sub --help' to see usage.\n");
+		return 1;
+	}
+	cfg.idtext = "bench";
+	latency_enabled = cfg.latency;
+	if(cfg.profile){
+		profile_init();
+	}
+	topic_interning = cfg.sample_count || cfg.rollup_count || cfg.dedup == DEDUP_CONSECUTIVE;
+	if(topic_interning){
+		intern_init(&cfg);
+	}
+	sample_init(&cfg, write_released);
+	if(rollup_init(&cfg, write_unacked)){
+		return 1;
+	}
+	/* last, as in main() */
+	dedup_init(&cfg);
+	if(cfg.top_topics && topk_init(&cfg)){
+		return 1;
+	}
+	if(cfg.writers && queue_init(&cfg, cfg.fmask ? print_message_file : print_message)){
+		return 1;
+	}
+
+	topics = bench_make_topics(opts.topics, opts.depth);
+	payload = malloc(opts.size.max + 1);
+	if(!topics || !payload){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	for(i=0; i<opts.size.max; i++){
+		payload[i] = (char)('a' + i % 26);
+	}
+
+	bench_syscalls_init();
+
+	threads = calloc(opts.threads, sizeof(struct bench_thread));
+	if(!threads || pthread_barrier_init(&start, NULL, opts.threads + 1)){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	for(i=0; i<opts.threads; i++){
+		threads[i].opts = &opts;
+		threads[i].topics = topics;
+		threads[i].payload = payload;
+		threads[i].warmup = opts.warmup / opts.threads;
+		threads[i].count = opts.count / opts.threads + (i < opts.count % opts.threads);
+		threads[i].rng = 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1);
+		threads[i].start = &start;
+		if(pthread_create(&threads[i].thread, NULL, bench_thread_run, &threads[i])){
+			fprintf(stderr, "Error: Unable to start thread.\n");
+			return 1;
+		}
+	}
+	/* wait for the warm up of all threads */
+	pthread_barrier_wait(&start);
+
+	/* reading the syscall counters allocates, keep it out of the window */
+	sc0 = bench_syscalls_get();
+	bench_allocs_get(&a0);
+	t0 = bench_now_ns();
+
+	pthread_barrier_wait(&start);
+	if(opts.soak){
+		/* a sample per -I, and a few spare */
+		sample_count = opts.soak / (opts.interval ? opts.interval : 1) + 4;
+		samples = calloc(sample_count, sizeof(struct soak_sample));
+		if(!samples){
+			fprintf(stderr, "Error: Out of memory.\n");
+			return 1;
+		}
+		sample_count = bench_soak(&opts, t0, samples, sample_count);
+	}
+	for(i=0; i<opts.threads; i++){
+		pthread_join(threads[i].thread, NULL);
+		bytes += threads[i].bytes;
+	}
+
+	t1 = bench_now_ns();
+	bench_allocs_get(&a1);
+	sc1 = bench_syscalls_get();
+	sample_flush();
+	rollup_flush();
+
+	secs = (t1 - t0) / 1e9;
+	count = opts.soak ? soak_messages : (uint64_t)opts.count;
+	fprintf(stderr, "messages          %llu\n", (unsigned long long)count);
+	fprintf(stderr, "elapsed           %.3f s\n", secs);
+	fprintf(stderr, "msgs/s            %.0f\n", count / secs);
+	fprintf(stderr, "MB/s              %.2f\n", bytes / secs / 1e6);
+	fprintf(stderr, "syscalls/msg      %.2f (%s)\n", (double)(sc1 - sc0) / count, bench_syscalls_label());
+	allocs = (double)(a1.count - a0.count) / count;
+	fprintf(stderr, "allocs/msg        %.2f\n", allocs);
+	fprintf(stderr, "alloc bytes/msg   %.1f\n", (double)(a1.bytes - a0.bytes) / count);
+	if(cfg.latency || cfg.profile || cfg.writers || cfg.dedup || cfg.sample_count || cfg.rollup_count
+			|| cfg.top_topics){
+		stats_dump(stderr);
+	}
+	if(opts.max_allocs >= 0 && allocs > opts.max_allocs){
+		fprintf(stderr, "Error: %.2f allocations per message, expected at most %.2f.\n", allocs, opts.max_allocs);
+		rc = 1;
+	}
+	if(opts.soak && soak_check(&opts, samples, sample_count)){
+		rc = 1;
+	}
+	free(samples);
+
+	bench_free_topics(topics, opts.topics);
+	free(payload);
+	free(threads);
+	pthread_barrier_destroy(&start);
+	if(cfg.writers){
+		queue_stop(NULL);
+	}
+	topk_cleanup();
+	dedup_cleanup();
+	sample_cleanup();
+	rollup_cleanup();
+	intern_cleanup();
+	pool_cleanup();
+	free(cargv);
+	client_config_cleanup(&cfg);
+	mosquitto_lib_cleanup();
+	return rc;
+}
@@ -0,0 +1,311 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+/* Replay of a traffic capture (--capture) through the message pipeline.
+ *
+ * Feeds the recorded messages to my_message_callback(), like bench_pipeline
+ * does with generated ones, with their recorded topics, sizes, QoS and
+ * timing: at the speed they arrived, N times faster, or as fast as they are
+ * taken. Messages captured with --capture-hash get a payload generated from
+ * the hash, so equal payloads stay equal for --dedup; --rollup needs the
+ * real payloads.
+ *
+ * Build from mosquitto-<ver>/client/bench, next to the other sources:
+ *
+ *   cc -O2 -I.. -I../.. -I../../include -I../../lib -o bench_replay \
+ *      bench_replay.c ../sub_client_output.c ../sub_client_queue.c \
+ *      ../sub_client_dedup.c ../sub_client_sample.c ../sub_client_rollup.c \
+ *      ../sub_client_intern.c ../sub_client_pool.c ../sub_client_affinity.c \
+ *      ../sub_client_capture.c ../sub_client_topk.c ../sub_client_stats.c \
+ *      ../client_shared.c ../client_props.c -lmosquitto -lm -lpthread
+ *
+ * Usage:
+ *   bench_replay [-x speed] [-l loops] trace -- <mosquitto_sub options>
+ *
+ * e.g. capture an hour of production traffic, then compare builds on it:
+ *   mosquitto_sub -t 'site/#' --capture site.trace -W 3600 > /dev/null
+ *   bench_replay -x 0 site.trace -- --fmask '/dev/shm/r/@topic' --writers 2
+ *
+ * At a given speed, "max lag" is how far behind the recorded timing the
+ * pipeline fell; a growing lag means it can't keep up with that rate.
+ */
+
+#define main mqtt_dirpub_main
+#include "../sub_client.c"
+#undef main
+
+#include "bench.h"
+
+struct replay_opts {
+	double speed;         /* 0 for as fast as possible */
+	int loops;
+	const char *path;
+};
+
+
+static void replay_usage(void)
+{
+	fprintf(stderr, "Usage: bench_replay [-x speed] [-l loops] trace -- <mosquitto_sub options>\n");
+	fprintf(stderr, " -x : replay speed, 1 as recorded, 10 ten times faster, 0 as fast as possible.\n");
+	fprintf(stderr, "      Defaults to 1.\n");
+	fprintf(stderr, " -l : replay the trace this many times. Defaults to 1.\n");
+}
+
+
+static int replay_parse_opts(struct replay_opts *opts, int argc, char *argv[], int *next)
+{
+	int i;
+
+	for(i=1; i<argc; i++){
+		if(!strcmp(argv[i], "--")){
+			i++;
+			break;
+		}
+		if(!strcmp(argv[i], "-x") && i < argc-1){
+			opts->speed = atof(argv[++i]);
+		}else if(!strcmp(argv[i], "-l") && i < argc-1){
+			opts->loops = atoi(argv[++i]);
+		}else if(argv[i][0] != '-' && !opts->path){
+			opts->path = argv[i];
+		}else{
+			replay_usage();
+			return 1;
+		}
+	}
+	if(!opts->path || opts->speed < 0 || opts->loops < 1){
+		replay_usage();
+		return 1;
+	}
+	*next = i;
+	return 0;
+}
+
+
+/* Same hash, same bytes. */
+static void replay_payload(char *buf, int len, uint64_t hash)
+{
+	uint64_t rng = hash | 1;
+	int i;
+
+	for(i=0; i<len; i++){
+		buf[i] = (char)('a' + bench_rand(&rng) % 26);
+	}
+	buf[len] = '\0';
+}
+
+
+/* Wait until the recorded time of a message, handling completions of the
+ * writers meanwhile. */
+static void replay_wait(uint64_t target)
+{
+	struct timespec ts;
+	uint64_t now;
+
+	while((now = bench_now_ns()) < target){
+		if(cfg.writers){
+			queue_wait((int)((target - now) / 1000000ULL) + 1);
+			queue_complete(message_written);
+		}else{
+			ts.tv_sec = (time_t)(target / 1000000000ULL);
+			ts.tv_nsec = (long)(target % 1000000000ULL);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+	}
+}
+
+
+/* One pass over the trace. */
+static int replay_run(const struct replay_opts *opts, uint64_t *count, uint64_t *bytes, uint64_t *lag, uint64_t *duration_us)
+{
+	struct capture_reader *reader;
+	struct capture_record record;
+	struct mosquitto_message message;
+	char *generated = NULL;
+	int generated_size = 0;
+	uint64_t start, target, now;
+	int rc;
+
+	reader = capture_reader_open(opts->path);
+	if(!reader){
+		return 1;
+	}
+	memset(&message, 0, sizeof(message));
+	start = bench_now_ns();
+
+	while((rc = capture_read(reader, &record)) == 0){
+		if(opts->speed > 0){
+			target = start + (uint64_t)(record.time_us * 1000.0 / opts->speed);
+			now = bench_now_ns();
+			if(now < target){
+				replay_wait(target);
+			}else if(now - target > *lag){
+				*lag = now - target;
+			}
+		}
+
+		message.mid = (int)(*count % 65535) + 1;
+		message.topic = (char *)record.topic;
+		message.qos = record.qos;
+		message.retain = record.retain;
+		message.payloadlen = record.payloadlen;
+		if(record.payload){
+			message.payload = (void *)record.payload;
+		}else{
+			if(record.payloadlen >= generated_size){
+				free(generated);
+				generated_size = record.payloadlen + 1;
+				generated = malloc(generated_size);
+				if(!generated){
+					fprintf(stderr, "Error: Out of memory.\n");
+					capture_reader_close(reader);
+					return 1;
+				}
+			}
+			replay_payload(generated, record.payloadlen, record.hash);
+			message.payload = generated;
+		}
+		*bytes += (uint64_t)record.payloadlen;
+		(*count)++;
+		*duration_us = record.time_us;
+
+		my_message_callback(NULL, &cfg, &message, NULL);
+		while(cfg.writers && queue_paused()){
+			queue_wait(10);
+			queue_complete(message_written);
+		}
+	}
+	free(generated);
+	capture_reader_close(reader);
+	if(rc < 0){
+		fprintf(stderr, "Error: %s is truncated or corrupt after %llu messages.\n",
+				opts->path, (unsigned long long)*count);
+		return 1;
+	}
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct replay_opts opts = { 1.0, 1, NULL };
+	struct bench_allocs a0, a1;
+	uint64_t sc0, sc1, t0, t1;
+	uint64_t count = 0, bytes = 0, lag = 0, duration_us = 0;
+	char **cargv;
+	double secs;
+	int rc = 0;
+	int next;
+	int cargc;
+	int i;
+
+	if(replay_parse_opts(&opts, argc, argv, &next)){
+		return 1;
+	}
+
+	/* mosquitto_sub options; a subscription is mandatory there but unused here */
+	cargv = calloc(argc - next + 4, sizeof(char *));
+	if(!cargv) return 1;
+	cargc = 0;
+	cargv[cargc++] = argv[0];
+	cargv[cargc++] = "-t";
+	cargv[cargc++] = "#";
+	for(i=next; i<argc; i++){
+		cargv[cargc++] = argv[i];
+	}
+
+	mosquitto_lib_init();
+	if(client_config_load(&cfg, CLIENT_SUB, cargc, cargv)){
+		fprintf(stderr, "\nUse 'mosquitto_sub --help' to see usage.\n");
+		return 1;
+	}
+	if(cfg.capture){
+		fprintf(stderr, "Error: --capture while replaying would overwrite traces.\n");
+		return 1;
+	}
+	cfg.idtext = "replay";
+	latency_enabled = cfg.latency;
+	if(cfg.profile){
+		profile_init();
+	}
+	topic_interning = cfg.sample_count || cfg.rollup_count || cfg.dedup == DEDUP_CONSECUTIVE;
+	if(topic_interning){
+		intern_init(&cfg);
+	}
+	sample_init(&cfg, write_released);
+	if(rollup_init(&cfg, write_unacked)){
+		return 1;
+	}
+	/* last, as in main() */
+	dedup_init(&cfg);
+	if(cfg.top_topics && topk_init(&cfg)){
+		return 1;
+	}
+	if(cfg.writers && queue_init(&cfg, cfg.fmask ? print_message_file : print_message)){
+		return 1;
+	}
+
+	bench_syscalls_init();
+	sc0 = bench_syscalls_get();
+	bench_allocs_get(&a0);
+	t0 = bench_now_ns();
+
+	for(i=0; i<opts.loops && rc == 0; i++){
+		rc = replay_run(&opts, &count, &bytes, &lag, &duration_us);
+	}
+	while(cfg.writers && !queue_idle()){
+		queue_wait(10);
+		queue_complete(message_written);
+	}
+
+	t1 = bench_now_ns();
+	bench_allocs_get(&a1);
+	sc1 = bench_syscalls_get();
+	sample_flush();
+	rollup_flush();
+
+	secs = (t1 - t0) / 1e9;
+	if(count){
+		fprintf(stderr, "messages          %llu\n", (unsigned long long)count);
+		fprintf(stderr, "recorded          %.3f s\n", duration_us / 1e6);
+		fprintf(stderr, "elapsed           %.3f s\n", secs);
+		fprintf(stderr, "msgs/s            %.0f\n", count / secs);
+		fprintf(stderr, "MB/s              %.2f\n", bytes / secs / 1e6);
+		if(opts.speed > 0){
+			fprintf(stderr, "max lag           %.3f ms\n", lag / 1e6);
+		}
+		fprintf(stderr, "syscalls/msg      %.2f (%s)\n", (double)(sc1 - sc0) / count, bench_syscalls_label());
+		fprintf(stderr, "allocs/msg        %.2f\n", (double)(a1.count - a0.count) / count);
+		if(cfg.latency || cfg.profile || cfg.writers || cfg.dedup || cfg.sample_count
+				|| cfg.rollup_count || cfg.top_topics){
+			stats_dump(stderr);
+		}
+	}
+
+	if(cfg.writers){
+		queue_stop(NULL);
+	}
+	print_message_cleanup();
+	topk_cleanup();
+	dedup_cleanup();
+	sample_cleanup();
+	rollup_cleanup();
+	intern_cleanup();
+	pool_cleanup();
+	free(cargv);
+	client_config_cleanup(&cfg);
+	mosquitto_lib_cleanup();
+	return rc;
+}
@@ -20,7 +20,9 @@ Contributors:
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -124,6 +126,163 @@ static int check_format(const char *str)
 }
 
 
+static int parse_bytes(const char *str, size_t *bytes)
+{
+	char *end;
+	unsigned long long b;
+
+	b = strtoull(str, &end, 10);
+	if(end == str || str[0] == '-' || b >= SIZE_MAX){
+		return 1;
+	}
+	*bytes = (size_t)b;
+	return *end != '\0';
+}
+
+
+/* "messages[:bytes]", a zero means no limit on that count */
+static int parse_watermark(const char *str, int *msgs, size_t *bytes)
+{
+	char *end;
+	long n;
+
+	n = strtol(str, &end, 10);
+	if(end == str || n < 0 || n > INT_MAX){
+		return 1;
+	}
+	*msgs = (int)n;
+	if(*end == ':'){
+		return parse_bytes(end+1, bytes);
+	}
+	return *end != '\0';
+}
+
+
+/* "0-3,8,10-11" as a list of cpus, below the glibc cpu_set_t size */
+static int parse_cpus(const char *str, int **cpus, int *count)
+{
+	const char *p = str;
+	char *end;
+	long first, last, c;
+	int *list;
+
+	free(*cpus);
+	*cpus = NULL;
+	*count = 0;
+	while(1){
+		first = strtol(p, &end, 10);
+		if(end == p || *p == '-' || first >= 1024){
+			return 1;
+		}
+		last = first;
+		if(*end == '-'){
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if(end == p || *p == '-' || last >= 1024 || last < first){
+				return 1;
+			}
+		}
+		for(c=first; c<=last; c++){
+			list = realloc(*cpus, (size_t)(*count + 1)*sizeof(int));
+			if(!list){
+				return 1;
+			}
+			*cpus = list;
+			(*cpus)[(*count)++] = (int)c;
+		}
+		if(*end == '\0'){
+			return 0;
+		}
+		if(*end != ','){
+			return 1;
+		}
+		p = end + 1;
+	}
+}
+
+
+/* A window in seconds, or milliseconds with an "ms" suffix, up to the next
+ * ':' */
+static int parse_window(const char *str, uint64_t *ns, const char **end)
+{
+	char *p;
+	unsigned long long n;
+
+	n = strtoull(str, &p, 10);
+	if(p == str || str[0] == '-' || n == 0 || n > 1000000000ULL){
+		return 1;
+	}
+	if(!strncmp(p, "ms", 2)){
+		*ns = n*1000000ULL;
+		p += 2;
+	}else{
+		if(*p == 's'){
+			p++;
+		}
+		*ns = n*1000000000ULL;
+	}
+	*end = p;
+	return *p != ':';
+}
+
+
+/* ":filter", the end of --sample and --rollup rules */
+static int parse_rule_filter(const char *str, char **filter)
+{
+	if(*str != ':' || str[1] == '\0'){
+		return 1;
+	}
+	if(mosquitto_sub_topic_check(str+1) == MOSQ_ERR_INVAL){
+		return 1;
+	}
+	*filter = strdup(str+1);
+	return *filter == NULL;
+}
+
+
+/* "first:window:filter", "last:window:filter" or "nth:N:filter" */
+static int parse_sample(const char *str, struct sample_rule *rule)
+{
+	char *p;
+	const char *end;
+	unsigned long long n;
+
+	if(!strncmp(str, "first:", 6)){
+		rule->mode = SAMPLE_FIRST;
+	}else if(!strncmp(str, "last:", 5)){
+		rule->mode = SAMPLE_LAST;
+	}else if(!strncmp(str, "nth:", 4)){
+		rule->mode = SAMPLE_NTH;
+	}else{
+		return 1;
+	}
+	str = strchr(str, ':') + 1;
+	if(rule->mode == SAMPLE_NTH){
+		n = strtoull(str, &p, 10);
+		if(p == str || str[0] == '-' || n == 0){
+			return 1;
+		}
+		rule->arg = n;
+		end = p;
+	}else if(parse_window(str, &rule->arg, &end)){
+		return 1;
+	}
+	return parse_rule_filter(end, &rule->filter);
+}
+
+
+/* "window:filter" */
+static int parse_rollup(const char *str, struct rollup_rule *rule)
+{
+	const char *end;
+
+	if(parse_window(str, &rule->window, &end)){
+		return 1;
+	}
+	return parse_rule_filter(end, &rule->filter);
+}
+
+
 void init_config(struct mosq_config *cfg, int pub_or_sub)
 {
 	memset(cfg, 0, sizeof(*cfg));
@@ -144,6 +303,11 @@ void init_config(struct mosq_config *cfg, int pub_or_sub)
 	cfg->session_expiry_interval = -1; /* -1 means unset here, the user can't set it to -1. */
 	cfg->isfmask = false;
 	cfg->overwrite = false;
+	cfg->queue_high = 10000;
+	cfg->queue_high_bytes = 64*1024*1024;
+	cfg->queue_low = -1;
+	cfg->queue_low_bytes = SIZE_MAX;
+	cfg->topic_memory = 64*1024*1024;
 }
 
 void client_config_cleanup(struct mosq_config *cfg)
@@ -190,6 +354,21 @@ void client_config_cleanup(struct mosq_config *cfg)
 		}
 		free(cfg->filter_outs);
 	}
+	if(cfg->samples){
+		for(i=0; i<cfg->sample_count; i++){
+			free(cfg->samples[i].filter);
+		}
+		free(cfg->samples);
+	}
+	if(cfg->rollups){
+		for(i=0; i<cfg->rollup_count; i++){
+			free(cfg->rollups[i].filter);
+		}
+		free(cfg->rollups);
+	}
+	free(cfg->rollup_field);
+	free(cfg->cpu_network);
+	free(cfg->cpu_writers);
 	if(cfg->unsub_topics){
 		for(i=0; i<cfg->unsub_topic_count; i++){
 			free(cfg->unsub_topics[i]);
@@ -207,10 +386,6 @@ void client_config_cleanup(struct mosq_config *cfg)
 	mosquitto_property_free_all(&cfg->unsubscribe_props);
 	mosquitto_property_free_all(&cfg->disconnect_props);
 	mosquitto_property_free_all(&cfg->will_props);
-
-	//free(cfg->ffmask);
-	//free(cfg->ftoken);
-	free(cfg->fmask_topic);
 }
 
 int client_config_load(struct mosq_config *cfg, int pub_or_sub, int argc, char *argv[])
@@ -389,6 +564,61 @@ int client_config_load(struct mosq_config *cfg, int pub_or_sub, int argc, char *
 		}
 	}
 
+	if(cfg->receive_maximum && cfg->protocol_version != MQTT_PROTOCOL_V5){
+		fprintf(stderr, "Error: --receive-maximum requires MQTT v5 (-V mqttv5).\n");
+		return 1;
+	}
+
+	if(cfg->ack_after_write && cfg->qos == 2){
+		/* PUBREC goes out on receipt, the broker then only resends PUBREL */
+		fprintf(stderr, "Error: --ack-after-write cannot protect QoS 2 messages, subscribe with -q 1.\n");
+		return 1;
+	}
+	if(cfg->spill_dir && !cfg->writers){
+		fprintf(stderr, "Error: --spill needs --writers.\n");
+		return 1;
+	}
+	if(cfg->dedup == DEDUP_OVERWRITE && (!cfg->fmask || !cfg->overwrite)){
+		fprintf(stderr, "Error: --dedup overwrite needs --fmask and --overwrite.\n");
+		return 1;
+	}
+	if(cfg->direct && !cfg->fmask){
+		fprintf(stderr, "Error: --direct needs --fmask.\n");
+		return 1;
+	}
+	if((cfg->rollup_field || cfg->rollup_raw) && !cfg->rollup_count){
+		fprintf(stderr, "Error: --rollup-field and --rollup-raw need --rollup.\n");
+		return 1;
+	}
+	if(cfg->capture_hash && !cfg->capture){
+		fprintf(stderr, "Error: --capture-hash needs --capture.\n");
+		return 1;
+	}
+	if(cfg->top_interval && !cfg->top_topics){
+		fprintf(stderr, "Error: --top-interval needs --top-topics.\n");
+		return 1;
+	}
+	if(cfg->cpu_writers && !cfg->writers){
+		fprintf(stderr, "Error: --cpu-writers needs --writers.\n");
+		return 1;
+	}
+	if(cfg->writers > 1 && !cfg->fmask){
+		fprintf(stderr, "Error: More than one writer needs --fmask, stdout output is written in order.\n");
+		return 1;
+	}
+	/* resume reading at half the high watermark unless told otherwise */
+	if(cfg->queue_low < 0){
+		cfg->queue_low = cfg->queue_high / 2;
+	}
+	if(cfg->queue_low_bytes == SIZE_MAX){
+		cfg->queue_low_bytes = cfg->queue_high_bytes / 2;
+	}
+	if((cfg->queue_high && cfg->queue_low > cfg->queue_high)
+			|| (cfg->queue_high_bytes && cfg->queue_low_bytes > cfg->queue_high_bytes)){
+		fprintf(stderr, "Error: The --queue-low watermark must be below --queue-high.\n");
+		return 1;
+	}
+
 	if(!cfg->host){
 		cfg->host = strdup("localhost");
 		if(!cfg->host){
@@ -469,6 +699,7 @@ int cfg_add_topic(struct mosq_config *cfg, int type, char *topic, const char *ar
 int client_config_line_proc(struct mosq_config *cfg, int pub_or_sub, int argc, char *argv[])
 {
 	int i;
+	int rc;
 	float f;
 
 	for(i=1; i<argc; i++){
@@ -500,6 +731,227 @@ int client_config_line_proc(struct mosq_config *cfg, int pub_or_sub, int argc, c
 			i++;
 		}else if(!strcmp(argv[i], "--overwrite")){
 			cfg->overwrite = true;
+		}else if(!strcmp(argv[i], "--fsync")){
+			cfg->fsync = true;
+		}else if(!strcmp(argv[i], "--direct")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: --direct argument given but no size specified.\n\n");
+				return 1;
+			}else{
+#ifndef O_DIRECT
+				fprintf(stderr, "Error: --direct is not supported on this platform.\n\n");
+				return 1;
+#else
+				if(parse_bytes(argv[i+1], &cfg->direct) || cfg->direct == 0){
+					fprintf(stderr, "Error: Invalid --direct size \"%s\", expected bytes.\n\n", argv[i+1]);
+					return 1;
+				}
+#endif
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--latency")){
+			cfg->latency = true;
+		}else if(!strcmp(argv[i], "--profile")){
+			cfg->profile = true;
+		}else if(!strcmp(argv[i], "--capture")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: --capture argument given but no file specified.\n\n");
+				return 1;
+			}else{
+				cfg->capture = argv[i+1];
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--capture-hash")){
+			cfg->capture_hash = true;
+		}else if(!strcmp(argv[i], "--top-topics")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: --top-topics argument given but no count specified.\n\n");
+				return 1;
+			}else{
+				cfg->top_topics = atoi(argv[i+1]);
+				if(cfg->top_topics < 1 || cfg->top_topics > TOP_TOPICS_MAX){
+					fprintf(stderr, "Error: Invalid --top-topics count \"%s\", must be 1-%d.\n\n", argv[i+1], TOP_TOPICS_MAX);
+					return 1;
+				}
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--top-interval")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: --top-interval argument given but no interval specified.\n\n");
+				return 1;
+			}else{
+				cfg->top_interval = atoi(argv[i+1]);
+				if(cfg->top_interval < 1){
+					fprintf(stderr, "Error: Invalid --top-interval \"%s\", expected seconds.\n\n", argv[i+1]);
+					return 1;
+				}
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--ack-after-write")){
+#if LIBMOSQUITTO_MAJOR >= 2
+			cfg->ack_after_write = true;
+#else
+			fprintf(stderr, "Error: --ack-after-write requires libmosquitto 2.0 or later.\n\n");
+			return 1;
+#endif
+		}else if(!strcmp(argv[i], "--writers")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: --writers argument given but no value specified.\n\n");
+				return 1;
+			}else{
+#ifdef WIN32
+				fprintf(stderr, "Error: --writers is not supported on Windows.\n\n");
+				return 1;
+#else
+				cfg->writers = atoi(argv[i+1]);
+				if(cfg->writers < 0 || cfg->writers > 64){
+					fprintf(stderr, "Error: Invalid writer count \"%d\", must be 0-64.\n\n", cfg->writers);
+					return 1;
+				}
+#endif
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--spill")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: --spill argument given but no directory specified.\n\n");
+				return 1;
+			}else{
+				cfg->spill_dir = argv[i+1];
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--spill-max")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: --spill-max argument given but no size specified.\n\n");
+				return 1;
+			}else{
+				if(parse_bytes(argv[i+1], &cfg->spill_max)){
+					fprintf(stderr, "Error: Invalid --spill-max size \"%s\", expected bytes.\n\n", argv[i+1]);
+					return 1;
+				}
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--sample")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: --sample argument given but no rule specified.\n\n");
+				return 1;
+			}else{
+				cfg->sample_count++;
+				cfg->samples = realloc(cfg->samples, cfg->sample_count*sizeof(struct sample_rule));
+				if(!cfg->samples){
+					fprintf(stderr, "Error: Out of memory.\n");
+					return 1;
+				}
+				memset(&cfg->samples[cfg->sample_count-1], 0, sizeof(struct sample_rule));
+				if(parse_sample(argv[i+1], &cfg->samples[cfg->sample_count-1])){
+					fprintf(stderr, "Error: Invalid --sample rule \"%s\", expected first:window:filter, last:window:filter or nth:N:filter.\n\n", argv[i+1]);
+					return 1;
+				}
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--rollup")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: --rollup argument given but no rule specified.\n\n");
+				return 1;
+			}else{
+				cfg->rollup_count++;
+				cfg->rollups = realloc(cfg->rollups, cfg->rollup_count*sizeof(struct rollup_rule));
+				if(!cfg->rollups){
+					fprintf(stderr, "Error: Out of memory.\n");
+					return 1;
+				}
+				memset(&cfg->rollups[cfg->rollup_count-1], 0, sizeof(struct rollup_rule));
+				if(parse_rollup(argv[i+1], &cfg->rollups[cfg->rollup_count-1])){
+					fprintf(stderr, "Error: Invalid --rollup rule \"%s\", expected window:filter.\n\n", argv[i+1]);
+					return 1;
+				}
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--rollup-field")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: --rollup-field argument given but no field specified.\n\n");
+				return 1;
+			}else{
+				free(cfg->rollup_field);
+				cfg->rollup_field = strdup(argv[i+1]);
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--rollup-raw")){
+			cfg->rollup_raw = true;
+		}else if(!strcmp(argv[i], "--cpu-network") || !strcmp(argv[i], "--cpu-writers")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: %s argument given but no cpus specified.\n\n", argv[i]);
+				return 1;
+			}else{
+#ifndef __linux__
+				fprintf(stderr, "Error: %s is not supported on this platform.\n\n", argv[i]);
+				return 1;
+#else
+				if(!strcmp(argv[i], "--cpu-network")){
+					rc = parse_cpus(argv[i+1], &cfg->cpu_network, &cfg->cpu_network_count);
+				}else{
+					rc = parse_cpus(argv[i+1], &cfg->cpu_writers, &cfg->cpu_writers_count);
+				}
+				if(rc){
+					fprintf(stderr, "Error: Invalid %s cpu list \"%s\", expected e.g. 0-3,8.\n\n", argv[i], argv[i+1]);
+					return 1;
+				}
+#endif
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--topic-memory")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: --topic-memory argument given but no size specified.\n\n");
+				return 1;
+			}else{
+				if(parse_bytes(argv[i+1], &cfg->topic_memory)){
+					fprintf(stderr, "Error: Invalid --topic-memory size \"%s\", expected bytes.\n\n", argv[i+1]);
+					return 1;
+				}
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--dedup")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: --dedup argument given but no mode specified.\n\n");
+				return 1;
+			}else{
+				if(!strcmp(argv[i+1], "consecutive")){
+					cfg->dedup = DEDUP_CONSECUTIVE;
+				}else if(!strcmp(argv[i+1], "overwrite")){
+					cfg->dedup = DEDUP_OVERWRITE;
+				}else{
+					fprintf(stderr, "Error: Invalid --dedup mode \"%s\", expected consecutive or overwrite.\n\n", argv[i+1]);
+					return 1;
+				}
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--queue-high") || !strcmp(argv[i], "--queue-low")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: %s argument given but no value specified.\n\n", argv[i]);
+				return 1;
+			}else{
+				if(!strcmp(argv[i], "--queue-high")){
+					rc = parse_watermark(argv[i+1], &cfg->queue_high, &cfg->queue_high_bytes);
+				}else{
+					rc = parse_watermark(argv[i+1], &cfg->queue_low, &cfg->queue_low_bytes);
+				}
+				if(rc){
+					fprintf(stderr, "Error: Invalid %s watermark \"%s\", expected messages[:bytes].\n\n", argv[i], argv[i+1]);
+					return 1;
+				}
+			}
+			i++;
+		}else if(!strcmp(argv[i], "--receive-maximum")){
+			if(i==argc-1){
+				fprintf(stderr, "Error: --receive-maximum argument given but no value specified.\n\n");
+				return 1;
+			}else{
+				cfg->receive_maximum = atoi(argv[i+1]);
+				if(cfg->receive_maximum < 1 || cfg->receive_maximum > 65535){
+					fprintf(stderr, "Error: Invalid receive maximum \"%d\", must be 1-65535.\n\n", cfg->receive_maximum);
+					return 1;
+				}
+			}
+			i++;
 
 #ifdef WITH_TLS
 		}else if(!strcmp(argv[i], "--cafile")){
@@ -1186,6 +1638,16 @@ int client_opts_set(struct mosquitto *mosq, struct mosq_config *cfg)
 	}
 #endif
 	mosquitto_max_inflight_messages_set(mosq, cfg->max_inflight);
+	if(cfg->receive_maximum && mosquitto_int_option(mosq, MOSQ_OPT_RECEIVE_MAXIMUM, cfg->receive_maximum)){
+		err_printf(cfg, "Error: Problem setting receive maximum.\n");
+		mosquitto_lib_cleanup();
+		return 1;
+	}
+#if LIBMOSQUITTO_MAJOR >= 2
+	if(cfg->ack_after_write){
+		mosquitto_manual_ack_set(mosq, true);
+	}
+#endif
 #ifdef WITH_SOCKS
 	if(cfg->socks5_host){
 		rc = mosquitto_socks5_set(mosq, cfg->socks5_host, cfg->socks5_port, cfg->socks5_username, cfg->socks5_password);
@@ -19,6 +19,7 @@ Contributors:
 #ifndef CLIENT_CONFIG_H
 #define CLIENT_CONFIG_H
 
+#include <stdint.h>
 #include <stdio.h>
 
 #ifdef WIN32
@@ -35,11 +36,34 @@ Contributors:
 #define MSGMODE_FILE 4
 #define MSGMODE_NULL 5
 
+#define DEDUP_NONE 0
+#define DEDUP_CONSECUTIVE 1
+#define DEDUP_OVERWRITE 2
+
+#define SAMPLE_FIRST 1 /* first message of every window */
+#define SAMPLE_LAST 2  /* last message of every window */
+#define SAMPLE_NTH 3   /* every Nth message */
+
+#define TOP_TOPICS_MAX 100 /* --top-topics */
+
 #define CLIENT_PUB 1
 #define CLIENT_SUB 2
 #define CLIENT_RR 3
 #define CLIENT_RESPONSE_TOPIC 4
 
+/* --sample mode:arg:filter */
+struct sample_rule {
+	char *filter;
+	int mode;      /* SAMPLE_* */
+	uint64_t arg;  /* window in ns, or N */
+};
+
+/* --rollup window:filter */
+struct rollup_rule {
+	char *filter;
+	uint64_t window; /* ns */
+};
+
 struct mosq_config {
 	char *id;
 	char *id_prefix;
@@ -124,12 +148,37 @@ struct mosq_config {
 	bool isfmask;
 	bool overwrite;
 	char *fmask;
-	char ffmask[1000];       /* limit 1000 bytes. */
-	char ftoken[1000];       /* limit 1000 bytes. */
 	char *idtext;
-	char *fmask_topic;
 	char *nodesuffix;
-	char nsuffix[16];        /* limit 16 bytes. */
+	bool fsync;
+	size_t direct; /* O_DIRECT for payloads of this many bytes or more, 0 for never */
+	bool latency;
+	bool profile;
+	char *capture;       /* trace file of the received messages */
+	bool capture_hash;   /* payload hashes instead of payloads */
+	int top_topics;      /* heavy hitters tracked, 0 for none */
+	int top_interval;    /* seconds per logged window, 0 for none */
+	bool ack_after_write;
+	int receive_maximum;
+	int writers;
+	int queue_high; /* writer queue watermarks, in messages and bytes */
+	size_t queue_high_bytes;
+	int queue_low;
+	size_t queue_low_bytes;
+	char *spill_dir;
+	size_t spill_max;
+	int dedup; /* DEDUP_* */
+	struct sample_rule *samples;
+	int sample_count;
+	struct rollup_rule *rollups;
+	int rollup_count;
+	char *rollup_field; /* JSON key holding the value, NULL for plain numbers */
+	bool rollup_raw;    /* write the messages too */
+	size_t topic_memory; /* interned topics budget, 0 for no limit */
+	int *cpu_network;    /* cpus for the network thread, NULL to leave it */
+	int cpu_network_count;
+	int *cpu_writers;    /* writer N runs on cpu_writers[N % count] */
+	int cpu_writers_count;
 };
 
 int client_config_load(struct mosq_config *config, int pub_or_sub, int argc, char *argv[]);
@@ -26,8 +26,16 @@ Contributors:
 #include <time.h>
 #ifndef WIN32
 #include <unistd.h>
+#include <poll.h>
 #include <signal.h>
-#else
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif
+#ifdef WIN32
 #include <process.h>
 #include <winsock2.h>
 #define snprintf sprintf_s
@@ -36,25 +44,46 @@ Contributors:
 #include <mosquitto.h>
 #include <mqtt_protocol.h>
 #include "client_shared.h"
+#include "sub_client_affinity.h"
+#include "sub_client_capture.h"
+#include "sub_client_dedup.h"
+#include "sub_client_intern.h"
+#include "sub_client_pool.h"
+#include "sub_client_queue.h"
+#include "sub_client_rollup.h"
+#include "sub_client_sample.h"
+#include "sub_client_stats.h"
+#include "sub_client_topk.h"
+#include "sub_client_trace.h"
 
 struct mosq_config cfg;
 bool process_messages = true;
+bool disconnected = false;
 int msg_count = 0;
 struct mosquitto *mosq = NULL;
 int last_mid = 0;
+unsigned int connection = 0; /* bumped on every successful connect */
+/* Set from the log callback while a PINGREQ is waiting for its PINGRESP, see
+ * writers_loop(). */
+static bool ping_outstanding = false;
+/* a per topic feature is on, see intern_topic() */
+static bool topic_interning = false;
 
-#ifndef WIN32
+#if !defined(WIN32) && !defined(__linux__)
 void my_signal_handler(int signum)
 {
 	if(signum == SIGALRM || signum == SIGTERM || signum == SIGINT){
 		process_messages = false;
 		mosquitto_disconnect_v5(mosq, MQTT_RC_DISCONNECT_WITH_WILL_MSG, cfg.disconnect_props);
+	}else if(signum == SIGUSR1){
+		stats_dump_requested = 1;
 	}
 }
 #endif
 
-void print_message(struct mosq_config *cfg, const struct mosquitto_message *message);
-void print_message_file(struct mosq_config *cfg, const struct mosquitto_message *message);
+int print_message(struct mosq_config *cfg, const struct mosquitto_message *message);
+int print_message_file(struct mosq_config *cfg, const struct mosquitto_message *message);
+void print_message_cleanup(void);
 
 
 void my_publish_callback(struct mosquitto *mosq, void *obj, int mid, int reason_code, const mosquitto_property *properties)
@@ -69,16 +98,120 @@ void my_publish_callback(struct mosquitto *mosq, void *obj, int mid, int reason_
 }
 
 
-void my_message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message, const mosquitto_property *properties)
+/* With --ack-after-write, QoS 1 messages are only acknowledged once they
+ * have been handled: written (and synced with --fsync) or filtered out. */
+static void ack_message(struct mosquitto *mosq, const struct mosquitto_message *message)
 {
+#if LIBMOSQUITTO_MAJOR >= 2
+	if(cfg.ack_after_write && message->qos > 0){
+		mosquitto_manual_ack(mosq, message->mid);
+		__atomic_add_fetch(&ack_stats.acked, 1, __ATOMIC_RELAXED);
+	}
+#else
+	UNUSED(mosq);
+	UNUSED(message);
+#endif
+}
+
+/* A message that could not be written keeps its slot in the broker's
+ * in-flight window until the session ends. Say so before the window fills
+ * up and delivery stops. */
+static void unacked_message(const struct mosquitto_message *message)
+{
+	uint64_t n;
+	uint64_t window;
+
+	if(!cfg.ack_after_write || message->qos == 0){
+		return;
+	}
+	n = __atomic_add_fetch(&ack_stats.unacked, 1, __ATOMIC_RELAXED);
+	window = cfg.receive_maximum ? (uint64_t)cfg.receive_maximum : 20;
+	if(n == 1 || n == window){
+		err_printf(&cfg, "Warning: %llu message(s) could not be written and stay unacknowledged, "
+				"the broker stops delivering once %llu are in flight.\n",
+				(unsigned long long)n, (unsigned long long)window);
+	}
+}
+
+
+/* Hand a message over to the output stage. Without ack the message is not
+ * acknowledged, it was already. id is the interned topic, INTERN_NONE for
+ * messages not checked by --dedup consecutive. */
+static void write_message(struct mosquitto *mosq, const struct mosquitto_message *message, uint32_t id, bool ack)
+{
+	int rc;
+
+	latency_mark(LAT_DISPATCH);
+	if(cfg.dedup == DEDUP_CONSECUTIVE && dedup_message(message, id)){
+		/* same payload as the previous message on this topic */
+		TRACE(filter, message->topic, message->payloadlen, NULL, TRACE_DEDUP);
+		if(ack){
+			ack_message(mosq, message);
+		}
+		return;
+	}
+	TRACE(filter, message->topic, message->payloadlen, NULL, TRACE_WRITE);
+#ifndef WIN32
+	if(cfg.writers){
+		/* acknowledged by message_written() once a writer is done with it,
+		 * connection 0 is never the current one */
+		if(queue_push(message, ack ? connection : 0)){
+			err_printf(&cfg, "Error: Out of memory.\n");
+		}
+	}else
+#endif
+	{
+		if(cfg.fmask){
+			rc = print_message_file(&cfg, message);
+		}else{
+			rc = print_message(&cfg, message);
+		}
+		/* not persisted: leave it unacknowledged for the broker to redeliver */
+		if(ack && rc == 0){
+			ack_message(mosq, message);
+		}else if(ack){
+			unacked_message(message);
+		}
+	}
+}
+
+/* The last message of a --sample window, acknowledged when it was kept. */
+static void write_released(const struct mosquitto_message *message, uint32_t id)
+{
+	write_message(mosq, message, id, false);
+}
+
+/* A --rollup record. */
+static void write_unacked(const struct mosquitto_message *message)
+{
+	write_message(mosq, message, INTERN_NONE, false);
+}
+
+
+static void message_received(struct mosquitto *mosq, const struct mosquitto_message *message)
+{
+	uint64_t start;
+	uint32_t id;
 	int i;
 	bool res;
 
-	UNUSED(obj);
-	UNUSED(properties);
+	latency_begin();
+	TRACE(receive, message->topic, message->payloadlen, NULL, message->mid);
+	if(stats_dump_requested){
+		stats_dump_requested = 0;
+		stats_dump(stderr);
+	}
 
 	if(process_messages == false) return;
 
+	if(cfg.capture){
+		/* as received, before anything decides its fate */
+		capture_message(message);
+	}
+	if(cfg.top_topics){
+		topk_message(message);
+	}
+
 	if(cfg.remove_retained && message->retain){
 		mosquitto_publish(mosq, &last_mid, message->topic, 0, NULL, 1, true);
 	}
@@ -91,11 +224,21 @@ void my_message_callback(struct mosquitto *mosq, void *obj, const struct mosquit
 		return;
 	}
 
-	if(message->retain && cfg.no_retain) return;
+	if(message->retain && cfg.no_retain){
+		TRACE(filter, message->topic, message->payloadlen, NULL, TRACE_NO_RETAIN);
+		ack_message(mosq, message);
+		return;
+	}
+	start = profile_begin();
 	if(cfg.filter_outs){
 		for(i=0; i<cfg.filter_out_count; i++){
 			mosquitto_topic_matches_sub(cfg.filter_outs[i], message->topic, &res);
-			if(res) return;
+			if(res){
+				profile_end(PROF_FILTER, start);
+				TRACE(filter, message->topic, message->payloadlen, NULL, TRACE_FILTER_OUT);
+				ack_message(mosq, message);
+				return;
+			}
 		}
 	}
 
@@ -103,10 +246,22 @@ void my_message_callback(struct mosquitto *mosq, void *obj, const struct mosquit
 		mosquitto_publish(mosq, &last_mid, message->topic, 0, NULL, 1, true);
 	}
 
-	if(cfg.fmask){
-		print_message_file(&cfg, message);
+	/* once per message, for every per topic feature */
+	id = topic_interning ? intern_topic(message->topic) : INTERN_NONE;
+
+	if(cfg.rollup_count && rollup_message(message, id)){
+		/* folded into the topic's rollup */
+		profile_end(PROF_FILTER, start);
+		TRACE(filter, message->topic, message->payloadlen, NULL, TRACE_ROLLUP);
+		ack_message(mosq, message);
+	}else if(cfg.sample_count && sample_message(message, id)){
+		/* sampled out, or kept until its window ends */
+		profile_end(PROF_FILTER, start);
+		TRACE(filter, message->topic, message->payloadlen, NULL, TRACE_SAMPLE);
+		ack_message(mosq, message);
 	}else{
-		print_message(&cfg, message);
+		profile_end(PROF_FILTER, start);
+		write_message(mosq, message, id, true);
 	}
 
 	if(cfg.msg_count>0){
@@ -120,6 +275,18 @@ void my_message_callback(struct mosquitto *mosq, void *obj, const struct mosquit
 	}
 }
 
+void my_message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message, const mosquitto_property *properties)
+{
+	uint64_t start;
+
+	UNUSED(obj);
+	UNUSED(properties);
+
+	start = profile_begin();
+	message_received(mosq, message);
+	profile_end(PROF_CALLBACK, start);
+}
+
 void my_connect_callback(struct mosquitto *mosq, void *obj, int result, int flags, const mosquitto_property *properties)
 {
 	int i;
@@ -129,6 +296,8 @@ void my_connect_callback(struct mosquitto *mosq, void *obj, int result, int flag
 	UNUSED(properties);
 
 	if(!result){
+		connection++;
+		ping_outstanding = false;
 		mosquitto_subscribe_multiple(mosq, NULL, cfg.topic_count, cfg.topics, cfg.qos, cfg.sub_opts, cfg.subscribe_props);
 
 		for(i=0; i<cfg.unsub_topic_count; i++){
@@ -150,6 +319,18 @@ void my_connect_callback(struct mosquitto *mosq, void *obj, int result, int flag
 	}
 }
 
+void my_disconnect_callback(struct mosquitto *mosq, void *obj, int rc, const mosquitto_property *properties)
+{
+	UNUSED(mosq);
+	UNUSED(obj);
+	UNUSED(properties);
+
+	if(rc == 0){
+		/* we asked for it */
+		disconnected = true;
+	}
+}
+
 void my_subscribe_callback(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
 {
 	int i;
@@ -175,9 +356,379 @@ void my_log_callback(struct mosquitto *mosq, void *obj, int level, const char *s
 	UNUSED(obj);
 	UNUSED(level);
 
-	printf("%s\n", str);
+	if(cfg.writers){
+		/* libmosquitto has no ping callback, only these debug messages */
+		if(strstr(str, "sending PINGREQ")){
+			ping_outstanding = true;
+		}else if(strstr(str, "received PINGRESP")){
+			ping_outstanding = false;
+		}
+	}
+	if(cfg.debug){
+		printf("%s\n", str);
+	}
+}
+
+#ifndef WIN32
+/* A mid is only valid on the connection it was received on. Messages from an
+ * earlier connection are redelivered by the broker (or dropped, with a clean
+ * session), acknowledging them now could ack an unrelated message. */
+static void message_written(const struct mosquitto_message *message, unsigned int conn, int rc)
+{
+	if(conn != connection){
+		return;
+	}
+	if(rc == 0){
+		ack_message(mosq, message);
+	}else{
+		unacked_message(message);
+	}
+}
+
+static bool loop_fatal(int rc)
+{
+	switch(rc){
+		case MOSQ_ERR_NOMEM:
+		case MOSQ_ERR_PROTOCOL:
+		case MOSQ_ERR_INVAL:
+		case MOSQ_ERR_NOT_FOUND:
+		case MOSQ_ERR_TLS:
+		case MOSQ_ERR_PAYLOAD_SIZE:
+		case MOSQ_ERR_NOT_SUPPORTED:
+		case MOSQ_ERR_AUTH:
+		case MOSQ_ERR_ACL_DENIED:
+		case MOSQ_ERR_UNKNOWN:
+		case MOSQ_ERR_EAI:
+		case MOSQ_ERR_PROXY:
+			return true;
+	}
+	return errno == EPROTO;
+}
+
+#ifdef __linux__
+/* Packets read per wakeup of event_loop() at most, so completions, timers
+ * and signals are not starved by a busy subscription. */
+#define LOOP_READ_MAX 64
+
+struct event_loop {
+	int epfd;
+	int sigfd;
+	int timerfd;
+	int sock;          /* broker socket in the set, -1 if none */
+	uint32_t watched;  /* events it is watched for */
+};
+
+/* The timer period: a second for the keepalive, or the shortest --sample
+ * last and --rollup window, so their output is not held back until the
+ * next message arrives. */
+static long loop_tick_ms(void)
+{
+	uint64_t ns = 1000000000ULL;
+	int i;
+
+	for(i=0; i<cfg.sample_count; i++){
+		if(cfg.samples[i].mode == SAMPLE_LAST && cfg.samples[i].arg < ns){
+			ns = cfg.samples[i].arg;
+		}
+	}
+	for(i=0; i<cfg.rollup_count; i++){
+		if(cfg.rollups[i].window < ns){
+			ns = cfg.rollups[i].window;
+		}
+	}
+	return ns < 10000000ULL ? 10 : (long)(ns / 1000000ULL);
+}
+
+static int loop_add(int epfd, int fd, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int loop_init(struct event_loop *loop, const sigset_t *sigs)
+{
+	struct itimerspec its;
+	struct timespec now;
+	long long first;
+	long ms;
+
+	loop->sock = -1;
+	loop->watched = 0;
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	loop->sigfd = signalfd(-1, sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+	loop->timerfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(loop->epfd < 0 || loop->sigfd < 0 || loop->timerfd < 0){
+		return 1;
+	}
+
+	/* ticks on multiples of the period, right after --rollup windows end */
+	ms = loop_tick_ms();
+	clock_gettime(CLOCK_REALTIME, &now);
+	its.it_interval.tv_sec = ms / 1000;
+	its.it_interval.tv_nsec = (ms % 1000) * 1000000L;
+	first = ((now.tv_sec * 1000LL + now.tv_nsec / 1000000) / ms + 1) * ms;
+	its.it_value.tv_sec = first / 1000;
+	its.it_value.tv_nsec = (first % 1000) * 1000000L;
+	if(timerfd_settime(loop->timerfd, TFD_TIMER_ABSTIME, &its, NULL)){
+		return 1;
+	}
+
+	if(loop_add(loop->epfd, loop->sigfd, EPOLLIN)
+			|| loop_add(loop->epfd, loop->timerfd, EPOLLIN)
+			|| (cfg.writers && loop_add(loop->epfd, queue_notify_fd(), EPOLLIN))){
+		return 1;
+	}
+	return 0;
+}
+
+static void loop_cleanup(struct event_loop *loop)
+{
+	if(loop->epfd >= 0) close(loop->epfd);
+	if(loop->sigfd >= 0) close(loop->sigfd);
+	if(loop->timerfd >= 0) close(loop->timerfd);
+}
+
+/* Forget the broker socket, libmosquitto may have closed it already. */
+static void loop_unwatch(struct event_loop *loop)
+{
+	if(loop->sock >= 0){
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->sock, NULL);
+		loop->sock = -1;
+	}
 }
 
+/* Watch the socket of the current connection, returns 1 without one. */
+static int loop_watch(struct event_loop *loop, struct mosquitto *mosq)
+{
+	struct epoll_event ev;
+	uint32_t events = 0;
+
+	if(loop->sock < 0){
+		loop->sock = mosquitto_socket(mosq);
+		if(loop->sock < 0){
+			return 1;
+		}
+		loop->watched = 0;
+		if(loop_add(loop->epfd, loop->sock, 0)){
+			loop->sock = -1;
+			return 1;
+		}
+	}
+
+	if(!cfg.writers || !queue_paused() || ping_outstanding){
+		events |= EPOLLIN;
+	}
+	if(mosquitto_want_write(mosq)){
+		events |= EPOLLOUT;
+	}
+	if(events != loop->watched){
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.fd = loop->sock;
+		epoll_ctl(loop->epfd, EPOLL_CTL_MOD, loop->sock, &ev);
+		loop->watched = events;
+	}
+	return 0;
+}
+
+/* What used to be done in a signal handler, now from the loop itself. */
+static void loop_signals(struct event_loop *loop, struct mosquitto *mosq)
+{
+	struct signalfd_siginfo si;
+
+	while(read(loop->sigfd, &si, sizeof(si)) == (ssize_t)sizeof(si)){
+		if(si.ssi_signo == SIGUSR1){
+			stats_dump(stderr);
+		}else{
+			/* SIGALRM (-W), SIGTERM, SIGINT */
+			process_messages = false;
+			mosquitto_disconnect_v5(mosq, MQTT_RC_DISCONNECT_WITH_WILL_MSG, cfg.disconnect_props);
+		}
+	}
+}
+
+/* Wait up to timeout_ms for events and handle all but the broker socket's,
+ * returned in *sock_events. */
+static int loop_wait(struct event_loop *loop, struct mosquitto *mosq, int timeout_ms, uint32_t *sock_events)
+{
+	struct epoll_event evs[8];
+	uint64_t ticks;
+	int n, i;
+
+	*sock_events = 0;
+	n = epoll_wait(loop->epfd, evs, 8, timeout_ms);
+	if(n < 0){
+		return errno == EINTR ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ERRNO;
+	}
+	for(i=0; i<n; i++){
+		if(evs[i].data.fd == loop->sock){
+			*sock_events = evs[i].events;
+		}else if(evs[i].data.fd == loop->sigfd){
+			loop_signals(loop, mosq);
+		}else if(evs[i].data.fd == loop->timerfd){
+			if(read(loop->timerfd, &ticks, sizeof(ticks)) > 0){
+				if(cfg.sample_count) sample_expire();
+				if(cfg.rollup_count) rollup_expire();
+				if(cfg.top_interval) topk_expire();
+			}
+		}else{
+			queue_complete(message_written);
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Replaces mosquitto_loop_forever() on Linux. One epoll set holds the broker
+ * socket, the writer queue's eventfd, a timerfd ticking for the keepalive
+ * and the --sample/--rollup/--top-interval windows, and a signalfd for the
+ * signals, which are blocked in every thread. Everything already received
+ * is read per wakeup, not one packet.
+ *
+ * With --writers the socket is not read while the queue is paused, see
+ * writers_loop() for the keepalive. */
+static int event_loop(struct mosquitto *mosq, const sigset_t *sigs)
+{
+	struct event_loop loop;
+	uint32_t events = 0;
+	int avail;
+	int count;
+	int rc;
+
+	if(loop_init(&loop, sigs)){
+		err_printf(&cfg, "Error: Unable to set up the event loop: %s.\n", strerror(errno));
+		loop_cleanup(&loop);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	while(1){
+		rc = MOSQ_ERR_SUCCESS;
+		if(loop_watch(&loop, mosq)){
+			rc = MOSQ_ERR_NO_CONN;
+		}else{
+			rc = loop_wait(&loop, mosq, -1, &events);
+		}
+
+		if(rc == MOSQ_ERR_SUCCESS && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))){
+			for(count=0; count<LOOP_READ_MAX; count++){
+				rc = mosquitto_loop_read(mosq, 1);
+				if(rc != MOSQ_ERR_SUCCESS
+						|| (cfg.writers && queue_paused() && !ping_outstanding)
+						|| ioctl(loop.sock, FIONREAD, &avail) != 0 || avail == 0){
+					break;
+				}
+			}
+		}
+		if(rc == MOSQ_ERR_SUCCESS && ((events & EPOLLOUT) || mosquitto_want_write(mosq))){
+			rc = mosquitto_loop_write(mosq, 1);
+		}
+		if(rc == MOSQ_ERR_SUCCESS){
+			rc = mosquitto_loop_misc(mosq);
+		}
+		if(rc == MOSQ_ERR_SUCCESS){
+			continue;
+		}
+
+		loop_unwatch(&loop);
+		if(disconnected){
+			rc = MOSQ_ERR_SUCCESS;
+			break;
+		}
+		if(!process_messages || loop_fatal(rc)){
+			break;
+		}
+		/* reconnect a second later, still handling signals and completions */
+		loop_wait(&loop, mosq, 1000, &events);
+		if(!process_messages){
+			break;
+		}
+		mosquitto_reconnect(mosq);
+	}
+	loop_cleanup(&loop);
+	return rc;
+}
+
+#else
+/* mosquitto_loop_forever() for --writers. The socket is not read while the
+ * writer queue is above its high watermark, so a slow disk makes the broker
+ * queue messages instead of us.
+ *
+ * The PINGRESP for a keepalive ping sent while paused is queued behind
+ * whatever PUBLISH packets the broker already sent, so once a PINGREQ is out
+ * the socket is read until its PINGRESP arrived, or libmosquitto drops the
+ * connection a keepalive later. The messages read meanwhile go over the high
+ * watermark. Without keepalive (-k 0) no ping is sent and nothing is read. */
+static int writers_loop(struct mosquitto *mosq)
+{
+	struct pollfd fds[2];
+	int rc;
+
+	while(1){
+		/* poll() wakes at least once a second, unlike the message callback */
+		if(stats_dump_requested){
+			stats_dump_requested = 0;
+			stats_dump(stderr);
+		}
+		if(cfg.top_interval){
+			topk_expire();
+		}
+
+		rc = MOSQ_ERR_SUCCESS;
+		fds[0].fd = mosquitto_socket(mosq);
+		fds[0].events = 0;
+		fds[0].revents = 0;
+		fds[1].fd = queue_notify_fd();
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		if(fds[0].fd < 0){
+			rc = MOSQ_ERR_NO_CONN;
+		}else{
+			if(!queue_paused() || ping_outstanding){
+				fds[0].events |= POLLIN;
+			}
+			if(mosquitto_want_write(mosq)){
+				fds[0].events |= POLLOUT;
+			}
+			if(poll(fds, 2, 1000) < 0 && errno != EINTR){
+				rc = MOSQ_ERR_ERRNO;
+			}
+		}
+
+		queue_complete(message_written);
+
+		if(rc == MOSQ_ERR_SUCCESS && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))){
+			rc = mosquitto_loop_read(mosq, 1);
+		}
+		if(rc == MOSQ_ERR_SUCCESS && ((fds[0].revents & POLLOUT) || mosquitto_want_write(mosq))){
+			rc = mosquitto_loop_write(mosq, 1);
+		}
+		if(rc == MOSQ_ERR_SUCCESS){
+			rc = mosquitto_loop_misc(mosq);
+		}
+		if(rc == MOSQ_ERR_SUCCESS){
+			continue;
+		}
+
+		if(disconnected){
+			return MOSQ_ERR_SUCCESS;
+		}
+		if(!process_messages || loop_fatal(rc)){
+			return rc;
+		}
+		sleep(1);
+		if(!process_messages){
+			return rc;
+		}
+		mosquitto_reconnect(mosq);
+	}
+}
+#endif
+#endif
+
 void print_usage(void)
 {
 	int major, minor, revision;
@@ -199,7 +750,16 @@ void print_usage(void)
 #endif
 	printf("                     [-i id] [-I id_prefix]\n");
 	printf("                     [-d] [-N] [--quiet] [-v]\n");
-	printf("                     [--fmask outfile [--overwrite]]\n");
+	printf("                     [--fmask outfile [--overwrite] [--fsync] [--direct bytes]] [--latency]\n");
+	printf("                     [--profile] [--capture file [--capture-hash]]\n");
+	printf("                     [--top-topics count [--top-interval seconds]]\n");
+	printf("                     [--ack-after-write] [--receive-maximum count]\n");
+	printf("                     [--writers count [--queue-high msgs[:bytes]] [--queue-low msgs[:bytes]]\n");
+	printf("                      [--spill dir [--spill-max bytes]] [--cpu-writers cpus]]\n");
+	printf("                     [--cpu-network cpus]\n");
+	printf("                     [--dedup consecutive|overwrite] [--sample mode:arg:filter ...]\n");
+	printf("                     [--rollup window:filter ... [--rollup-field key] [--rollup-raw]]\n");
+	printf("                     [--topic-memory bytes]\n");
 	printf("                     [--will-topic [--will-payload payload] [--will-qos qos] [--will-retain]]\n");
 #ifdef WITH_TLS
 	printf("                     [{--cafile file | --capath dir} [--cert file] [--key file]\n");
@@ -261,6 +821,50 @@ void print_usage(void)
 	printf("            NOTE: enabled (experimental) use of option -F <value> with empty --fmask "" \n");
 	printf(" --nodesuffix : suffix for leaf/text node, when --fmask is provided\n");
 	printf(" --overwrite : overwrite the existing output file, can be used with --fmask only.\n");
+	printf(" --fsync : fsync every record written with --fmask before handling the next message.\n");
+	printf(" --direct : write payloads of at least this many bytes with O_DIRECT, bypassing the\n");
+	printf("            page cache. Such records are not appended atomically.\n");
+	printf(" --ack-after-write : acknowledge QoS 1 messages only once they are written (and synced\n");
+	printf("                     with --fsync). Messages that fail to write stay in flight for the\n");
+	printf("                     rest of the session. Not possible with -q 2. Needs libmosquitto 2.0.\n");
+	printf(" --receive-maximum : MQTT v5 receive maximum, the number of unacknowledged QoS 1/2\n");
+	printf("                     messages the broker may have in flight to this client.\n");
+	printf(" --writers : write messages from this many threads, sharded by topic. The socket is\n");
+	printf("             not read while the writer queue is above --queue-high, and reading\n");
+	printf("             resumes at --queue-low. Defaults to 0, writing from the network thread.\n");
+	printf(" --queue-high : writer queue high watermark in messages and optionally bytes, 0 for\n");
+	printf("                no limit. Defaults to 10000:67108864.\n");
+	printf(" --queue-low : writer queue low watermark. Defaults to half of --queue-high.\n");
+	printf(" --spill : instead of pausing at --queue-high, append further messages to a spill file\n");
+	printf("           per writer in this directory, written out in order once the writers catch up.\n");
+	printf(" --spill-max : pause reading once this many bytes are spilled, resume at half of it.\n");
+	printf("               Defaults to 0, no limit.\n");
+	printf(" --cpu-network : pin the network thread to these cpus, e.g. 0-3,8. Linux only.\n");
+	printf(" --cpu-writers : pin writer N to the Nth cpu of this list, wrapping around. Linux only.\n");
+	printf(" --dedup : skip messages whose content is unchanged. consecutive: same payload as the\n");
+	printf("           previous message on the topic. overwrite: same record as the one last\n");
+	printf("           written to the file, needs --fmask and --overwrite.\n");
+	printf(" --sample : write only some messages of the topics matching filter, first:window and\n");
+	printf("            last:window the first or last message of every window (e.g. 1s, 500ms),\n");
+	printf("            nth:N every Nth message. The first matching rule applies, can be repeated.\n");
+	printf(" --rollup : write one record with count, min, max and avg of the numeric payloads per\n");
+	printf("            window (e.g. 60s) for the topics matching filter, instead of the messages.\n");
+	printf(" --rollup-field : take the number from this JSON key of the payload.\n");
+	printf(" --rollup-raw : write the messages too, the records then go to rollup/<topic>.\n");
+	printf(" --topic-memory : memory for the topics of --sample, --rollup and --dedup consecutive,\n");
+	printf("                  idle topics are dropped above it. Defaults to 64 MiB, 0 for no limit.\n");
+	printf(" --latency : record per stage latency histograms, from message receipt to dispatch,\n");
+	printf("             path resolution, write and fsync. Printed to stderr at exit, and on\n");
+	printf("             SIGUSR1: right away on Linux, elsewhere within a second with --writers,\n");
+	printf("             otherwise only once the next message arrives.\n");
+	printf(" --profile : account the time and syscalls of each stage (callback, filter, path render,\n");
+	printf("             mkdir, open, write, sync, close). Printed to stderr at exit and on SIGUSR1.\n");
+	printf(" --capture : record the received messages, their topic, timing and payload, to this\n");
+	printf("             trace file, to be replayed by bench/bench_replay.\n");
+	printf(" --capture-hash : record a hash of each payload instead of the payload.\n");
+	printf(" --top-topics : estimate the topics with the most messages and payload bytes, without\n");
+	printf("                a counter per topic, and list this many of each (1-100) with the stats.\n");
+	printf(" --top-interval : also log the list to stderr every this many seconds, then start over.\n");
 	printf(" --will-payload : payload for the client Will, which is sent by the broker in case of\n");
 	printf("                  unexpected disconnection. If not given and will-topic is set, a zero\n");
 	printf("                  length message will be sent.\n");
@@ -300,7 +904,9 @@ void print_usage(void)
 int main(int argc, char *argv[])
 {
 	int rc;
-#ifndef WIN32
+#ifdef __linux__
+	sigset_t sigs;
+#elif !defined(WIN32)
 		struct sigaction sigact;
 #endif
 
@@ -325,6 +931,33 @@ int main(int argc, char *argv[])
 	if(client_id_generate(&cfg)){
 		goto cleanup;
 	}
+	/* before any of the network thread's state is allocated */
+	if(cfg.cpu_network && affinity_set(&cfg, "network", cfg.cpu_network, cfg.cpu_network_count)){
+		goto cleanup;
+	}
+
+	latency_enabled = cfg.latency;
+	if(cfg.profile){
+		profile_init();
+	}
+	ack_stats_enabled = cfg.ack_after_write;
+	topic_interning = cfg.sample_count || cfg.rollup_count || cfg.dedup == DEDUP_CONSECUTIVE;
+	if(topic_interning){
+		intern_init(&cfg);
+	}
+	sample_init(&cfg, write_released);
+	if(rollup_init(&cfg, write_unacked)){
+		goto cleanup;
+	}
+	/* after sample_init(), an evicted topic's kept message goes through
+	 * dedup_message() before dedup forgets the topic */
+	dedup_init(&cfg);
+	if(cfg.capture && capture_init(&cfg)){
+		goto cleanup;
+	}
+	if(cfg.top_topics && topk_init(&cfg)){
+		goto cleanup;
+	}
 
 	mosq = mosquitto_new(cfg.id, cfg.clean_session, &cfg);
 	cfg.idtext = cfg.id;
@@ -342,11 +975,12 @@ int main(int argc, char *argv[])
 	if(client_opts_set(mosq, &cfg)){
 		goto cleanup;
 	}
-	if(cfg.debug){
+	if(cfg.debug || cfg.writers){
 		mosquitto_log_callback_set(mosq, my_log_callback);
 	}
 	mosquitto_subscribe_callback_set(mosq, my_subscribe_callback);
 	mosquitto_connect_v5_callback_set(mosq, my_connect_callback);
+	mosquitto_disconnect_v5_callback_set(mosq, my_disconnect_callback);
 	mosquitto_message_v5_callback_set(mosq, my_message_callback);
 
 	rc = client_connect(mosq, &cfg);
@@ -354,10 +988,23 @@ int main(int argc, char *argv[])
 		goto cleanup;
 	}
 
-#ifndef WIN32
+#ifdef __linux__
+	/* read from a signalfd by event_loop(), blocked before queue_init() so
+	 * the writer threads inherit the mask */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGALRM);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGUSR1);
+	if(sigprocmask(SIG_BLOCK, &sigs, NULL) == -1){
+		perror("sigprocmask");
+		goto cleanup;
+	}
+#elif !defined(WIN32)
 	sigact.sa_handler = my_signal_handler;
 	sigemptyset(&sigact.sa_mask);
-	sigact.sa_flags = 0;
+	/* stdout/file writes must not fail with EINTR on SIGUSR1 */
+	sigact.sa_flags = SA_RESTART;
 
 	if(sigaction(SIGALRM, &sigact, NULL) == -1){
 		perror("sigaction");
@@ -374,13 +1021,62 @@ int main(int argc, char *argv[])
 		goto cleanup;
 	}
 
+	if(sigaction(SIGUSR1, &sigact, NULL) == -1){
+		perror("sigaction");
+		goto cleanup;
+	}
+
+#endif
+#ifndef WIN32
 	if(cfg.timeout){
 		alarm(cfg.timeout);
 	}
 #endif
 
-	rc = mosquitto_loop_forever(mosq, -1, 1);
+#ifdef __linux__
+	if(cfg.writers && queue_init(&cfg, cfg.fmask ? print_message_file : print_message)){
+		goto cleanup;
+	}
+	rc = event_loop(mosq, &sigs);
+	/* the connection is gone, whatever is left is written unacknowledged */
+	sample_flush();
+	rollup_flush();
+	if(cfg.writers){
+		queue_stop(NULL);
+	}
+#else
+#ifndef WIN32
+	if(cfg.writers){
+		if(queue_init(&cfg, cfg.fmask ? print_message_file : print_message)){
+			goto cleanup;
+		}
+		rc = writers_loop(mosq);
+		/* the connection is gone, whatever is left is written unacknowledged */
+		sample_flush();
+		rollup_flush();
+		queue_stop(NULL);
+	}else
+#endif
+	{
+		rc = mosquitto_loop_forever(mosq, -1, 1);
+		sample_flush();
+		rollup_flush();
+	}
+#endif
+
+	if(cfg.latency || cfg.profile || cfg.writers || cfg.ack_after_write || cfg.dedup || cfg.sample_count
+			|| cfg.rollup_count || cfg.top_topics){
+		stats_dump(stderr);
+	}
 
+	print_message_cleanup();
+	capture_cleanup();
+	topk_cleanup();
+	dedup_cleanup();
+	sample_cleanup();
+	rollup_cleanup();
+	intern_cleanup();
+	pool_cleanup();
 	mosquitto_destroy(mosq);
 	mosquitto_lib_cleanup();
 
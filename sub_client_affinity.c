@@ -0,0 +1,71 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#include "config.h"
+
+#include <string.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#include <mosquitto.h>
+#include "client_shared.h"
+#include "sub_client_affinity.h"
+
+
+#ifdef __linux__
+int affinity_set(const struct mosq_config *cfg, const char *name, const int *cpus, int count)
+{
+	cpu_set_t set;
+	unsigned int cpu = 0, node = 0;
+	int rc;
+	int i;
+
+	CPU_ZERO(&set);
+	for(i=0; i<count; i++){
+		CPU_SET(cpus[i], &set);
+	}
+	rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if(rc){
+		err_printf(cfg, "Error: Unable to pin the %s thread: %s.\n", name, strerror(rc));
+		return 1;
+	}
+
+	/* the move happens before this returns, so this is where it runs now */
+	if(syscall(SYS_getcpu, &cpu, &node, NULL) == 0){
+		if(count == 1){
+			err_printf(cfg, "Placement: %s thread on cpu %u, node %u.\n", name, cpu, node);
+		}else{
+			err_printf(cfg, "Placement: %s thread on %d cpus, now cpu %u, node %u.\n", name, count, cpu, node);
+		}
+	}
+	return 0;
+}
+#else
+int affinity_set(const struct mosq_config *cfg, const char *name, const int *cpus, int count)
+{
+	UNUSED(cfg);
+	UNUSED(name);
+	UNUSED(cpus);
+	UNUSED(count);
+
+	/* the options are refused on other platforms */
+	return 1;
+}
+#endif
@@ -0,0 +1,33 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#ifndef SUB_CLIENT_AFFINITY_H
+#define SUB_CLIENT_AFFINITY_H
+
+#include <mosquitto.h>
+#include "client_shared.h"
+
+/* CPU placement (--cpu-network, --cpu-writers), Linux only.
+ *
+ * Threads are pinned before they allocate anything of their own, so with
+ * the kernel's first touch policy their buffers, caches and pools end up
+ * on the NUMA node they run on. */
+
+/* Pin the calling thread to cpus and report the cpu and node it runs on,
+ * as name. Returns 1 if the kernel refused the cpus. */
+int affinity_set(const struct mosq_config *cfg, const char *name, const int *cpus, int count);
+
+#endif
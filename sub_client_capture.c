@@ -0,0 +1,428 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mosquitto.h>
+#include "client_shared.h"
+#include "sub_client_capture.h"
+#include "sub_client_dedup.h"
+#include "sub_client_stats.h"
+
+#define CAPTURE_MAGIC "MQDPCAP1"
+#define CAPTURE_HEADER 16
+#define CAPTURE_BUFFER (1024*1024)
+#define CAPTURE_FLUSH_NS 1000000000ULL   /* lose at most this much on a crash */
+#define CAPTURE_TOPICS_MIN 1024
+
+/* A topic written to the trace, topic NULL marks a free slot. */
+struct capture_topic {
+	uint64_t hash;
+	char *topic;
+	uint32_t index;
+};
+
+struct capture_reader {
+	FILE *fptr;
+	char **topics;
+	uint32_t topic_count;
+	uint32_t topic_size;
+	char *payload;
+	size_t payload_size;
+	uint64_t time_us;
+};
+
+static struct mosq_config *capture_cfg = NULL;
+static FILE *trace = NULL;
+static uint64_t start_ns = 0;
+static uint64_t last_us = 0;
+static uint64_t flush_ns = 0;
+static struct capture_topic *topics = NULL;
+static size_t topics_size = 0; /* power of two */
+static uint32_t topic_count = 0;
+
+
+static size_t put_varint(uint8_t *buf, uint64_t v)
+{
+	size_t n = 0;
+
+	while(v >= 0x80){
+		buf[n++] = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = (uint8_t)v;
+	return n;
+}
+
+static size_t put_u64(uint8_t *buf, uint64_t v)
+{
+	int i;
+
+	for(i=0; i<8; i++){
+		buf[i] = (uint8_t)(v >> (8*i));
+	}
+	return 8;
+}
+
+static uint64_t get_u64(const uint8_t *buf)
+{
+	uint64_t v = 0;
+	int i;
+
+	for(i=7; i>=0; i--){
+		v = v << 8 | buf[i];
+	}
+	return v;
+}
+
+
+static void capture_stop(const char *what)
+{
+	err_printf(capture_cfg, "Error: Unable to %s capture file %s: %s, capture stopped.\n",
+			what, capture_cfg->capture, strerror(errno));
+	fclose(trace);
+	trace = NULL;
+}
+
+static int topics_grow(void)
+{
+	struct capture_topic *old = topics;
+	size_t old_size = topics_size;
+	size_t i, j;
+
+	topics_size = old_size ? old_size * 2 : CAPTURE_TOPICS_MIN;
+	topics = calloc(topics_size, sizeof(struct capture_topic));
+	if(!topics){
+		topics = old;
+		topics_size = old_size;
+		return 1;
+	}
+	for(i=0; i<old_size; i++){
+		if(!old[i].topic) continue;
+		j = old[i].hash & (topics_size - 1);
+		while(topics[j].topic){
+			j = (j + 1) & (topics_size - 1);
+		}
+		topics[j] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/* The index of topic, *added if it is new to the trace. */
+static int capture_topic(const char *topic, size_t len, uint32_t *index, bool *added)
+{
+	struct capture_topic *entry;
+	uint64_t hash;
+	size_t i;
+
+	hash = dedup_hash(topic, len, 0);
+	i = hash & (topics_size - 1);
+	while(topics[i].topic){
+		if(topics[i].hash == hash && !strcmp(topics[i].topic, topic)){
+			*index = topics[i].index;
+			*added = false;
+			return 0;
+		}
+		i = (i + 1) & (topics_size - 1);
+	}
+
+	if((topic_count + 1) * 2 > topics_size){
+		if(topics_grow()){
+			return 1;
+		}
+		i = hash & (topics_size - 1);
+		while(topics[i].topic){
+			i = (i + 1) & (topics_size - 1);
+		}
+	}
+	entry = &topics[i];
+	entry->topic = strdup(topic);
+	if(!entry->topic){
+		return 1;
+	}
+	entry->hash = hash;
+	entry->index = topic_count++;
+	*index = entry->index;
+	*added = true;
+	return 0;
+}
+
+
+int capture_init(struct mosq_config *cfg)
+{
+	uint8_t header[CAPTURE_HEADER];
+	struct timespec now;
+
+	capture_cfg = cfg;
+	trace = fopen(cfg->capture, "wb");
+	if(!trace){
+		err_printf(cfg, "Error: Unable to open capture file %s: %s.\n", cfg->capture, strerror(errno));
+		return 1;
+	}
+	setvbuf(trace, NULL, _IOFBF, CAPTURE_BUFFER);
+	if(topics_grow()){
+		err_printf(cfg, "Error: Out of memory.\n");
+		fclose(trace);
+		trace = NULL;
+		return 1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	memcpy(header, CAPTURE_MAGIC, 8);
+	put_u64(header + 8, (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec);
+	if(fwrite(header, 1, sizeof(header), trace) != sizeof(header)){
+		capture_stop("write");
+		return 1;
+	}
+	start_ns = stats_now_ns();
+	flush_ns = start_ns;
+	last_us = 0;
+	return 0;
+}
+
+
+void capture_message(const struct mosquitto_message *message)
+{
+	/* flags, delay, topic index or length, payload length and hash */
+	uint8_t head[1 + 10 + 10 + 10 + 8];
+	uint64_t now, us;
+	uint32_t index;
+	size_t tlen, n;
+	bool added;
+
+	if(!trace){
+		return;
+	}
+	now = stats_now_ns();
+	us = (now - start_ns) / 1000;
+	tlen = strlen(message->topic);
+	if(capture_topic(message->topic, tlen, &index, &added)){
+		errno = ENOMEM;
+		capture_stop("write");
+		return;
+	}
+
+	head[0] = (uint8_t)((message->qos & CAPTURE_QOS_MASK)
+			| (message->retain ? CAPTURE_RETAIN : 0)
+			| (added ? CAPTURE_TOPIC : 0)
+			| (capture_cfg->capture_hash ? CAPTURE_HASH : 0));
+	n = 1 + put_varint(head + 1, us - last_us);
+	last_us = us;
+	if(added){
+		n += put_varint(head + n, tlen);
+		if(fwrite(head, 1, n, trace) != n || fwrite(message->topic, 1, tlen, trace) != tlen){
+			capture_stop("write");
+			return;
+		}
+		n = 0;
+	}else{
+		n += put_varint(head + n, index);
+	}
+	n += put_varint(head + n, (uint64_t)message->payloadlen);
+	if(capture_cfg->capture_hash){
+		n += put_u64(head + n, dedup_hash(message->payload, (size_t)message->payloadlen, 0));
+	}
+	if(fwrite(head, 1, n, trace) != n){
+		capture_stop("write");
+		return;
+	}
+	if(!capture_cfg->capture_hash && message->payloadlen > 0
+			&& fwrite(message->payload, 1, (size_t)message->payloadlen, trace) != (size_t)message->payloadlen){
+		capture_stop("write");
+		return;
+	}
+
+	if(now - flush_ns > CAPTURE_FLUSH_NS){
+		flush_ns = now;
+		if(fflush(trace)){
+			capture_stop("write");
+		}
+	}
+}
+
+
+void capture_cleanup(void)
+{
+	size_t i;
+
+	if(trace && fclose(trace)){
+		trace = NULL;
+		err_printf(capture_cfg, "Error: Unable to write capture file %s: %s.\n",
+				capture_cfg->capture, strerror(errno));
+	}
+	trace = NULL;
+	for(i=0; i<topics_size; i++){
+		free(topics[i].topic);
+	}
+	free(topics);
+	topics = NULL;
+	topics_size = 0;
+	topic_count = 0;
+}
+
+
+/* ------------------------------------------------------------- */
+/* reading a trace back */
+
+static int get_varint(FILE *fptr, uint64_t *v)
+{
+	int shift = 0;
+	int c;
+
+	*v = 0;
+	do{
+		c = getc(fptr);
+		if(c == EOF || shift > 63){
+			return 1;
+		}
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		shift += 7;
+	}while(c & 0x80);
+	return 0;
+}
+
+
+struct capture_reader *capture_reader_open(const char *path)
+{
+	struct capture_reader *reader;
+	uint8_t header[CAPTURE_HEADER];
+
+	reader = calloc(1, sizeof(struct capture_reader));
+	if(!reader){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return NULL;
+	}
+	reader->fptr = fopen(path, "rb");
+	if(!reader->fptr){
+		fprintf(stderr, "Error: Unable to open capture file %s: %s.\n", path, strerror(errno));
+		free(reader);
+		return NULL;
+	}
+	setvbuf(reader->fptr, NULL, _IOFBF, CAPTURE_BUFFER);
+	if(fread(header, 1, sizeof(header), reader->fptr) != sizeof(header)
+			|| memcmp(header, CAPTURE_MAGIC, 8)){
+		fprintf(stderr, "Error: %s is not a capture file.\n", path);
+		capture_reader_close(reader);
+		return NULL;
+	}
+	return reader;
+}
+
+
+int capture_read(struct capture_reader *reader, struct capture_record *record)
+{
+	uint8_t hash[8];
+	uint64_t delay, v, len;
+	char **topics_new;
+	char *topic;
+	int flags;
+
+	flags = getc(reader->fptr);
+	if(flags == EOF){
+		return 1;
+	}
+	if(get_varint(reader->fptr, &delay)){
+		return -1;
+	}
+	reader->time_us += delay;
+
+	if(flags & CAPTURE_TOPIC){
+		if(get_varint(reader->fptr, &len) || len > 65535){
+			return -1;
+		}
+		if(reader->topic_count == reader->topic_size){
+			reader->topic_size = reader->topic_size ? reader->topic_size * 2 : CAPTURE_TOPICS_MIN;
+			topics_new = realloc(reader->topics, reader->topic_size * sizeof(char *));
+			if(!topics_new){
+				return -1;
+			}
+			reader->topics = topics_new;
+		}
+		topic = malloc(len + 1);
+		if(!topic || fread(topic, 1, len, reader->fptr) != len){
+			free(topic);
+			return -1;
+		}
+		topic[len] = '\0';
+		reader->topics[reader->topic_count++] = topic;
+		record->topic = topic;
+	}else{
+		if(get_varint(reader->fptr, &v) || v >= reader->topic_count){
+			return -1;
+		}
+		record->topic = reader->topics[v];
+	}
+
+	/* the MQTT maximum */
+	if(get_varint(reader->fptr, &len) || len > 268435455){
+		return -1;
+	}
+	record->payloadlen = (int)len;
+	record->hash = 0;
+	if(flags & CAPTURE_HASH){
+		if(fread(hash, 1, sizeof(hash), reader->fptr) != sizeof(hash)){
+			return -1;
+		}
+		record->hash = get_u64(hash);
+		record->payload = NULL;
+	}else{
+		if(len + 1 > reader->payload_size){
+			free(reader->payload);
+			reader->payload_size = len + 1;
+			reader->payload = malloc(reader->payload_size);
+			if(!reader->payload){
+				reader->payload_size = 0;
+				return -1;
+			}
+		}
+		if(fread(reader->payload, 1, len, reader->fptr) != len){
+			return -1;
+		}
+		/* terminated like the payloads of libmosquitto */
+		reader->payload[len] = '\0';
+		record->payload = reader->payload;
+	}
+	record->time_us = reader->time_us;
+	record->qos = flags & CAPTURE_QOS_MASK;
+	record->retain = (flags & CAPTURE_RETAIN) != 0;
+	return 0;
+}
+
+
+void capture_reader_close(struct capture_reader *reader)
+{
+	uint32_t i;
+
+	if(!reader){
+		return;
+	}
+	if(reader->fptr){
+		fclose(reader->fptr);
+	}
+	for(i=0; i<reader->topic_count; i++){
+		free(reader->topics[i]);
+	}
+	free(reader->topics);
+	free(reader->payload);
+	free(reader);
+}
@@ -0,0 +1,76 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#ifndef SUB_CLIENT_CAPTURE_H
+#define SUB_CLIENT_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <mosquitto.h>
+#include "client_shared.h"
+
+/* Traffic capture (--capture) and the reader used to replay it.
+ *
+ * A trace is the 8 byte magic "MQDPCAP1" and the wall clock time the capture
+ * started (ns since the epoch, 64 bit little endian), then one record per
+ * received message:
+ *
+ *   flags        1 byte, CAPTURE_QOS_MASK, CAPTURE_RETAIN, CAPTURE_TOPIC,
+ *                CAPTURE_HASH
+ *   delay        varint, microseconds since the previous record
+ *   topic        CAPTURE_TOPIC: varint length and the topic, which gets the
+ *                next index (from 0); otherwise varint index of the topic
+ *   length       varint, of the payload
+ *   payload      CAPTURE_HASH: its 64 bit dedup_hash(), little endian;
+ *                otherwise the payload itself
+ *
+ * Varints are LEB128. */
+
+#define CAPTURE_QOS_MASK 0x03
+#define CAPTURE_RETAIN 0x04
+#define CAPTURE_TOPIC 0x08
+#define CAPTURE_HASH 0x10
+
+struct capture_record {
+	uint64_t time_us;      /* since the capture started */
+	const char *topic;
+	const void *payload;   /* NULL with CAPTURE_HASH */
+	int payloadlen;
+	uint64_t hash;         /* with CAPTURE_HASH */
+	int qos;
+	bool retain;
+};
+
+struct capture_reader;
+
+int capture_init(struct mosq_config *cfg);
+
+/* Append a record for message, from the network thread. */
+void capture_message(const struct mosquitto_message *message);
+
+/* Write out what is buffered and close the trace. */
+void capture_cleanup(void);
+
+struct capture_reader *capture_reader_open(const char *path);
+
+/* The next record, valid until the next call. Returns 1 at the end of the
+ * trace, -1 if it is truncated or not a trace. */
+int capture_read(struct capture_reader *reader, struct capture_record *record);
+
+void capture_reader_close(struct capture_reader *reader);
+
+#endif
@@ -0,0 +1,334 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+#include <mosquitto.h>
+#include "client_shared.h"
+#include "sub_client_dedup.h"
+#include "sub_client_intern.h"
+#include "sub_client_stats.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define DEDUP_MIN_SIZE 1024
+
+/* A key of 0 marks a free slot. Keys are hashes themselves, two files
+ * sharing one would also need the same content hash to skip a write. */
+struct dedup_entry {
+	uint64_t key;
+	uint64_t value;
+};
+
+/* Last content of a topic, indexed by its interned id. */
+struct dedup_topic {
+	uint64_t value;
+	bool seen;
+};
+
+static struct dedup_entry *table = NULL;
+static size_t table_size = 0; /* power of two */
+static size_t table_used = 0;
+static struct dedup_topic *states = NULL;
+static uint32_t state_count = 0;
+#ifndef WIN32
+/* writer threads (--writers) check and store concurrently */
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/* input is read as little endian, the hashes never leave the process */
+static uint64_t read64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+
+uint64_t dedup_hash(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+	uint64_t v1, v2, v3, v4;
+	uint64_t h;
+
+	if(len >= 32){
+		v1 = seed + PRIME64_1 + PRIME64_2;
+		v2 = seed + PRIME64_2;
+		v3 = seed;
+		v4 = seed - PRIME64_1;
+		do{
+			v1 = xxh64_round(v1, read64(p));
+			v2 = xxh64_round(v2, read64(p + 8));
+			v3 = xxh64_round(v3, read64(p + 16));
+			v4 = xxh64_round(v4, read64(p + 24));
+			p += 32;
+		}while(end - p >= 32);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	}else{
+		h = seed + PRIME64_5;
+	}
+	h += (uint64_t)len;
+
+	while(end - p >= 8){
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+	}
+	if(end - p >= 4){
+		h ^= (uint64_t)read32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	while(p < end){
+		h ^= (*p) * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+
+/* Linear probing, called with the table locked. */
+static struct dedup_entry *dedup_find(struct dedup_entry *entries, size_t size, uint64_t key)
+{
+	size_t i;
+
+	i = (size_t)key & (size - 1);
+	while(entries[i].key && entries[i].key != key){
+		i = (i + 1) & (size - 1);
+	}
+	return &entries[i];
+}
+
+/* Double the table once it is 3/4 full. */
+static int dedup_grow(void)
+{
+	struct dedup_entry *entries;
+	size_t size;
+	size_t i;
+
+	size = table_size ? table_size*2 : DEDUP_MIN_SIZE;
+	entries = calloc(size, sizeof(struct dedup_entry));
+	if(!entries){
+		return 1;
+	}
+	for(i=0; i<table_size; i++){
+		if(table[i].key){
+			*dedup_find(entries, size, table[i].key) = table[i];
+		}
+	}
+	free(table);
+	table = entries;
+	table_size = size;
+	return 0;
+}
+
+/* True if key holds value. With store the value is remembered for key. */
+static bool dedup_lookup(uint64_t key, uint64_t value, bool store)
+{
+	struct dedup_entry *entry;
+	bool same = false;
+
+	if(key == 0){
+		key = 1;
+	}
+#ifndef WIN32
+	pthread_mutex_lock(&table_mutex);
+#endif
+	if(table_size){
+		entry = dedup_find(table, table_size, key);
+		if(entry->key){
+			same = (entry->value == value);
+			if(store){
+				entry->value = value;
+			}
+			goto unlock;
+		}
+	}
+	if(!store){
+		goto unlock;
+	}
+	if(table_used + 1 > table_size/4*3 && dedup_grow()){
+		/* out of memory, just don't skip this one */
+		goto unlock;
+	}
+	entry = dedup_find(table, table_size, key);
+	entry->key = key;
+	entry->value = value;
+	table_used++;
+	__atomic_store_n(&dedup_stats.entries, (uint64_t)table_used, __ATOMIC_RELAXED);
+
+unlock:
+#ifndef WIN32
+	pthread_mutex_unlock(&table_mutex);
+#endif
+	return same;
+}
+
+
+/* The id is about to be reused for another topic. */
+static void dedup_evict(uint32_t id, const char *topic)
+{
+	UNUSED(topic);
+
+#ifndef WIN32
+	pthread_mutex_lock(&table_mutex);
+#endif
+	if(id < state_count && states[id].seen){
+		states[id].seen = false;
+		__atomic_sub_fetch(&dedup_stats.entries, 1, __ATOMIC_RELAXED);
+	}
+#ifndef WIN32
+	pthread_mutex_unlock(&table_mutex);
+#endif
+}
+
+
+int dedup_init(struct mosq_config *cfg)
+{
+	dedup_stats_enabled = (cfg->dedup != DEDUP_NONE);
+	if(cfg->dedup == DEDUP_CONSECUTIVE){
+		intern_on_evict(dedup_evict);
+	}
+	return 0;
+}
+
+
+bool dedup_message(const struct mosquitto_message *message, uint32_t id)
+{
+	struct dedup_topic *s;
+	uint64_t value;
+	uint32_t count;
+	bool same = false;
+
+	if(id == INTERN_NONE){
+		return false;
+	}
+	value = dedup_hash(message->payload, (size_t)message->payloadlen, 0);
+
+#ifndef WIN32
+	pthread_mutex_lock(&table_mutex);
+#endif
+	if(id >= state_count){
+		count = state_count ? state_count : DEDUP_MIN_SIZE;
+		while(count <= id){
+			count *= 2;
+		}
+		s = realloc(states, count*sizeof(struct dedup_topic));
+		if(!s){
+			/* out of memory, just don't skip this one */
+			goto unlock;
+		}
+		memset(s + state_count, 0, (count - state_count)*sizeof(struct dedup_topic));
+		states = s;
+		state_count = count;
+	}
+	s = &states[id];
+	if(s->seen){
+		same = (s->value == value);
+	}else{
+		s->seen = true;
+		__atomic_add_fetch(&dedup_stats.entries, 1, __ATOMIC_RELAXED);
+	}
+	s->value = value;
+	if(same){
+		__atomic_add_fetch(&dedup_stats.skipped, 1, __ATOMIC_RELAXED);
+	}
+
+unlock:
+#ifndef WIN32
+	pthread_mutex_unlock(&table_mutex);
+#endif
+	return same;
+}
+
+
+bool dedup_unchanged(uint64_t key, uint64_t value)
+{
+	if(dedup_lookup(key, value, false)){
+		__atomic_add_fetch(&dedup_stats.skipped, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+	return false;
+}
+
+
+void dedup_store(uint64_t key, uint64_t value)
+{
+	dedup_lookup(key, value, true);
+}
+
+
+void dedup_cleanup(void)
+{
+	free(table);
+	table = NULL;
+	table_size = 0;
+	table_used = 0;
+	free(states);
+	states = NULL;
+	state_count = 0;
+}
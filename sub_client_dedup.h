@@ -0,0 +1,48 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#ifndef SUB_CLIENT_DEDUP_H
+#define SUB_CLIENT_DEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mosquitto.h>
+#include "client_shared.h"
+
+/* Skipping of unchanged payloads (--dedup). Only a 64 bit hash of the last
+ * content is kept per topic (consecutive, indexed by the interned topic id) or
+ * per output file (overwrite, in one open addressing table shared by all
+ * threads). */
+
+/* XXH64 of data, chain calls through seed to hash several pieces */
+uint64_t dedup_hash(const void *data, size_t len, uint64_t seed);
+
+int dedup_init(struct mosq_config *cfg);
+
+/* --dedup consecutive: true if the payload is the same as the previous one
+ * of this topic, which is then remembered */
+bool dedup_message(const struct mosquitto_message *message, uint32_t id);
+
+/* --dedup overwrite: true if the file (key) was last written with this
+ * content (value). dedup_store() once the content is written. */
+bool dedup_unchanged(uint64_t key, uint64_t value);
+void dedup_store(uint64_t key, uint64_t value);
+
+void dedup_cleanup(void);
+
+#endif
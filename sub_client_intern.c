@@ -0,0 +1,348 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+#include <mosquitto.h>
+#include "client_shared.h"
+#include "sub_client_dedup.h"
+#include "sub_client_intern.h"
+#include "sub_client_stats.h"
+
+#define INTERN_CHUNK_SIZE (64*1024)
+#define INTERN_MIN_SLOTS 1024
+#define INTERN_EVICT_MAX 4
+/* ids are kept in pages that never move, so names can be read unlocked */
+#define INTERN_PAGE_BITS 12
+#define INTERN_PAGE_SIZE (1U<<INTERN_PAGE_BITS)
+#define INTERN_PAGES 16384
+
+struct intern_chunk {
+	struct intern_chunk *next;
+	size_t size;
+	size_t used;
+	size_t live;          /* bytes of topics not evicted */
+	char data[];
+};
+
+struct intern_topic {
+	const char *name;     /* NULL for a free id */
+	struct intern_chunk *chunk;
+	uint32_t hash;
+	uint32_t len;
+	bool used;            /* seen since the last eviction pass */
+};
+
+/* Index slot, the hash is kept to compare names only on a likely match. */
+struct intern_slot {
+	uint32_t hash;
+	uint32_t id;          /* id + 1, 0 marks a free slot */
+};
+
+static struct mosq_config *intern_cfg = NULL;
+static struct intern_chunk *chunks = NULL; /* the first one is being filled */
+static size_t chunk_bytes = 0;
+static struct intern_topic *pages[INTERN_PAGES];
+static uint32_t topic_count = 0;
+static uint32_t topic_size = 0;  /* ids in allocated pages */
+static uint32_t *free_ids = NULL;
+static uint32_t free_count = 0;
+static struct intern_slot *slots = NULL;
+static size_t slot_size = 0;  /* power of two */
+static size_t slot_used = 0;
+static size_t budget = 0;
+static intern_evict_fn evict_fns[INTERN_EVICT_MAX];
+static int evict_count = 0;
+#ifndef WIN32
+/* only the benchmark calls the message callback from several threads */
+static pthread_mutex_t intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+static struct intern_topic *intern_get(uint32_t id)
+{
+	return &pages[id >> INTERN_PAGE_BITS][id & (INTERN_PAGE_SIZE - 1)];
+}
+
+static size_t intern_bytes(void)
+{
+	return chunk_bytes
+		+ topic_size*(sizeof(struct intern_topic) + sizeof(uint32_t))
+		+ slot_size*sizeof(struct intern_slot);
+}
+
+static void intern_slot_add(struct intern_slot *s, size_t size, uint32_t hash, uint32_t id)
+{
+	size_t i;
+
+	i = hash & (size - 1);
+	while(s[i].id){
+		i = (i + 1) & (size - 1);
+	}
+	s[i].hash = hash;
+	s[i].id = id + 1;
+}
+
+/* Rebuild the index from the live topics. */
+static int intern_index(size_t size)
+{
+	struct intern_slot *s;
+	uint32_t id;
+
+	s = calloc(size, sizeof(struct intern_slot));
+	if(!s){
+		return 1;
+	}
+	slot_used = 0;
+	for(id=0; id<topic_count; id++){
+		if(intern_get(id)->name){
+			intern_slot_add(s, size, intern_get(id)->hash, id);
+			slot_used++;
+		}
+	}
+	free(slots);
+	slots = s;
+	slot_size = size;
+	return 0;
+}
+
+/* Copy the name into the current chunk. */
+static const char *intern_store(const char *topic, size_t len, struct intern_chunk **chunk)
+{
+	struct intern_chunk *c;
+	size_t size;
+	char *name;
+
+	if(!chunks || chunks->size - chunks->used < len + 1){
+		size = len + 1 > INTERN_CHUNK_SIZE ? len + 1 : INTERN_CHUNK_SIZE;
+		c = malloc(sizeof(struct intern_chunk) + size);
+		if(!c){
+			return NULL;
+		}
+		c->next = chunks;
+		c->size = size;
+		c->used = 0;
+		c->live = 0;
+		chunks = c;
+		chunk_bytes += size;
+	}
+	name = chunks->data + chunks->used;
+	memcpy(name, topic, len + 1);
+	chunks->used += len + 1;
+	chunks->live += len + 1;
+	*chunk = chunks;
+	return name;
+}
+
+/* Evict the topics not seen since the previous pass. Chunks are freed once
+ * all of their topics are gone. */
+static void intern_evict(void)
+{
+	struct intern_chunk **cp, *c;
+	struct intern_topic *t;
+	uint64_t evicted = 0;
+	uint32_t id;
+	int i;
+
+	for(id=0; id<topic_count; id++){
+		t = intern_get(id);
+		if(!t->name){
+			continue;
+		}
+		if(t->used){
+			t->used = false;
+			continue;
+		}
+		for(i=0; i<evict_count; i++){
+			evict_fns[i](id, t->name);
+		}
+		t->chunk->live -= t->len + 1;
+		__atomic_store_n(&t->name, NULL, __ATOMIC_RELEASE);
+		t->chunk = NULL;
+		free_ids[free_count++] = id;
+		evicted++;
+	}
+
+	cp = chunks ? &chunks->next : &chunks;
+	while(*cp){
+		c = *cp;
+		if(c->live == 0){
+			*cp = c->next;
+			chunk_bytes -= c->size;
+			free(c);
+		}else{
+			cp = &c->next;
+		}
+	}
+	intern_index(slot_size);
+
+	__atomic_add_fetch(&intern_stats.evicted, evicted, __ATOMIC_RELAXED);
+	__atomic_store_n(&intern_stats.topics, (uint64_t)slot_used, __ATOMIC_RELAXED);
+	__atomic_store_n(&intern_stats.bytes, (uint64_t)intern_bytes(), __ATOMIC_RELAXED);
+	if(intern_bytes() > budget/4*3){
+		/* mostly active topics, evicting them would only thrash */
+		budget *= 2;
+		err_printf(intern_cfg, "Warning: Active topics need more than --topic-memory, raised to %llu bytes.\n",
+				(unsigned long long)budget);
+	}
+}
+
+/* Room for one more id, a page at a time. */
+static int intern_grow(void)
+{
+	struct intern_topic *t;
+	uint32_t *f;
+	uint32_t size;
+
+	if(topic_size/INTERN_PAGE_SIZE == INTERN_PAGES){
+		return 1;
+	}
+	size = topic_size + INTERN_PAGE_SIZE;
+	f = realloc(free_ids, size*sizeof(uint32_t));
+	if(!f){
+		return 1;
+	}
+	free_ids = f;
+	t = calloc(INTERN_PAGE_SIZE, sizeof(struct intern_topic));
+	if(!t){
+		return 1;
+	}
+	__atomic_store_n(&pages[topic_size/INTERN_PAGE_SIZE], t, __ATOMIC_RELEASE);
+	topic_size = size;
+	return 0;
+}
+
+
+int intern_init(struct mosq_config *cfg)
+{
+	intern_cfg = cfg;
+	budget = cfg->topic_memory;
+	intern_stats_enabled = true;
+	return 0;
+}
+
+
+void intern_on_evict(intern_evict_fn evict)
+{
+	if(evict_count < INTERN_EVICT_MAX){
+		evict_fns[evict_count++] = evict;
+	}
+}
+
+
+uint32_t intern_topic(const char *topic)
+{
+	struct intern_chunk *chunk;
+	struct intern_topic *t;
+	const char *name;
+	uint32_t hash;
+	uint32_t id = INTERN_NONE;
+	size_t len;
+	size_t i;
+
+	len = strlen(topic);
+	hash = (uint32_t)dedup_hash(topic, len, 0);
+
+#ifndef WIN32
+	pthread_mutex_lock(&intern_mutex);
+#endif
+	if(slot_size){
+		i = hash & (slot_size - 1);
+		while(slots[i].id){
+			t = intern_get(slots[i].id - 1);
+			if(slots[i].hash == hash && t->name && t->len == len && !memcmp(t->name, topic, len)){
+				t->used = true;
+				id = slots[i].id - 1;
+				goto unlock;
+			}
+			i = (i + 1) & (slot_size - 1);
+		}
+	}
+
+	if(budget && intern_bytes() + len + 1 > budget){
+		intern_evict();
+	}
+	if(!free_count && topic_count == topic_size && intern_grow()){
+		goto unlock;
+	}
+	if((slot_used + 1)*4 > slot_size*3 && intern_index(slot_size ? slot_size*2 : INTERN_MIN_SLOTS)){
+		goto unlock;
+	}
+	name = intern_store(topic, len, &chunk);
+	if(!name){
+		goto unlock;
+	}
+
+	id = free_count ? free_ids[--free_count] : topic_count++;
+	t = intern_get(id);
+	t->chunk = chunk;
+	t->hash = hash;
+	t->len = (uint32_t)len;
+	t->used = true;
+	__atomic_store_n(&t->name, name, __ATOMIC_RELEASE);
+	intern_slot_add(slots, slot_size, hash, id);
+	slot_used++;
+
+	__atomic_store_n(&intern_stats.topics, (uint64_t)slot_used, __ATOMIC_RELAXED);
+	__atomic_store_n(&intern_stats.bytes, (uint64_t)intern_bytes(), __ATOMIC_RELAXED);
+
+unlock:
+#ifndef WIN32
+	pthread_mutex_unlock(&intern_mutex);
+#endif
+	return id;
+}
+
+
+const char *intern_name(uint32_t id)
+{
+	struct intern_topic *page;
+
+	page = __atomic_load_n(&pages[id >> INTERN_PAGE_BITS], __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&page[id & (INTERN_PAGE_SIZE - 1)].name, __ATOMIC_ACQUIRE);
+}
+
+
+void intern_cleanup(void)
+{
+	struct intern_chunk *c;
+	uint32_t i;
+
+	while(chunks){
+		c = chunks->next;
+		free(chunks);
+		chunks = c;
+	}
+	chunk_bytes = 0;
+	for(i=0; i<topic_size/INTERN_PAGE_SIZE; i++){
+		free(pages[i]);
+		pages[i] = NULL;
+	}
+	topic_count = topic_size = 0;
+	free(free_ids);
+	free_ids = NULL;
+	free_count = 0;
+	free(slots);
+	slots = NULL;
+	slot_size = slot_used = 0;
+	evict_count = 0;
+}
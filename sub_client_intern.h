@@ -0,0 +1,53 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#ifndef SUB_CLIENT_INTERN_H
+#define SUB_CLIENT_INTERN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "client_shared.h"
+
+/* Topic interning for the per topic features (--sample, --rollup, --dedup
+ * consecutive). Every topic gets a dense id, which those features use to
+ * index their state arrays instead of keeping their own copies of the topic.
+ * The names are stored in 64 KiB chunks.
+ *
+ * Above --topic-memory bytes, topics not seen since the previous eviction
+ * pass are evicted: the evict functions are called for each so state kept
+ * for the id can be written out and reset, then the id is reused. Names of
+ * live topics never move. */
+
+#define INTERN_NONE UINT32_MAX
+
+/* called with the topic still interned, in the order registered, must not
+ * call back into intern_*() */
+typedef void (*intern_evict_fn)(uint32_t id, const char *name);
+
+int intern_init(struct mosq_config *cfg);
+void intern_on_evict(intern_evict_fn evict);
+
+/* id of topic, interned on first sight. INTERN_NONE if out of memory. */
+uint32_t intern_topic(const char *topic);
+
+/* Name of a live id, without locking: the features call it with their own
+ * lock held, which the evict functions take under the intern lock. */
+const char *intern_name(uint32_t id);
+
+void intern_cleanup(void);
+
+#endif
@@ -24,7 +24,6 @@ Contributors:
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <libgen.h> /* dirname, basename */
 #ifndef WIN32
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -39,15 +38,33 @@ Contributors:
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#ifndef WIN32
+#include <sys/resource.h>
+#include <sys/uio.h>
+#else
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#endif
 
 #ifdef __APPLE__
 #  include <sys/time.h>
 #endif
 
+#ifdef WIN32
+#  define THREAD_LOCAL __declspec(thread)
+#else
+#  define THREAD_LOCAL __thread
+#endif
+
 #include <mosquitto.h>
 #include "client_shared.h"
+#include "sub_client_dedup.h"
+#include "sub_client_stats.h"
+#include "sub_client_trace.h"
 
-extern struct mosq_config cfg;
+static THREAD_LOCAL struct tm tm_buf;
 
 static int get_time(struct tm **ti, long *ns)
 {
@@ -71,16 +88,19 @@ static int get_time(struct tm **ti, long *ns)
 	*ns = tv.tv_usec*1000;
 #else
 	if(clock_gettime(CLOCK_REALTIME, &ts) != 0){
-		err_printf(&cfg, "Error obtaining system time.\n");
 		return 1;
 	}
 	s = ts.tv_sec;
 	*ns = ts.tv_nsec;
 #endif
 
+#ifdef WIN32
 	*ti = localtime(&s);
+#else
+	/* localtime() re-reads the zone (and strdup's its name) on every call */
+	*ti = localtime_r(&s, &tm_buf);
+#endif
 	if(!(*ti)){
-		err_printf(&cfg, "Error obtaining system time.\n");
 		return 1;
 	}
 
@@ -88,60 +108,60 @@ static int get_time(struct tm **ti, long *ns)
 }
 
 
-static void write_payload(const unsigned char *payload, int payloadlen, int hex)
+static void write_payload(FILE *out, const unsigned char *payload, int payloadlen, int hex)
 {
 	int i;
 
 	if(hex == 0){
-		(void)fwrite(payload, 1, payloadlen, stdout);
+		(void)fwrite(payload, 1, payloadlen, out);
 	}else if(hex == 1){
 		for(i=0; i<payloadlen; i++){
-			fprintf(stdout, "%02x", payload[i]);
+			fprintf(out, "%02x", payload[i]);
 		}
 	}else if(hex == 2){
 		for(i=0; i<payloadlen; i++){
-			fprintf(stdout, "%02X", payload[i]);
+			fprintf(out, "%02X", payload[i]);
 		}
 	}
 }
 
 
-static void write_json_payload(const char *payload, int payloadlen)
+static void write_json_payload(FILE *out, const char *payload, int payloadlen)
 {
 	int i;
 
 	for(i=0; i<payloadlen; i++){
 		if(payload[i] == '"' || payload[i] == '\\' || (payload[i] >=0 && payload[i] < 32)){
-			printf("\\u%04x", payload[i]);
+			fprintf(out, "\\u%04x", payload[i]);
 		}else{
-			fputc(payload[i], stdout);
+			fputc(payload[i], out);
 		}
 	}
 }
 
 
-static void json_print(const struct mosquitto_message *message, const struct tm *ti, bool escaped)
+static void json_print(FILE *out, const struct mosquitto_message *message, const struct tm *ti, bool escaped)
 {
 	char buf[100];
 
 	strftime(buf, 100, "%s", ti);
-	printf("{\"tst\":%s,\"topic\":\"%s\",\"qos\":%d,\"retain\":%d,\"payloadlen\":%d,", buf, message->topic, message->qos, message->retain, message->payloadlen);
+	fprintf(out, "{\"tst\":%s,\"topic\":\"%s\",\"qos\":%d,\"retain\":%d,\"payloadlen\":%d,", buf, message->topic, message->qos, message->retain, message->payloadlen);
 	if(message->qos > 0){
-		printf("\"mid\":%d,", message->mid);
+		fprintf(out, "\"mid\":%d,", message->mid);
 	}
 	if(escaped){
-		fputs("\"payload\":\"", stdout);
-		write_json_payload(message->payload, message->payloadlen);
-		fputs("\"}", stdout);
+		fputs("\"payload\":\"", out);
+		write_json_payload(out, message->payload, message->payloadlen);
+		fputs("\"}", out);
 	}else{
-		fputs("\"payload\":", stdout);
-		write_payload(message->payload, message->payloadlen, 0);
-		fputs("}", stdout);
+		fputs("\"payload\":", out);
+		write_payload(out, message->payload, message->payloadlen, 0);
+		fputs("}", out);
 	}
 }
 
 
-static void formatted_print(const struct mosq_config *lcfg, const struct mosquitto_message *message)
+static void formatted_print(FILE *out, const struct mosq_config *lcfg, const struct mosquitto_message *message)
 {
 	int len;
 	int i;
@@ -158,7 +178,7 @@ static void formatted_print(const struct mosq_config *lcfg, const struct mosquit
 				i++;
 				switch(lcfg->format[i]){
 					case '%':
-						fputc('%', stdout);
+						fputc('%', out);
 						break;
 
 					case 'I':
@@ -169,7 +189,7 @@ static void formatted_print(const struct mosq_config *lcfg, const struct mosquit
 							}
 						}
 						if(strftime(buf, 100, "%FT%T%z", ti) != 0){
-							fputs(buf, stdout);
+							fputs(buf, out);
 						}
 						break;
 
@@ -180,7 +200,7 @@ static void formatted_print(const struct mosq_config *lcfg, const struct mosquit
 								return;
 							}
 						}
-						json_print(message, ti, true);
+						json_print(out, message, ti, true);
 						break;
 
 					case 'J':
@@ -190,35 +210,35 @@ static void formatted_print(const struct mosq_config *lcfg, const struct mosquit
 								return;
 							}
 						}
-						json_print(message, ti, false);
+						json_print(out, message, ti, false);
 						break;
 
 					case 'l':
-						printf("%d", message->payloadlen);
+						fprintf(out, "%d", message->payloadlen);
 						break;
 
 					case 'm':
-						printf("%d", message->mid);
+						fprintf(out, "%d", message->mid);
 						break;
 
 					case 'p':
-						write_payload(message->payload, message->payloadlen, 0);
+						write_payload(out, message->payload, message->payloadlen, 0);
 						break;
 
 					case 'q':
-						fputc(message->qos + 48, stdout);
+						fputc(message->qos + 48, out);
 						break;
 
 					case 'r':
 						if(message->retain){
-							fputc('1', stdout);
+							fputc('1', out);
 						}else{
-							fputc('0', stdout);
+							fputc('0', out);
 						}
 						break;
 
 					case 't':
-						fputs(message->topic, stdout);
+						fputs(message->topic, out);
 						break;
 
 					case 'U':
@@ -229,16 +249,16 @@ static void formatted_print(const struct mosq_config *lcfg, const struct mosquit
 							}
 						}
 						if(strftime(buf, 100, "%s", ti) != 0){
-							printf("%s.%09ld", buf, ns);
+							fprintf(out, "%s.%09ld", buf, ns);
 						}
 						break;
 
 					case 'x':
-						write_payload(message->payload, message->payloadlen, 1);
+						write_payload(out, message->payload, message->payloadlen, 1);
 						break;
 
 					case 'X':
-						write_payload(message->payload, message->payloadlen, 2);
+						write_payload(out, message->payload, message->payloadlen, 2);
 						break;
 				}
 			}
@@ -246,7 +266,7 @@ static void formatted_print(const struct mosq_config *lcfg, const struct mosquit
 			if(i < len-1){
 				i++;
 				if(lcfg->format[i] == '@'){
-					fputc('@', stdout);
+					fputc('@', out);
 				}else{
 					if(!ti){
 						if(get_time(&ti, &ns)){
@@ -260,10 +280,10 @@ static void formatted_print(const struct mosq_config *lcfg, const struct mosquit
 					strf[2] = 0;
 
 					if(lcfg->format[i] == 'N'){
-						printf("%09ld", ns);
+						fprintf(out, "%09ld", ns);
 					}else{
 						if(strftime(buf, 100, strf, ti) != 0){
-							fputs(buf, stdout);
+							fputs(buf, out);
 						}
 					}
 				}
@@ -273,76 +293,331 @@ static void formatted_print(const struct mosq_config *lcfg, const struct mosquit
 				i++;
 				switch(lcfg->format[i]){
 					case '\\':
-						fputc('\\', stdout);
+						fputc('\\', out);
 						break;
 
 					case '0':
-						fputc('\0', stdout);
+						fputc('\0', out);
 						break;
 
 					case 'a':
-						fputc('\a', stdout);
+						fputc('\a', out);
 						break;
 
 					case 'e':
-						fputc('\033', stdout);
+						fputc('\033', out);
 						break;
 
 					case 'n':
-						fputc('\n', stdout);
+						fputc('\n', out);
 						break;
 
 					case 'r':
-						fputc('\r', stdout);
+						fputc('\r', out);
 						break;
 
 					case 't':
-						fputc('\t', stdout);
+						fputc('\t', out);
 						break;
 
 					case 'v':
-						fputc('\v', stdout);
+						fputc('\v', out);
 						break;
 				}
 			}
 		}else{
-			fputc(lcfg->format[i], stdout);
+			fputc(lcfg->format[i], out);
 		}
 	}
 	if(lcfg->eol){
-		fputc('\n', stdout);
+		fputc('\n', out);
 	}
-	fflush(stdout);
+	fflush(out);
 }
 
 
-void print_message(struct mosq_config *cfg, const struct mosquitto_message *message)
+/* Per thread render context, so print_message_file() can run from several
+   threads at once. It holds the resolved output path and the -F stream, both
+   growing to fit, and a bump allocator for the strings built while handling
+   one message (expanded mask tokens, path copies). The allocator is reset
+   once the message has been written; after the first messages everything
+   has grown to fit and no further heap allocation is made.
+*/
+/* ------------------------------------------------------------- */
+#define ARENA_MIN_SIZE 4096
+#define ARENA_KEEP_MAX (64*1024)  /* larger chunks are not kept across messages */
+
+struct arena_chunk {
+	struct arena_chunk *prev;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+/* --fmask path cache, see path_cache_get() */
+struct path_cache_entry {
+	uint64_t hash;        /* of the topic, 0 marks a free slot */
+	size_t topic;         /* offsets into strings */
+	size_t path;
+	size_t path_len;
+};
+
+struct path_cache {
+	struct path_cache_entry *entries;
+	size_t size;          /* power of two */
+	size_t used;
+	char *strings;        /* topics and paths */
+	size_t strings_len;
+	size_t strings_size;
+	int unit;             /* finest time field of the mask, PATH_CACHE_* */
+	time_t time;          /* second gen was computed for */
+	uint64_t gen;
+};
+
+#ifndef WIN32
+/* --fmask directory fds, see dir_open() */
+#define DIR_CACHE_MIN 16
+#define DIR_CACHE_MAX 4096    /* open fds per thread, all closed once full */
+
+struct dir_cache_entry {
+	char *path;           /* NULL marks a free slot, "" is the root */
+	size_t len;
+	uint64_t hash;
+	int fd;
+};
+#endif
+
+struct render_ctx {
+	struct arena_chunk *arena;
+	char *path;           /* resolved output file */
+	size_t path_len;
+	size_t path_size;
+	const char *topic;    /* topic of the message, for @topic */
+	int payloadlen;       /* of the message, for the tracepoints */
+	FILE *stream;         /* -F rendering, see _fmask() */
+	char *stream_buf;
+	size_t stream_size;
+	struct path_cache cache;
+#ifndef WIN32
+	struct dir_cache_entry *dirs;
+	size_t dirs_size;     /* power of two */
+	size_t dirs_used;
+	size_t dirs_max;
+	time_t dirs_time;     /* second the fds were opened in */
+#endif
+#ifdef O_DIRECT
+	char *direct_buf;     /* --direct staging, DIRECT_ALIGN aligned */
+#endif
+};
+
+static THREAD_LOCAL struct render_ctx render;
+
+static void *arena_alloc(struct render_ctx *ctx, size_t len)
 {
+	struct arena_chunk *chunk;
+	size_t size;
+	void *p;
+
+	len = (len + 7) & ~(size_t)7;
+	if(!ctx->arena || ctx->arena->size - ctx->arena->used < len){
+		size = ctx->arena ? ctx->arena->size*2 : ARENA_MIN_SIZE;
+		while(size < len){
+			size *= 2;
+		}
+		chunk = malloc(sizeof(struct arena_chunk) + size);
+		if(!chunk) return NULL;
+		chunk->prev = ctx->arena;
+		chunk->size = size;
+		chunk->used = 0;
+		ctx->arena = chunk;
+	}
+	p = ctx->arena->data + ctx->arena->used;
+	ctx->arena->used += len;
+	return p;
+}
+
+static char *arena_strdup(struct render_ctx *ctx, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *p;
+
+	p = arena_alloc(ctx, len);
+	if(p){
+		memcpy(p, str, len);
+	}
+	return p;
+}
+
+/* Keep only the newest, largest, chunk so the next message fits in one,
+   unless an unusually long path made it grow past ARENA_KEEP_MAX. */
+static void arena_reset(struct render_ctx *ctx)
+{
+	struct arena_chunk *prev;
+
+	if(!ctx->arena) return;
+	while(ctx->arena->prev){
+		prev = ctx->arena->prev;
+		ctx->arena->prev = prev->prev;
+		free(prev);
+	}
+	if(ctx->arena->size > ARENA_KEEP_MAX){
+		free(ctx->arena);
+		ctx->arena = NULL;
+		return;
+	}
+	ctx->arena->used = 0;
+}
+
+static int path_append(struct render_ctx *ctx, const char *str, size_t len)
+{
+	size_t size;
+	char *path;
+
+	if(ctx->path_len + len + 1 > ctx->path_size){
+		size = ctx->path_size ? ctx->path_size : 256;
+		while(ctx->path_len + len + 1 > size){
+			size *= 2;
+		}
+		path = realloc(ctx->path, size);
+		if(!path) return 1;
+		ctx->path = path;
+		ctx->path_size = size;
+	}
+	memcpy(ctx->path + ctx->path_len, str, len);
+	ctx->path_len += len;
+	ctx->path[ctx->path_len] = '\0';
+	return 0;
+}
+
+static int path_appends(struct render_ctx *ctx, const char *str)
+{
+	return path_append(ctx, str, strlen(str));
+}
+
+/* The per thread memory stream, rewound for a new record. */
+static FILE *render_stream(struct render_ctx *ctx)
+{
+	if(!ctx->stream) {
+		ctx->stream = open_memstream(&ctx->stream_buf, &ctx->stream_size);
+		if(!ctx->stream) {
+			return NULL;
+		}
+	}
+	rewind(ctx->stream);
+	return ctx->stream;
+}
+
+/* Drop the stream once a large payload made it grow past ARENA_KEEP_MAX. */
+static void render_stream_trim(struct render_ctx *ctx)
+{
+	if(ctx->stream && ctx->stream_size > ARENA_KEEP_MAX) {
+		fclose(ctx->stream);
+		free(ctx->stream_buf);
+		ctx->stream = NULL;
+		ctx->stream_buf = NULL;
+		ctx->stream_size = 0;
+	}
+}
+
+#ifndef WIN32
+/* Close every cached directory fd. */
+static void dir_cache_clear(struct render_ctx *ctx)
+{
+	size_t i;
+
+	if(!ctx->dirs) return;
+	for(i=0; i<ctx->dirs_size; i++){
+		if(ctx->dirs[i].path){
+			close(ctx->dirs[i].fd);
+			profile_syscalls(PROF_MKDIR, 1);
+			free(ctx->dirs[i].path);
+		}
+	}
+	memset(ctx->dirs, 0, ctx->dirs_size*sizeof(struct dir_cache_entry));
+	ctx->dirs_used = 0;
+}
+#endif
+
+/* Release the render context of the calling thread. */
+void print_message_cleanup(void)
+{
+	struct render_ctx *ctx = &render;
+
+	arena_reset(ctx);
+	free(ctx->arena);
+	free(ctx->path);
+	if(ctx->stream){
+		fclose(ctx->stream);
+	}
+	free(ctx->stream_buf);
+	free(ctx->cache.entries);
+	free(ctx->cache.strings);
+#ifndef WIN32
+	dir_cache_clear(ctx);
+	free(ctx->dirs);
+#endif
+#ifdef O_DIRECT
+	free(ctx->direct_buf);
+#endif
+	memset(ctx, 0, sizeof(struct render_ctx));
+}
+/* ------------------------------------------------------------- */
+
+/* Render the record into the per thread stream and hand it to stdout with
+   one fwrite(), so records printed from several threads never interleave. */
+int print_message(struct mosq_config *cfg, const struct mosquitto_message *message)
+{
+	struct render_ctx *ctx = &render;
+	FILE *out;
+	long len;
+	int rc = 0;
+
+	if(!cfg->format && !cfg->verbose && !message->payloadlen){
+		return 0;
+	}
+	out = render_stream(ctx);
+	if(!out){
+		return 1;
+	}
+
 	if(cfg->format){
-		formatted_print(cfg, message);
+		formatted_print(out, cfg, message);
 	}else if(cfg->verbose){
 		if(message->payloadlen){
-			printf("%s ", message->topic);
-			write_payload(message->payload, message->payloadlen, false);
+			fprintf(out, "%s ", message->topic);
+			write_payload(out, message->payload, message->payloadlen, false);
 			if(cfg->eol){
-				printf("\n");
+				fputc('\n', out);
 			}
 		}else{
 			if(cfg->eol){
-				printf("%s (null)\n", message->topic);
+				fprintf(out, "%s (null)\n", message->topic);
 			}
 		}
-		fflush(stdout);
 	}else{
-		if(message->payloadlen){
-			write_payload(message->payload, message->payloadlen, false);
-			if(cfg->eol){
-				printf("\n");
-			}
-			fflush(stdout);
+		write_payload(out, message->payload, message->payloadlen, false);
+		if(cfg->eol){
+			fputc('\n', out);
 		}
 	}
+	fflush(out);
+	len = ftell(out);
+
+	if(len > 0 && fwrite(ctx->stream_buf, 1, (size_t)len, stdout) != (size_t)len){
+		rc = 1;
+	}
+	if(fflush(stdout)){
+		rc = 1;
+	}
+	if(rc){
+		/* the error flag is sticky, only this record failed */
+		clearerr(stdout);
+	}
+	latency_mark(LAT_WRITE);
+	render_stream_trim(ctx);
+	return rc;
 }
+/* ------------------------------------------------------------- */
 
 /*
 @(#)Purpose:        Create all directories in path
@@ -358,8 +633,10 @@ static int do_mkdir(const char *path, mode_t mode)
 	Stat st;
 	int status = 0;
 
+	profile_syscalls(PROF_MKDIR, 1);
 	if (stat(path, &st) != 0) {
 		/* Directory does not exist. EEXIST for race condition */
+		profile_syscalls(PROF_MKDIR, 1);
 		if (mkdir(path, mode) != 0 && errno != EEXIST)
 			status = -1;
 	} else if (!S_ISDIR(st.st_mode)) {
@@ -375,13 +652,14 @@ static int do_mkdir(const char *path, mode_t mode)
 ** each directory in path exists, rather than optimistically creating
 ** the last element and working backwards.
 */
-static int mkpath(const char *path, mode_t mode)
+static int mkpath(struct render_ctx *ctx, const char *path, mode_t mode)
 {
 	char *pp;
 	char *sp;
 	int  status;
-	char *copypath = strdup(path);
+	char *copypath = arena_strdup(ctx, path);
 
+	if(!copypath) return -1;
 	status = 0;
 	pp = copypath;
 	while (status == 0 && (sp = strchr(pp, '/')) != 0) {
@@ -395,7 +673,6 @@ static int mkpath(const char *path, mode_t mode)
 	}
 	if (status == 0)
 		status = do_mkdir(path, mode);
-	free(copypath);
 	return (status);
 }
 /* ------------------------------------------------------------- */
@@ -415,18 +692,22 @@ static int mkpath(const char *path, mode_t mode)
 #define FMASK_MINUTE 8
 #define FMASK_SECOND 9
 
-static const char *datetime(int fmt)
+static const char *datetime(struct render_ctx *ctx, int fmt)
 {
 	int n;
 	int size = 16;     /* limit 16 bytes. */
 	char *dt;
-	if ((dt = malloc(size)) == NULL)
+	if ((dt = arena_alloc(ctx, size)) == NULL)
 	       return NULL;
 
 	time_t current;
 	struct tm      *now;
 	current  = time(NULL);
+#ifdef WIN32
 	now = localtime(&current);
+#else
+	now = localtime_r(&current, &tm_buf);
+#endif
 
 	switch(fmt) {
 		case FMASK_EPOCH:
@@ -471,26 +752,20 @@ static const char *datetime(int fmt)
 	if (n > -1 && n < size) {
 		return dt;
 	} else {
-		free(dt);
 		return NULL;
 	}
 }
 /* ------------------------------------------------------------- */
 
-/* Expand/resolve fmask token string. */
+/* Expand/resolve fmask token string, appending it to the output path. */
 /* ------------------------------------------------------------- */
-static void _setfmask(char *token, void *obj)
+static int _setfmask(struct render_ctx *ctx, char *token, const struct mosq_config *cfg)
 {
-	struct mosq_config *cfg;
-
-	assert(obj);
-	cfg = (struct mosq_config *)obj;
-
 	char *str2, *subtoken;
 	char *saveptr2;
 
-	char *to = cfg->ftoken;      /* limit 1000 bytes. */
 	const char *dt;
+	int n;
 
 	for (str2 = token; ; str2 = NULL) {
 		subtoken = strtok_r(str2, "@", &saveptr2);
@@ -499,75 +774,62 @@ static void _setfmask(char *token, void *obj)
 
 		/* format type */
 		if(!strcmp(subtoken, "epoch")) {
-			dt = datetime(0);
+			dt = datetime(ctx, 0);
 		} else if(!strcmp(subtoken, "date")) {
-			dt = datetime(1);
+			dt = datetime(ctx, 1);
 		} else if(!strcmp(subtoken, "year")) {
-			dt = datetime(2);
+			dt = datetime(ctx, 2);
 		} else if(!strcmp(subtoken, "month")) {
-			dt = datetime(3);
+			dt = datetime(ctx, 3);
 		} else if(!strcmp(subtoken, "day")) {
-			dt = datetime(4);
+			dt = datetime(ctx, 4);
 		} else if(!strcmp(subtoken, "datetime")) {
-			dt = datetime(5);
+			dt = datetime(ctx, 5);
 		} else if(!strcmp(subtoken, "time")) {
-			dt = datetime(6);
+			dt = datetime(ctx, 6);
 		} else if(!strcmp(subtoken, "hour")) {
-			dt = datetime(7);
+			dt = datetime(ctx, 7);
 		} else if(!strcmp(subtoken, "min")) {
-			dt = datetime(8);
+			dt = datetime(ctx, 8);
 		} else if(!strcmp(subtoken, "sec")) {
-			dt = datetime(9);
+			dt = datetime(ctx, 9);
 		} else if(!strcmp(subtoken, "topic")) {
-			dt = cfg->fmask_topic;
-		} else if(!strcmp(subtoken, "topic1")) {
-			dt = cfg->topics[0];
-		} else if(!strcmp(subtoken, "topic2")) {
-			dt = cfg->topics[1];
-		} else if(!strcmp(subtoken, "topic3")) {
-			dt = cfg->topics[2];
-		} else if(!strcmp(subtoken, "topic4")) {
-			dt = cfg->topics[3];
-		} else if(!strcmp(subtoken, "topic5")) {
-			dt = cfg->topics[4];
-		} else if(!strcmp(subtoken, "topic6")) {
-			dt = cfg->topics[5];
-		} else if(!strcmp(subtoken, "topic7")) {
-			dt = cfg->topics[6];
-		} else if(!strcmp(subtoken, "topic8")) {
-			dt = cfg->topics[7];
-		} else if(!strcmp(subtoken, "topic9")) {
-			dt = cfg->topics[8];
+			dt = ctx->topic;
+		} else if(!strncmp(subtoken, "topic", 5)
+				&& subtoken[5] >= '1' && subtoken[5] <= '9' && subtoken[6] == '\0') {
+			/* @topic1 .. @topic9, subscriptions given with -t */
+			n = subtoken[5] - '1';
+			dt = n < cfg->topic_count ? cfg->topics[n] : NULL;
 		} else if(!strcmp(subtoken, "id")) {
 			dt = cfg->idtext;
 		} else {
-			dt = strdup(subtoken);
+			dt = subtoken;
 		}
 
-		to = stpcpy(to, dt);
+		if(dt && path_appends(ctx, dt)) {
+			return 1;
+		}
 	}
+	return 0;
 }
 
 /* Expand --fmask string options for output filename. */
 /* ------------------------------------------------------------- */
-static void _fmask(char *fmask, void *obj, const struct mosquitto_message *message)
+static int _fmask(struct render_ctx *ctx, const char *fmask, const struct mosq_config *cfg, const struct mosquitto_message *message)
 {
-	struct mosq_config *cfg;
-
-	assert(obj);
-	cfg = (struct mosq_config *)obj;
-
 	char *str1, *token;
 	char *saveptr1;
 
 	char *path;
-	path = strdup(fmask);
-	char *to = cfg->ffmask;      /* limit 1000 bytes. */
-	if(cfg->verbose == 1) {
-		printf("%s\t", path); /* if verbose (-v) is enabled */
+	path = arena_strdup(ctx, fmask);
+	if(!path) {
+		return 1;
+	}
+	ctx->path_len = 0;
+	/* make sure path starts with a slash */
+	if(path_appends(ctx, "/")) {
+		return 1;
 	}
-
-	to = stpcpy(to, "/");  /* make sure path starts with a slash */
 	if(cfg->format == NULL && strlen(cfg->fmask) >= 1) {
 		for (str1 = path; ; str1 = NULL) {
 			token = strtok_r(str1, "/", &saveptr1);
@@ -575,123 +837,847 @@ static void _fmask(char *fmask, void *obj, const struct mosquitto_message *messa
 				break;
 
 			/* format type */
-			_setfmask(token, cfg);
-			to = stpcpy(to, cfg->ftoken);
-			to = stpcpy(to, "/");
+			if(_setfmask(ctx, token, cfg) || path_appends(ctx, "/")) {
+				return 1;
+			}
 		}
 	} else { /* experimental */
-		char buf[1000] = { 0 };
-		fclose(stdout);
-		stdout = fmemopen(buf, sizeof(buf), "w");
-		setbuf(stdout, NULL);
-		formatted_print(cfg, message);
-		to = stpcpy(to, buf);
-		int fd;
-		fd = open("/dev/tty",  O_WRONLY);
-		stdout = fdopen(fd, "w");    
-	}
-
-	to[strlen(to)-1] = '\0';
+		/* render -F into a per thread memory stream, opened once */
+		if(!render_stream(ctx)) {
+			return 1;
+		}
+		formatted_print(ctx->stream, cfg, message);
+		fputc('\0', ctx->stream);
+		fflush(ctx->stream);
+		if(path_appends(ctx, ctx->stream_buf)) {
+			return 1;
+		}
+	}
+
+	/* drop the trailing slash (or -F end of line) */
+	ctx->path[--ctx->path_len] = '\0';
 	if(cfg->verbose == 1) {
-		printf("%s\n", cfg->ffmask); /* if verbose (-v) is enabled */
+		/* if verbose (-v) is enabled, one call so threads don't interleave */
+		printf("%s\t%s\n", fmask, ctx->path);
 	}
+	return 0;
+}
 
+/* Create the directories of the output file ctx->path. */
+static void _mkparent(struct render_ctx *ctx)
+{
+	uint64_t start;
+	char *slash;
+
+	start = profile_begin();
+	slash = strrchr(ctx->path, '/');
+	if(slash && slash != ctx->path) {
+		*slash = '\0';
+		if(mkpath(ctx, ctx->path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == 0) {
+			TRACE(mkdir, ctx->topic, ctx->payloadlen, ctx->path, 0);
+		} else {
+			TRACE(mkdir, ctx->topic, ctx->payloadlen, ctx->path, errno);
+		}
+		*slash = '/';
+	}
+	profile_end(PROF_MKDIR, start);
 }
 
 /*
-File open with given mode.
+File open with given flags.
 returns file descriptor (fd)
 */
 /* ------------------------------------------------------------- */
-static FILE *_mosquitto_fopen(const char *path, const char *mode)
+static int _mosquitto_open(const char *path, int flags)
 {
+	uint64_t start;
+	int fd;
 #ifdef WIN32
 	char buf[MAX_PATH];
 	int rc;
 	rc = ExpandEnvironmentStrings(path, buf, MAX_PATH);
 	if(rc == 0 || rc == MAX_PATH) {
-		return NULL;
-	}else {
-		return fopen(buf, mode);
+		return -1;
+	}
+	path = buf;
+	flags |= O_BINARY;
+#endif
+	start = profile_begin();
+	fd = open(path, flags, 0666);
+	profile_syscalls(PROF_OPEN, 1);
+	profile_end(PROF_OPEN, start);
+	return fd;
+}
+
+/*
+Point iov at the parts of the output record (as -v / -N would print it),
+the payload is written from the message itself.
+returns number of iov entries used, at most 4
+*/
+/* ------------------------------------------------------------- */
+static int _record(const struct mosq_config *cfg, const struct mosquitto_message *message, struct iovec *iov)
+{
+	int n = 0;
+
+	if(cfg->verbose) {
+		iov[n].iov_base = message->topic;
+		iov[n++].iov_len = strlen(message->topic);
+		if(message->payloadlen) {
+			iov[n].iov_base = " ";
+			iov[n++].iov_len = 1;
+		} else {
+			if(!cfg->eol) {
+				return 0;
+			}
+			iov[n].iov_base = " (null)\n";
+			iov[n++].iov_len = 8;
+			return n;
+		}
+	}
+	if(message->payloadlen) {
+		iov[n].iov_base = message->payload;
+		iov[n++].iov_len = (size_t)message->payloadlen;
+		if(cfg->eol) {
+			iov[n].iov_base = "\n";
+			iov[n++].iov_len = 1;
+		}
+	}
+	return n;
+}
+
+/*
+Write all iov entries, one writev() call where available.
+On an O_APPEND fd the record then lands in the file in one piece, even
+when other processes append to the same file. A short write (disk full,
+a signal) is continued from where it stopped.
+returns 0 on success
+*/
+/* ------------------------------------------------------------- */
+static int _writev(int fd, struct iovec *iov, int iovcnt)
+{
+#ifdef WIN32
+	int i;
+
+	for(i=0; i<iovcnt; i++) {
+		profile_syscalls(PROF_WRITE, 1);
+		if(write(fd, iov[i].iov_base, (unsigned int)iov[i].iov_len) != (int)iov[i].iov_len) {
+			return 1;
+		}
 	}
+	return 0;
 #else
-	return fopen(path, mode);
+	ssize_t n;
+
+	while(iovcnt > 0) {
+		n = writev(fd, iov, iovcnt);
+		profile_syscalls(PROF_WRITE, 1);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return 1;
+		}
+		if(n == 0) {
+			return 1;
+		}
+		/* skip what was written, the caller's iov is used up */
+		while(iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= (ssize_t)iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= (size_t)n;
+		}
+	}
+	return 0;
 #endif
 }
 
-void print_message_file(struct mosq_config *cfg, const struct mosquitto_message *message)
+#ifdef O_DIRECT
+/*
+Write a large record with O_DIRECT (--direct), bypassing the page cache
+so a stream of blobs does not evict the small files of the rest of the
+tree. The record is staged through an aligned per thread buffer: the bytes
+up to the first DIRECT_ALIGN boundary of the file and the final partial
+block go through the page cache, everything between is written direct.
+Filesystems that refuse O_DIRECT get the whole record buffered.
+Unlike _writev() the record is written in several calls, so it is not
+atomic against other processes appending to the same file.
+returns 0 on success
+*/
+/* ------------------------------------------------------------- */
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUF_SIZE (1024*1024)
+
+/* Copy the next len bytes of the record into buf. */
+static void direct_gather(char *buf, size_t len, struct iovec **iov, int *iovcnt, size_t *skip)
 {
+	size_t n;
+
+	while(len > 0) {
+		n = (*iov)->iov_len - *skip;
+		if(n > len) n = len;
+		memcpy(buf, (char *)(*iov)->iov_base + *skip, n);
+		buf += n;
+		len -= n;
+		*skip += n;
+		if(*skip == (*iov)->iov_len) {
+			(*iov)++;
+			(*iovcnt)--;
+			*skip = 0;
+		}
+	}
+}
 
-	cfg->fmask_topic = message->topic;
+static int direct_pwrite(int fd, const char *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while(len > 0) {
+		n = pwrite(fd, buf, len, off);
+		profile_syscalls(PROF_WRITE, 1);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return 1;
+		}
+		if(n == 0) {
+			return 1;
+		}
+		buf += n;
+		len -= (size_t)n;
+		off += n;
+	}
+	return 0;
+}
 
-	FILE *fptr = NULL;
+static int _write_direct(struct render_ctx *ctx, int fd, bool overwrite, struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	size_t skip = 0;
+	size_t len;
+	off_t off;
+	int flags;
+	bool direct = false;
+	int i;
+
+	for(i=0; i<iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+	if(!ctx->direct_buf && posix_memalign((void **)&ctx->direct_buf, DIRECT_ALIGN, DIRECT_BUF_SIZE)) {
+		ctx->direct_buf = NULL;
+		return _writev(fd, iov, iovcnt);
+	}
+	off = overwrite ? 0 : lseek(fd, 0, SEEK_END);
+	if(off < 0) {
+		return 1;
+	}
+	flags = fcntl(fd, F_GETFL);
+	profile_syscalls(PROF_WRITE, overwrite ? 1 : 2);
+
+	while(total > 0) {
+		if(off % DIRECT_ALIGN || total < DIRECT_ALIGN) {
+			/* head up to the block boundary, or the tail */
+			len = DIRECT_ALIGN - (size_t)(off % DIRECT_ALIGN);
+			if(len > total) len = total;
+			if(direct && fcntl(fd, F_SETFL, flags) == 0) {
+				direct = false;
+				profile_syscalls(PROF_WRITE, 1);
+			}
+		} else {
+			len = total - total % DIRECT_ALIGN;
+			if(len > DIRECT_BUF_SIZE) len = DIRECT_BUF_SIZE;
+			if(!direct && flags != -1 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0) {
+				direct = true;
+				profile_syscalls(PROF_WRITE, 1);
+			}
+		}
+		direct_gather(ctx->direct_buf, len, &iov, &iovcnt, &skip);
+		if(direct_pwrite(fd, ctx->direct_buf, len, off)) {
+			if(!direct || errno != EINVAL) {
+				return 1;
+			}
+			/* O_DIRECT is accepted on open but not on write by some filesystems */
+			fcntl(fd, F_SETFL, flags);
+			profile_syscalls(PROF_WRITE, 1);
+			direct = false;
+			flags = -1;
+			if(direct_pwrite(fd, ctx->direct_buf, len, off)) {
+				return 1;
+			}
+		}
+		off += (off_t)len;
+		total -= len;
+	}
+	return 0;
+}
+/* ------------------------------------------------------------- */
+#endif
+
+/* Resolved --fmask paths, per thread.
+   Without -F the path only depends on the topic and the date and time fields
+   used in the mask, so once resolved (with mkpath and --nodesuffix done) it
+   is kept per topic until one of those fields changes, then the whole cache
+   is dropped. A hit costs a hash of the topic and one probe.
+*/
+/* ------------------------------------------------------------- */
+#define PATH_CACHE_NONE 0       /* mask without time fields */
+#define PATH_CACHE_YEAR 1
+#define PATH_CACHE_MONTH 2
+#define PATH_CACHE_DAY 3
+#define PATH_CACHE_HOUR 4
+#define PATH_CACHE_MINUTE 5
+#define PATH_CACHE_SECOND 6
+#define PATH_CACHE_MIN_SIZE 256
+#define PATH_CACHE_MAX_STRINGS (16*1024*1024) /* dropped as a whole beyond */
+
+static const struct {
+	const char *name;
+	int unit;
+} path_cache_fields[] = {
+	{"epoch", PATH_CACHE_SECOND},
+	{"datetime", PATH_CACHE_SECOND},
+	{"time", PATH_CACHE_SECOND},
+	{"sec", PATH_CACHE_SECOND},
+	{"min", PATH_CACHE_MINUTE},
+	{"hour", PATH_CACHE_HOUR},
+	{"date", PATH_CACHE_DAY},
+	{"day", PATH_CACHE_DAY},
+	{"month", PATH_CACHE_MONTH},
+	{"year", PATH_CACHE_YEAR},
+};
+
+/* The finest time field in the mask, tokens split as _setfmask() does. */
+static int path_cache_unit(const char *fmask)
+{
+	const char *p = fmask;
+	size_t len;
+	size_t i;
+	int unit = PATH_CACHE_NONE;
+
+	while(*p) {
+		len = strcspn(p, "@/");
+		for(i=0; i<sizeof(path_cache_fields)/sizeof(path_cache_fields[0]); i++) {
+			if(strlen(path_cache_fields[i].name) == len
+					&& !strncmp(p, path_cache_fields[i].name, len)
+					&& path_cache_fields[i].unit > unit) {
+				unit = path_cache_fields[i].unit;
+			}
+		}
+		p += len;
+		if(*p) p++;
+	}
+	return unit;
+}
+
+/* The value of the mask's time fields, localtime only once a second. */
+static uint64_t path_cache_gen(struct path_cache *cache, time_t now)
+{
+	struct tm *tm;
+	uint64_t gen;
+
+	if(cache->unit == PATH_CACHE_NONE) {
+		return 0;
+	}
+	if(cache->unit == PATH_CACHE_SECOND) {
+		return (uint64_t)now;
+	}
+	if(now == cache->time) {
+		return cache->gen;
+	}
+#ifdef WIN32
+	tm = localtime(&now);
+#else
+	tm = localtime_r(&now, &tm_buf);
+#endif
+	gen = (uint64_t)tm->tm_year;
+	if(cache->unit >= PATH_CACHE_MONTH) gen = gen*12 + (uint64_t)tm->tm_mon;
+	if(cache->unit >= PATH_CACHE_DAY) gen = gen*31 + (uint64_t)tm->tm_mday;
+	if(cache->unit >= PATH_CACHE_HOUR) gen = gen*24 + (uint64_t)tm->tm_hour;
+	if(cache->unit >= PATH_CACHE_MINUTE) gen = gen*60 + (uint64_t)tm->tm_min;
+	return gen;
+}
+
+static void path_cache_clear(struct path_cache *cache)
+{
+	if(cache->entries) {
+		memset(cache->entries, 0, cache->size*sizeof(struct path_cache_entry));
+	}
+	cache->used = 0;
+	cache->strings_len = 0;
+}
+
+static struct path_cache_entry *path_cache_find(struct path_cache_entry *entries, size_t size, uint64_t hash)
+{
+	size_t i;
+
+	i = (size_t)hash & (size - 1);
+	while(entries[i].hash && entries[i].hash != hash) {
+		i = (i + 1) & (size - 1);
+	}
+	return &entries[i];
+}
+
+/* Set ctx->path from the cache, returns true on a hit. *hash is for
+   path_cache_put() on a miss. */
+static bool path_cache_get(struct render_ctx *ctx, const struct mosq_config *cfg, const char *topic, uint64_t *hash)
+{
+	struct path_cache *cache = &ctx->cache;
+	struct path_cache_entry *entry;
+	time_t now;
+	uint64_t gen;
+
+	if(cache->time == 0) {
+		cache->unit = path_cache_unit(cfg->fmask);
+	}
+	now = time(NULL);
+	gen = path_cache_gen(cache, now);
+	cache->time = now;
+	if(gen != cache->gen) {
+		path_cache_clear(cache);
+		cache->gen = gen;
+	}
+
+	*hash = dedup_hash(topic, strlen(topic), 0);
+	if(*hash == 0) {
+		*hash = 1;
+	}
+	if(!cache->used) {
+		return false;
+	}
+	entry = path_cache_find(cache->entries, cache->size, *hash);
+	if(!entry->hash || strcmp(cache->strings + entry->topic, topic)) {
+		/* a different topic with the same hash is just not cached */
+		return false;
+	}
+	ctx->path_len = 0;
+	return path_append(ctx, cache->strings + entry->path, entry->path_len) == 0;
+}
+
+static int path_cache_strings(struct path_cache *cache, const char *str, size_t len, size_t *offset)
+{
+	size_t size;
+	char *strings;
+
+	if(cache->strings_len + len + 1 > cache->strings_size) {
+		size = cache->strings_size ? cache->strings_size : 4096;
+		while(cache->strings_len + len + 1 > size) {
+			size *= 2;
+		}
+		strings = realloc(cache->strings, size);
+		if(!strings) return 1;
+		cache->strings = strings;
+		cache->strings_size = size;
+	}
+	*offset = cache->strings_len;
+	memcpy(cache->strings + cache->strings_len, str, len);
+	cache->strings[cache->strings_len + len] = '\0';
+	cache->strings_len += len + 1;
+	return 0;
+}
+
+/* Remember ctx->path for topic, a failure only means it isn't cached. */
+static void path_cache_put(struct render_ctx *ctx, uint64_t hash, const char *topic)
+{
+	struct path_cache *cache = &ctx->cache;
+	struct path_cache_entry *entries, *entry;
+	size_t topic_len;
+	size_t size;
+	size_t i;
+
+	topic_len = strlen(topic);
+	if(cache->strings_len + topic_len + ctx->path_len + 2 > PATH_CACHE_MAX_STRINGS) {
+		path_cache_clear(cache);
+	}
+	if(cache->used + 1 > cache->size/4*3) {
+		size = cache->size ? cache->size*2 : PATH_CACHE_MIN_SIZE;
+		entries = calloc(size, sizeof(struct path_cache_entry));
+		if(!entries) return;
+		for(i=0; i<cache->size; i++) {
+			if(cache->entries[i].hash) {
+				*path_cache_find(entries, size, cache->entries[i].hash) = cache->entries[i];
+			}
+		}
+		free(cache->entries);
+		cache->entries = entries;
+		cache->size = size;
+	}
+	entry = path_cache_find(cache->entries, cache->size, hash);
+	if(entry->hash) {
+		/* hash collision, keep the first topic */
+		return;
+	}
+	if(path_cache_strings(cache, topic, topic_len, &entry->topic)
+			|| path_cache_strings(cache, ctx->path, ctx->path_len, &entry->path)) {
+		return;
+	}
+	entry->path_len = ctx->path_len;
+	entry->hash = hash;
+	cache->used++;
+}
+/* ------------------------------------------------------------- */
+
+#ifndef WIN32
+/* Directory fds, per thread.
+   Instead of handing the kernel the absolute path for every stat(), mkdir()
+   and open(), the directories of the output files are kept open and files
+   are opened with openat() relative to them. Missing directories are
+   created with mkdirat() below the deepest one already open, so a hit costs
+   no path walk at all however deep the mask is. The fds are dropped every
+   second, so a directory renamed or replaced meanwhile is not written into
+   for longer than that.
+*/
+/* ------------------------------------------------------------- */
+static struct dir_cache_entry *dir_cache_find(struct render_ctx *ctx, const char *path, size_t len, uint64_t hash)
+{
+	struct dir_cache_entry *entry;
+	size_t i;
+
+	i = (size_t)hash & (ctx->dirs_size - 1);
+	for(;;) {
+		entry = &ctx->dirs[i];
+		if(!entry->path || (entry->hash == hash && entry->len == len && !memcmp(entry->path, path, len))) {
+			return entry;
+		}
+		i = (i + 1) & (ctx->dirs_size - 1);
+	}
+}
+
+/* Size the cache from the fd limit, half of it shared by the writers. */
+static int dir_cache_init(struct render_ctx *ctx, const struct mosq_config *cfg)
+{
+	struct rlimit rl;
+	size_t max = DIR_CACHE_MAX;
+	size_t size;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+		max = (size_t)rl.rlim_cur / 2 / (size_t)(cfg->writers + 1);
+	}
+	if(max < DIR_CACHE_MIN) max = DIR_CACHE_MIN;
+	if(max > DIR_CACHE_MAX) max = DIR_CACHE_MAX;
+	for(size = DIR_CACHE_MIN; size < max*2; size *= 2);
+
+	ctx->dirs = calloc(size, sizeof(struct dir_cache_entry));
+	if(!ctx->dirs) return 1;
+	ctx->dirs_size = size;
+	ctx->dirs_max = max;
+	return 0;
+}
+
+/* Keep fd open for path, returns 1 if it is not (the caller closes it). */
+static int dir_cache_put(struct render_ctx *ctx, const char *path, size_t len, uint64_t hash, int fd)
+{
+	struct dir_cache_entry *entry;
+
+	if(ctx->dirs_used >= ctx->dirs_max) {
+		return 1;
+	}
+	entry = dir_cache_find(ctx, path, len, hash);
+	entry->path = malloc(len + 1);
+	if(!entry->path) {
+		return 1;
+	}
+	memcpy(entry->path, path, len);
+	entry->path[len] = '\0';
+	entry->len = len;
+	entry->hash = hash;
+	entry->fd = fd;
+	ctx->dirs_used++;
+	return 0;
+}
+
+/* An fd of the directory path[0..len), created if missing. *owned is set
+   if the fd is not cached and must be closed by the caller. */
+static int dir_open(struct render_ctx *ctx, const struct mosq_config *cfg, const char *path, size_t len, mode_t mode, bool *owned)
+{
+	struct dir_cache_entry *entry;
+	char *dir, *name;
+	size_t end, p, q;
+	time_t now;
+	bool tmp = false;
+	int fd, dfd;
+	int err;
+
+	*owned = false;
+	if(!ctx->dirs && dir_cache_init(ctx, cfg)) {
+		errno = ENOMEM;
+		return -1;
+	}
+	now = time(NULL);
+	if(now != ctx->dirs_time) {
+		dir_cache_clear(ctx);
+		ctx->dirs_time = now;
+	}
+
+	/* the deepest directory of path already open, at worst the root */
+	end = len;
+	for(;;) {
+		entry = dir_cache_find(ctx, path, end, dedup_hash(path, end, 0));
+		if(entry->path) {
+			fd = entry->fd;
+			break;
+		}
+		if(end == len && ctx->dirs_used >= ctx->dirs_max) {
+			/* a new directory with the cache full, start over */
+			dir_cache_clear(ctx);
+		}
+		if(end == 0) {
+			fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			profile_syscalls(PROF_MKDIR, 1);
+			if(fd < 0) return -1;
+			if(dir_cache_put(ctx, path, 0, dedup_hash(path, 0, 0), fd)) {
+				tmp = true;
+			}
+			break;
+		}
+		do {
+			end--;
+		} while(end > 0 && path[end] != '/');
+	}
+
+	/* open or create the rest, one component at a time */
+	for(p = end; p < len; p = q) {
+		while(p < len && path[p] == '/') p++;
+		if(p == len) break;
+		for(q = p; q < len && path[q] != '/'; q++);
+
+		/* the directory's path, for the tracepoint, and its name */
+		dir = arena_alloc(ctx, q + 1);
+		if(!dir) {
+			errno = ENOMEM;
+			goto error;
+		}
+		memcpy(dir, path, q);
+		dir[q] = '\0';
+		name = dir + p;
+
+		dfd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		profile_syscalls(PROF_MKDIR, 1);
+		if(dfd < 0 && errno == ENOENT) {
+			/* EEXIST if another thread was first */
+			profile_syscalls(PROF_MKDIR, 2);
+			if(mkdirat(fd, name, mode) != 0 && errno != EEXIST) {
+				TRACE(mkdir, ctx->topic, ctx->payloadlen, dir, errno);
+				goto error;
+			}
+			TRACE(mkdir, ctx->topic, ctx->payloadlen, dir, 0);
+			dfd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+		if(dfd < 0) {
+			goto error;
+		}
+		if(tmp) {
+			close(fd);
+			profile_syscalls(PROF_MKDIR, 1);
+		}
+		fd = dfd;
+		tmp = dir_cache_put(ctx, path, q, dedup_hash(path, q, 0), fd) != 0;
+	}
+	*owned = tmp;
+	return fd;
+
+error:
+	if(tmp) {
+		err = errno;
+		close(fd);
+		errno = err;
+	}
+	return -1;
+}
+
+/* Open ctx->path relative to its directory's fd. */
+static int _file_open(struct render_ctx *ctx, const struct mosq_config *cfg, int flags)
+{
+	uint64_t start;
+	char *slash;
+	bool owned;
+	int dfd, fd;
+	int err;
+
+	start = profile_begin();
+	slash = strrchr(ctx->path, '/');
+	dfd = dir_open(ctx, cfg, ctx->path, (size_t)(slash - ctx->path),
+			S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH, &owned);
+	profile_end(PROF_MKDIR, start);
+	if(dfd < 0) {
+		return -1;
+	}
+	start = profile_begin();
+	fd = openat(dfd, slash + 1, flags, 0666);
+	profile_syscalls(PROF_OPEN, 1);
+	profile_end(PROF_OPEN, start);
+	if(owned) {
+		err = errno;
+		close(dfd);
+		profile_syscalls(PROF_MKDIR, 1);
+		errno = err;
+	}
+	return fd;
+}
+/* ------------------------------------------------------------- */
+#endif
+
+/* returns 0 once the record is written (and synced with --fsync) */
+int print_message_file(struct mosq_config *cfg, const struct mosquitto_message *message)
+{
+	struct render_ctx *ctx = &render;
+	int rc = 1;
+	int fd;
+	int iovcnt;
+	struct iovec iov[4];
+	uint64_t dedup_key = 0, dedup_value = 0;
+	uint64_t hash = 0;
+	bool cached = false;
+#ifdef O_DIRECT
+	bool direct = false;
+#endif
+	size_t suffix_len;
+	uint64_t start;
+	int flags;
+	int i;
+
+	start = profile_begin();
+	ctx->topic = message->topic;
+	ctx->payloadlen = message->payloadlen;
 
 	if(cfg->format && strlen(cfg->fmask) == 0) {
-		_fmask(cfg->format, cfg, message); /* experimental */
+		if(_fmask(ctx, cfg->format, cfg, message)) { /* experimental */
+			err_printf(cfg, "Error: Out of memory.\n");
+			goto cleanup;
+		}
 	} else {
 		if(strlen(cfg->fmask) == 0) {
 			fprintf(stderr, "Error: fmask is empty, try an absolute path string.\n");
 			fflush(stdout);
-			return;
+			return 1;
         }
-		_fmask(cfg->fmask, cfg, message);
-	}
-
-	char *path, *prog;
-	path = dirname(strdup(cfg->ffmask));
-	prog = basename(strdup(cfg->ffmask));
-
-	mkpath(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-
-	/* reasonable method to distinguish between directory 
-	 * and a writable node (by default is off) */
-	if(cfg->nodesuffix) {
-		char *sf = cfg->nsuffix;      /* limit 16 bytes. */
-		sf = stpcpy(sf, cfg->nodesuffix);
-		if(cfg->nsuffix) {
-			char *to = cfg->ffmask;
-			to = stpcpy(to, path);
-			to = stpcpy(to, "/");
-			if(prog) {
-				to = stpcpy(to, prog);
+		if(cfg->format == NULL && path_cache_get(ctx, cfg, message->topic, &hash)) {
+			cached = true;
+			if(cfg->verbose == 1) {
+				/* as _fmask() prints it, before the suffix */
+				suffix_len = (cfg->nodesuffix && cfg->nodesuffix[0]) ? strlen(cfg->nodesuffix) + 1 : 0;
+				printf("%s\t%.*s\n", cfg->fmask, (int)(ctx->path_len - suffix_len), ctx->path);
 			}
-			to = stpcpy(to, ".");
-			to = stpcpy(to, cfg->nsuffix);
+		} else if(_fmask(ctx, cfg->fmask, cfg, message)) {
+			err_printf(cfg, "Error: Out of memory.\n");
+			goto cleanup;
 		}
 	}
 
-	if(cfg->overwrite) {
-		fptr = _mosquitto_fopen(cfg->ffmask, "w");
-	} else {
-		fptr = _mosquitto_fopen(cfg->ffmask, "a");
+	if(!cached) {
+#ifdef WIN32
+		_mkparent(ctx);
+#endif
+
+		/* reasonable method to distinguish between directory 
+		 * and a writable node (by default is off) */
+		if(cfg->nodesuffix && cfg->nodesuffix[0]) {
+			if(path_appends(ctx, ".") || path_appends(ctx, cfg->nodesuffix)) {
+				err_printf(cfg, "Error: Out of memory.\n");
+				goto cleanup;
+			}
+		}
+		if(hash) {
+			path_cache_put(ctx, hash, message->topic);
+		}
+	}
+
+	latency_mark(LAT_PATH);
+	profile_end(PROF_RENDER, start);
+	TRACE(fmask, message->topic, message->payloadlen, ctx->path, cached);
+
+	iovcnt = _record(cfg, message, iov);
+
+	if(cfg->dedup == DEDUP_OVERWRITE) {
+		/* the file already holds exactly this record */
+		dedup_key = dedup_hash(ctx->path, ctx->path_len, 0);
+		dedup_value = 0;
+		for(i=0; i<iovcnt; i++) {
+			dedup_value = dedup_hash(iov[i].iov_base, iov[i].iov_len, dedup_value);
+		}
+		if(dedup_unchanged(dedup_key, dedup_value)) {
+			TRACE(filter, message->topic, message->payloadlen, ctx->path, TRACE_DEDUP);
+			rc = 0;
+			goto cleanup;
+		}
+	}
+
+	flags = O_WRONLY | O_CREAT | (cfg->overwrite ? O_TRUNC : O_APPEND);
+#ifdef O_DIRECT
+	direct = cfg->direct && (size_t)message->payloadlen >= cfg->direct;
+	if(direct) {
+		/* written at explicit offsets, see _write_direct() */
+		flags &= ~O_APPEND;
+	}
+#endif
+#ifdef WIN32
+	fd = _mosquitto_open(ctx->path, flags);
+	if(fd < 0 && cached) {
+		/* the directory went away since the path was cached */
+		_mkparent(ctx);
+		fd = _mosquitto_open(ctx->path, flags);
+	}
+#else
+	fd = _file_open(ctx, cfg, flags);
+	if(fd < 0 && errno == ENOENT && ctx->dirs_used) {
+		/* a directory went away since it was opened */
+		dir_cache_clear(ctx);
+		fd = _file_open(ctx, cfg, flags);
 	}
+	if(fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+		/* out of fds, give back the cached ones and go by path */
+		dir_cache_clear(ctx);
+		_mkparent(ctx);
+		fd = _mosquitto_open(ctx->path, flags);
+	}
+#endif
 
-	if(!fptr){
-		fprintf(stderr, "Error: cannot open outfile, using stdout - %s\n", cfg->ffmask);
+	TRACE(open, message->topic, message->payloadlen, ctx->path, fd < 0 ? -errno : fd);
+	if(fd < 0){
+		fprintf(stderr, "Error: cannot open outfile, using stdout - %s\n", ctx->path);
 		// need to do normal stdout
 		//mosquitto_message_callback_set(mosq, "my_message_callback");
 	} else{
-		if(cfg->verbose){
-			if(message->payloadlen){
-				fprintf(fptr, "%s ", message->topic);
-				fwrite(message->payload, 1, message->payloadlen, fptr);
-				if(cfg->eol){
-					fprintf(fptr, "\n");
-				}
-			}else{
-				if(cfg->eol){
-					fprintf(fptr, "%s (null)\n", message->topic);
-				}
+		rc = 0;
+		start = profile_begin();
+#ifdef O_DIRECT
+		if(direct){
+			if(_write_direct(ctx, fd, cfg->overwrite, iov, iovcnt)){
+				fprintf(stderr, "Error: cannot write outfile - %s\n", ctx->path);
+				rc = 1;
 			}
-		}else{
-			if(message->payloadlen){
-				fwrite(message->payload, 1, message->payloadlen, fptr);
-				if(cfg->eol){
-					fprintf(fptr, "\n");
-				}
+		}else
+#endif
+		if(_writev(fd, iov, iovcnt)){
+			fprintf(stderr, "Error: cannot write outfile - %s\n", ctx->path);
+			rc = 1;
+		}
+		profile_end(PROF_WRITE, start);
+		latency_mark(LAT_WRITE);
+		TRACE(write, message->topic, message->payloadlen, ctx->path, rc);
+#ifndef WIN32
+		if(cfg->fsync){
+			start = profile_begin();
+			if(fsync(fd) != 0){
+				fprintf(stderr, "Error: cannot sync outfile - %s\n", ctx->path);
+				rc = 1;
 			}
+			profile_syscalls(PROF_SYNC, 1);
+			profile_end(PROF_SYNC, start);
+			latency_mark(LAT_SYNC);
+		}
+#endif
+		start = profile_begin();
+		close(fd);
+		profile_syscalls(PROF_CLOSE, 1);
+		profile_end(PROF_CLOSE, start);
+		TRACE(close, message->topic, message->payloadlen, ctx->path, fd);
+		if(rc == 0 && cfg->dedup == DEDUP_OVERWRITE) {
+			dedup_store(dedup_key, dedup_value);
 		}
-		fclose(fptr);
 	}
-    
+
+cleanup:
+	ctx->topic = NULL;
+	arena_reset(ctx);
+	return rc;
 }
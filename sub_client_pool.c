@@ -0,0 +1,199 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#ifdef WIN32
+#  define THREAD_LOCAL __declspec(thread)
+#else
+#  define THREAD_LOCAL __thread
+#endif
+
+#include "sub_client_pool.h"
+#include "sub_client_stats.h"
+
+#define POOL_MIN_SHIFT 6
+#define POOL_CLASSES 11                    /* 64 bytes .. 64 KiB */
+#define POOL_MAX ((size_t)1 << (POOL_MIN_SHIFT + POOL_CLASSES - 1))
+#define POOL_CACHE_BYTES (1024*1024)      /* per class and thread */
+#define POOL_CACHE_MIN 4
+
+/* Header of every buffer, the caller's part follows it. */
+struct pool_buf {
+	struct pool_buf *next; /* in a free list */
+	size_t size;           /* with the header, above POOL_MAX not pooled */
+};
+
+struct pool_cache {
+	struct pool_buf *head;
+	size_t count;
+};
+
+static THREAD_LOCAL struct pool_cache caches[POOL_CLASSES];
+/* buffers given back beyond the caches, pushed with a CAS and only ever
+ * taken as a whole, so there is no ABA problem */
+static struct pool_buf *returned[POOL_CLASSES];
+
+
+static void pool_stats_add(uint64_t *value, uint64_t *max, uint64_t n)
+{
+	uint64_t v, m;
+
+	v = __atomic_add_fetch(value, n, __ATOMIC_RELAXED);
+	m = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while(v > m){
+		if(__atomic_compare_exchange_n(max, &m, v, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+			break;
+		}
+	}
+}
+
+static int pool_class(size_t size)
+{
+	int cls = 0;
+
+	while(((size_t)1 << (POOL_MIN_SHIFT + cls)) < size){
+		cls++;
+	}
+	return cls;
+}
+
+/* Push the list first..last onto the returned buffers of cls. */
+static void pool_return(int cls, struct pool_buf *first, struct pool_buf *last)
+{
+	last->next = __atomic_load_n(&returned[cls], __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&returned[cls], &last->next, first,
+				true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+	}
+}
+
+
+void *pool_alloc(size_t size)
+{
+	struct pool_cache *cache;
+	struct pool_buf *buf;
+	int cls;
+
+	size += sizeof(struct pool_buf);
+	__atomic_add_fetch(&pool_stats.allocs, 1, __ATOMIC_RELAXED);
+
+	if(size > POOL_MAX){
+		buf = malloc(size);
+		if(!buf){
+			return NULL;
+		}
+		buf->size = size;
+		pool_stats_add(&pool_stats.bytes, &pool_stats.max_bytes, size);
+	}else{
+		cls = pool_class(size);
+		cache = &caches[cls];
+		if(!cache->head){
+			/* take over what the other threads gave back */
+			cache->head = __atomic_exchange_n(&returned[cls], NULL, __ATOMIC_ACQUIRE);
+			for(buf=cache->head; buf; buf=buf->next){
+				cache->count++;
+			}
+		}
+		if(cache->head){
+			buf = cache->head;
+			cache->head = buf->next;
+			cache->count--;
+			__atomic_add_fetch(&pool_stats.hits, 1, __ATOMIC_RELAXED);
+		}else{
+			size = (size_t)1 << (POOL_MIN_SHIFT + cls);
+			buf = malloc(size);
+			if(!buf){
+				return NULL;
+			}
+			buf->size = size;
+			pool_stats_add(&pool_stats.bytes, &pool_stats.max_bytes, size);
+		}
+	}
+	pool_stats_add(&pool_stats.used, &pool_stats.max_used, 1);
+	return buf + 1;
+}
+
+
+void pool_free(void *ptr)
+{
+	struct pool_cache *cache;
+	struct pool_buf *buf;
+	size_t max;
+	int cls;
+
+	if(!ptr){
+		return;
+	}
+	buf = (struct pool_buf *)ptr - 1;
+	__atomic_sub_fetch(&pool_stats.used, 1, __ATOMIC_RELAXED);
+
+	if(buf->size > POOL_MAX){
+		__atomic_sub_fetch(&pool_stats.bytes, buf->size, __ATOMIC_RELAXED);
+		free(buf);
+		return;
+	}
+	cls = pool_class(buf->size);
+	cache = &caches[cls];
+	max = POOL_CACHE_BYTES / buf->size;
+	if(max < POOL_CACHE_MIN){
+		max = POOL_CACHE_MIN;
+	}
+	if(cache->count < max){
+		buf->next = cache->head;
+		cache->head = buf;
+		cache->count++;
+	}else{
+		pool_return(cls, buf, buf);
+	}
+}
+
+
+void pool_thread_flush(void)
+{
+	struct pool_buf *last;
+	int cls;
+
+	for(cls=0; cls<POOL_CLASSES; cls++){
+		if(!caches[cls].head){
+			continue;
+		}
+		for(last=caches[cls].head; last->next; last=last->next){
+		}
+		pool_return(cls, caches[cls].head, last);
+		caches[cls].head = NULL;
+		caches[cls].count = 0;
+	}
+}
+
+
+void pool_cleanup(void)
+{
+	struct pool_buf *buf, *next;
+	int cls;
+
+	pool_thread_flush();
+	for(cls=0; cls<POOL_CLASSES; cls++){
+		buf = __atomic_exchange_n(&returned[cls], NULL, __ATOMIC_ACQUIRE);
+		while(buf){
+			next = buf->next;
+			__atomic_sub_fetch(&pool_stats.bytes, buf->size, __ATOMIC_RELAXED);
+			free(buf);
+			buf = next;
+		}
+	}
+}
@@ -0,0 +1,42 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#ifndef SUB_CLIENT_POOL_H
+#define SUB_CLIENT_POOL_H
+
+#include <stddef.h>
+
+/* Size classed buffer pools for the messages handed to the writer threads
+ * (--writers). Buffers are powers of two from 64 bytes to 64 KiB, larger
+ * ones come from malloc() directly: copying them costs more than that, and
+ * a burst of them would stay pooled.
+ *
+ * Every thread keeps a bounded cache of free buffers per class, so the
+ * message callback allocating and queue_complete() freeing on the same
+ * thread never share anything. Buffers freed beyond the cache go to a
+ * lock-free list per class, which a thread with an empty cache takes over
+ * as a whole. */
+
+void *pool_alloc(size_t size);
+void pool_free(void *ptr);
+
+/* Give the buffers cached by the calling thread back, before it exits. */
+void pool_thread_flush(void);
+
+/* Free the pooled buffers, with no other thread using the pools. */
+void pool_cleanup(void);
+
+#endif
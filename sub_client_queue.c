@@ -0,0 +1,709 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#include "config.h"
+
+#ifndef WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <mosquitto.h>
+#include "client_shared.h"
+#include "sub_client_affinity.h"
+#include "sub_client_pool.h"
+#include "sub_client_queue.h"
+#include "sub_client_stats.h"
+
+void print_message_cleanup(void);
+
+struct queue_item {
+	struct queue_item *next;
+	struct mosquitto_message message;
+	uint64_t start; /* latency_begin() time, 0 without --latency */
+	size_t bytes;
+	unsigned int conn; /* connection the message was received on */
+	int rc;
+};
+
+/* Spill file record header, followed by the topic and the payload. */
+struct spill_record {
+	uint32_t topic_len;
+	uint32_t payload_len;
+	int32_t mid;
+	uint32_t conn;
+	uint8_t qos;
+	uint8_t retain;
+	uint8_t pad[6];
+	uint64_t start;
+	uint64_t spilled; /* stats_now_ns() when spilled */
+};
+
+#define SPILL_BUF_SIZE (1024*1024)
+
+struct queue_shard {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct queue_item *head;
+	struct queue_item *tail;
+	bool stop;
+	/* Once a shard spills, everything after goes through the spill file
+	 * until it is drained, which keeps the order of the records. */
+	bool spilling;
+	int spill_fd;
+	off_t spill_read;  /* next record to write out */
+	off_t spill_write; /* end of the file */
+	char *spill_buf;   /* records not in the file yet */
+	size_t spill_len;
+};
+
+static struct mosq_config *queue_cfg = NULL;
+static queue_write_fn queue_write = NULL;
+static struct queue_shard *shards = NULL;
+static int shard_count = 0;
+
+/* completed messages, newest first, waiting for queue_complete() */
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct queue_item *done_list = NULL;
+/* an eventfd on Linux, both ends are the same fd then */
+static int notify_pipe[2] = {-1, -1};
+
+static bool paused = false;
+static uint64_t paused_since = 0;
+
+
+static bool queue_full(void)
+{
+	return (queue_cfg->queue_high
+				&& __atomic_load_n(&queue_stats.depth, __ATOMIC_RELAXED) >= (uint64_t)queue_cfg->queue_high)
+			|| (queue_cfg->queue_high_bytes
+				&& __atomic_load_n(&queue_stats.bytes, __ATOMIC_RELAXED) >= queue_cfg->queue_high_bytes);
+}
+
+
+/* FNV-1a, only used to spread topics over the writers */
+static unsigned int queue_hash(const char *str)
+{
+	unsigned int h = 2166136261U;
+
+	while(*str){
+		h ^= (unsigned char)*str++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+
+static void queue_stats_add(uint64_t *value, uint64_t *max, uint64_t n)
+{
+	uint64_t v, m;
+
+	v = __atomic_add_fetch(value, n, __ATOMIC_RELAXED);
+	m = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while(v > m){
+		if(__atomic_compare_exchange_n(max, &m, v, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+			break;
+		}
+	}
+}
+
+
+static void queue_done(struct queue_item *item)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+#endif
+	bool wake;
+
+	pthread_mutex_lock(&done_mutex);
+	wake = (done_list == NULL);
+	item->next = done_list;
+	done_list = item;
+	pthread_mutex_unlock(&done_mutex);
+
+	if(wake){
+		/* non-blocking, a full pipe already wakes the reader */
+#ifdef __linux__
+		if(write(notify_pipe[1], &one, sizeof(one)) < 0 && errno != EAGAIN){
+#else
+		if(write(notify_pipe[1], "", 1) < 0 && errno != EAGAIN){
+#endif
+			fprintf(stderr, "Error: Writer queue notification failed.\n");
+		}
+	}
+}
+
+
+static int spill_pwrite(struct queue_shard *shard, const void *buf, size_t len)
+{
+	ssize_t n;
+	size_t pos = 0;
+
+	while(pos < len){
+		n = pwrite(shard->spill_fd, (const char *)buf + pos, len - pos, shard->spill_write + (off_t)pos);
+		if(n <= 0){
+			if(n < 0 && errno == EINTR) continue;
+			return 1;
+		}
+		pos += (size_t)n;
+	}
+	shard->spill_write += (off_t)len;
+	return 0;
+}
+
+
+/* Drop what was written since start, so the file only has whole records.
+ * The dropped messages stay unacknowledged. */
+static void spill_rollback(struct queue_shard *shard, off_t start, size_t len)
+{
+	fprintf(stderr, "Error: Unable to write spill file: %s.\n", strerror(errno));
+	__atomic_add_fetch(&spill_stats.errors, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&spill_stats.bytes, len, __ATOMIC_RELAXED);
+	if(ftruncate(shard->spill_fd, start)){
+		fprintf(stderr, "Error: Unable to truncate spill file: %s.\n", strerror(errno));
+	}
+	shard->spill_write = start;
+}
+
+
+/* Write the buffered records to the end of the spill file, with the shard
+ * locked. */
+static void spill_flush(struct queue_shard *shard)
+{
+	off_t start = shard->spill_write;
+
+	if(shard->spill_len && spill_pwrite(shard, shard->spill_buf, shard->spill_len)){
+		spill_rollback(shard, start, shard->spill_len);
+	}
+	shard->spill_len = 0;
+}
+
+
+static void spill_append(struct queue_shard *shard, const struct mosquitto_message *message, unsigned int conn)
+{
+	struct spill_record rec;
+	size_t topic_len;
+	size_t len;
+	off_t start;
+	char *p;
+
+	topic_len = strlen(message->topic);
+	len = sizeof(rec) + topic_len + 1 + (size_t)message->payloadlen;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.topic_len = (uint32_t)topic_len;
+	rec.payload_len = (uint32_t)message->payloadlen;
+	rec.mid = message->mid;
+	rec.conn = conn;
+	rec.qos = (uint8_t)message->qos;
+	rec.retain = message->retain;
+	rec.start = latency_started();
+	rec.spilled = stats_now_ns();
+
+	/* This blocks the network thread, and this shard's writer, for one
+	 * sequential write of up to SPILL_BUF_SIZE. It goes to the page cache
+	 * (spill files are never synced) and is paid once per buffer, not per
+	 * record; the writer would have to wait for this data anyway. */
+	if(shard->spill_len + len > SPILL_BUF_SIZE){
+		spill_flush(shard);
+	}
+	queue_stats_add(&spill_stats.bytes, &spill_stats.max_bytes, len);
+	__atomic_add_fetch(&spill_stats.spilled, 1, __ATOMIC_RELAXED);
+
+	if(len > SPILL_BUF_SIZE){
+		/* larger than the buffer, goes straight to the file in pieces */
+		spill_flush(shard);
+		start = shard->spill_write;
+		p = shard->spill_buf;
+		memcpy(p, &rec, sizeof(rec));
+		memcpy(p + sizeof(rec), message->topic, topic_len + 1);
+		if(spill_pwrite(shard, p, sizeof(rec) + topic_len + 1)
+				|| spill_pwrite(shard, message->payload, (size_t)message->payloadlen)){
+
+			spill_rollback(shard, start, len);
+		}
+		return;
+	}
+
+	p = shard->spill_buf + shard->spill_len;
+	memcpy(p, &rec, sizeof(rec));
+	p += sizeof(rec);
+	memcpy(p, message->topic, topic_len + 1);
+	p += topic_len + 1;
+	if(message->payloadlen){
+		memcpy(p, message->payload, message->payloadlen);
+	}
+	shard->spill_len += len;
+}
+
+
+/* Write out one record read back from the spill file. The completion only
+ * carries mid, qos and retain, the topic and payload are not kept. */
+static void spill_write_record(const struct spill_record *rec, char *data)
+{
+	struct mosquitto_message message;
+	struct queue_item *item;
+	int rc;
+
+	memset(&message, 0, sizeof(message));
+	message.mid = rec->mid;
+	message.qos = rec->qos;
+	message.retain = rec->retain;
+	message.topic = data;
+	message.payload = data + rec->topic_len + 1;
+	message.payloadlen = (int)rec->payload_len;
+
+	latency_resume(rec->start);
+	latency_mark(LAT_QUEUE);
+	rc = queue_write(queue_cfg, &message);
+
+	item = pool_alloc(sizeof(struct queue_item));
+	if(!item){
+		/* written, but can't be acknowledged */
+		__atomic_add_fetch(&spill_stats.errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	memset(item, 0, sizeof(struct queue_item));
+	item->message.mid = rec->mid;
+	item->conn = rec->conn;
+	item->message.qos = rec->qos;
+	item->message.retain = rec->retain;
+	item->rc = rc;
+	queue_stats_add(&queue_stats.depth, &queue_stats.max_depth, 1);
+	queue_done(item);
+}
+
+
+/* Write out the next chunk of the spill file, called and returning with the
+ * shard locked. Records are read back with large sequential reads. */
+static void spill_drain(struct queue_shard *shard, char **buf, size_t *size)
+{
+	struct spill_record rec;
+	off_t off;
+	size_t avail;
+	size_t pos = 0;
+	size_t len;
+	ssize_t n;
+	uint64_t t0, now;
+	char *tmp;
+
+	spill_flush(shard);
+	off = shard->spill_read;
+	avail = (size_t)(shard->spill_write - off);
+	if(avail == 0){
+		/* the flush was rolled back */
+		goto caught_up;
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	t0 = stats_now_ns();
+	n = pread(shard->spill_fd, *buf, avail < *size ? avail : *size, off);
+	if(n < 0){
+		fprintf(stderr, "Error: Unable to read spill file: %s.\n", strerror(errno));
+	}
+	while(n > 0 && pos + sizeof(rec) <= (size_t)n){
+		memcpy(&rec, *buf + pos, sizeof(rec));
+		len = sizeof(rec) + rec.topic_len + 1 + rec.payload_len;
+		if(pos + len > (size_t)n){
+			if(pos == 0 && len > avail){
+				/* corrupt, handled below */
+				n = 0;
+			}else if(pos == 0 && len > *size){
+				tmp = realloc(*buf, len);
+				if(tmp){
+					*buf = tmp;
+					*size = len;
+				}else{
+					/* skip the record, it can't be held in memory */
+					pos = len;
+					__atomic_add_fetch(&spill_stats.errors, 1, __ATOMIC_RELAXED);
+				}
+			}
+			break;
+		}
+		spill_write_record(&rec, *buf + pos + sizeof(rec));
+		pos += len;
+
+		now = stats_now_ns();
+		__atomic_store_n(&spill_stats.lag_ns, now - rec.spilled, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&spill_stats.drained, 1, __ATOMIC_RELAXED);
+	}
+	if(n <= 0 || (pos == 0 && (size_t)n < sizeof(rec))){
+		/* unreadable or truncated, drop the rest */
+		pos = avail;
+		__atomic_add_fetch(&spill_stats.errors, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_sub_fetch(&spill_stats.bytes, pos, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&spill_stats.drained_bytes, pos, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&spill_stats.drain_ns, stats_now_ns() - t0, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&shard->mutex);
+	shard->spill_read += (off_t)pos;
+caught_up:
+	if(shard->spill_read == shard->spill_write && shard->spill_len == 0){
+		/* caught up, back to the memory queue */
+		if(ftruncate(shard->spill_fd, 0)){
+			fprintf(stderr, "Error: Unable to truncate spill file: %s.\n", strerror(errno));
+		}
+		shard->spill_read = shard->spill_write = 0;
+		shard->spilling = false;
+	}
+}
+
+
+static void *queue_writer(void *obj)
+{
+	struct queue_shard *shard = obj;
+	struct queue_item *item;
+	char *buf = NULL;
+	size_t size = 0;
+	char name[32];
+	int i;
+
+	if(queue_cfg->cpu_writers){
+		/* before the thread's render context and pool cache exist, so
+		 * they are allocated on its node */
+		i = (int)(shard - shards);
+		snprintf(name, sizeof(name), "writer %d", i);
+		affinity_set(queue_cfg, name, &queue_cfg->cpu_writers[i % queue_cfg->cpu_writers_count], 1);
+	}
+
+	pthread_mutex_lock(&shard->mutex);
+	while(1){
+		while(!shard->head && !shard->spilling && !shard->stop){
+			pthread_cond_wait(&shard->cond, &shard->mutex);
+		}
+		item = shard->head;
+		if(!item){
+			if(!shard->spilling) break;
+			if(!buf){
+				buf = malloc(SPILL_BUF_SIZE);
+				if(!buf){
+					pthread_mutex_unlock(&shard->mutex);
+					fprintf(stderr, "Error: Out of memory.\n");
+					pthread_mutex_lock(&shard->mutex);
+					pthread_cond_wait(&shard->cond, &shard->mutex);
+					continue;
+				}
+				size = SPILL_BUF_SIZE;
+			}
+			/* the memory queue holds older messages, so only now */
+			spill_drain(shard, &buf, &size);
+			continue;
+		}
+		shard->head = item->next;
+		if(!shard->head){
+			shard->tail = NULL;
+		}
+		pthread_mutex_unlock(&shard->mutex);
+
+		latency_resume(item->start);
+		latency_mark(LAT_QUEUE);
+		item->rc = queue_write(queue_cfg, &item->message);
+		queue_done(item);
+
+		pthread_mutex_lock(&shard->mutex);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	free(buf);
+	print_message_cleanup();
+	pool_thread_flush();
+	return NULL;
+}
+
+
+static int spill_open(struct queue_shard *shard, int idx)
+{
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/mqtt-dirpub-%d-%d.spill", queue_cfg->spill_dir, (int)getpid(), idx);
+	shard->spill_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if(shard->spill_fd < 0){
+		fprintf(stderr, "Error: Unable to open spill file %s: %s.\n", path, strerror(errno));
+		return 1;
+	}
+	/* nothing to recover after a crash, unacknowledged messages come back
+	 * from the broker */
+	unlink(path);
+	shard->spill_buf = malloc(SPILL_BUF_SIZE);
+	if(!shard->spill_buf){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	return 0;
+}
+
+
+int queue_init(struct mosq_config *cfg, queue_write_fn write_fn)
+{
+	int i;
+
+	queue_cfg = cfg;
+	queue_write = write_fn;
+
+#ifdef __linux__
+	notify_pipe[0] = notify_pipe[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(notify_pipe[0] < 0){
+		fprintf(stderr, "Error: Unable to create writer queue eventfd.\n");
+		return 1;
+	}
+#else
+	if(pipe(notify_pipe)){
+		fprintf(stderr, "Error: Unable to create writer queue pipe.\n");
+		return 1;
+	}
+	fcntl(notify_pipe[0], F_SETFL, fcntl(notify_pipe[0], F_GETFL) | O_NONBLOCK);
+	fcntl(notify_pipe[1], F_SETFL, fcntl(notify_pipe[1], F_GETFL) | O_NONBLOCK);
+#endif
+
+	shards = calloc(cfg->writers, sizeof(struct queue_shard));
+	if(!shards){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	for(i=0; i<cfg->writers; i++){
+		pthread_mutex_init(&shards[i].mutex, NULL);
+		pthread_cond_init(&shards[i].cond, NULL);
+		shards[i].spill_fd = -1;
+		if(cfg->spill_dir && spill_open(&shards[i], i)){
+			return 1;
+		}
+		if(pthread_create(&shards[i].thread, NULL, queue_writer, &shards[i])){
+			fprintf(stderr, "Error: Unable to start writer thread.\n");
+			return 1;
+		}
+		shard_count++;
+	}
+	queue_stats_enabled = true;
+	pool_stats_enabled = true;
+	spill_stats_enabled = (cfg->spill_dir != NULL);
+	return 0;
+}
+
+
+int queue_push(const struct mosquitto_message *message, unsigned int conn)
+{
+	struct queue_item *item;
+	struct queue_shard *shard;
+	size_t topic_len;
+
+	shard = &shards[queue_hash(message->topic) % (unsigned int)shard_count];
+	if(shard->spill_fd >= 0){
+		pthread_mutex_lock(&shard->mutex);
+		if(shard->spilling || queue_full()){
+			shard->spilling = true;
+			spill_append(shard, message, conn);
+			pthread_cond_signal(&shard->cond);
+			pthread_mutex_unlock(&shard->mutex);
+			return 0;
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	/* the item, topic and payload in one pooled buffer, the payload is
+	 * terminated like mosquitto_message_copy() does */
+	topic_len = strlen(message->topic);
+	item = pool_alloc(sizeof(struct queue_item) + topic_len + 1 + (size_t)message->payloadlen + 1);
+	if(!item){
+		return 1;
+	}
+	memset(item, 0, sizeof(struct queue_item));
+	item->message.mid = message->mid;
+	item->message.qos = message->qos;
+	item->message.retain = message->retain;
+	item->message.topic = (char *)(item + 1);
+	memcpy(item->message.topic, message->topic, topic_len + 1);
+	item->message.payload = item->message.topic + topic_len + 1;
+	item->message.payloadlen = message->payloadlen;
+	if(message->payloadlen){
+		memcpy(item->message.payload, message->payload, (size_t)message->payloadlen);
+	}
+	((char *)item->message.payload)[message->payloadlen] = '\0';
+	item->bytes = topic_len + (size_t)message->payloadlen;
+	item->start = latency_started();
+	item->conn = conn;
+
+	queue_stats_add(&queue_stats.depth, &queue_stats.max_depth, 1);
+	queue_stats_add(&queue_stats.bytes, &queue_stats.max_bytes, item->bytes);
+
+	pthread_mutex_lock(&shard->mutex);
+	if(shard->tail){
+		shard->tail->next = item;
+	}else{
+		shard->head = item;
+	}
+	shard->tail = item;
+	pthread_cond_signal(&shard->cond);
+	pthread_mutex_unlock(&shard->mutex);
+
+	return 0;
+}
+
+
+int queue_notify_fd(void)
+{
+	return notify_pipe[0];
+}
+
+
+int queue_complete(queue_done_fn done)
+{
+	struct queue_item *list, *item, *next;
+	char buf[64];
+	int count = 0;
+
+	/* an eventfd is reset by a single read of its counter */
+	while(read(notify_pipe[0], buf, sizeof(buf)) > 0){
+	}
+
+	pthread_mutex_lock(&done_mutex);
+	list = done_list;
+	done_list = NULL;
+	pthread_mutex_unlock(&done_mutex);
+
+	/* oldest first */
+	item = NULL;
+	while(list){
+		next = list->next;
+		list->next = item;
+		item = list;
+		list = next;
+	}
+
+	while(item){
+		next = item->next;
+		if(done){
+			done(&item->message, item->conn, item->rc);
+		}
+		__atomic_sub_fetch(&queue_stats.depth, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&queue_stats.bytes, item->bytes, __ATOMIC_RELAXED);
+		pool_free(item);
+		item = next;
+		count++;
+	}
+	return count;
+}
+
+
+void queue_wait(int timeout_ms)
+{
+	struct pollfd pfd;
+
+	pfd.fd = notify_pipe[0];
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	poll(&pfd, 1, timeout_ms);
+}
+
+
+bool queue_idle(void)
+{
+	/* drained records are counted in depth before leaving the spill bytes */
+	return __atomic_load_n(&spill_stats.bytes, __ATOMIC_RELAXED) == 0
+			&& __atomic_load_n(&queue_stats.depth, __ATOMIC_RELAXED) == 0;
+}
+
+
+bool queue_paused(void)
+{
+	uint64_t depth, bytes;
+	uint64_t now;
+	bool high, low;
+	bool p;
+
+	if(queue_cfg->spill_dir){
+		/* a full memory queue spills, only a full spill file pauses */
+		bytes = __atomic_load_n(&spill_stats.bytes, __ATOMIC_RELAXED);
+		high = queue_cfg->spill_max && bytes >= queue_cfg->spill_max;
+		low = !queue_cfg->spill_max || bytes <= queue_cfg->spill_max / 2;
+	}else{
+		depth = __atomic_load_n(&queue_stats.depth, __ATOMIC_RELAXED);
+		bytes = __atomic_load_n(&queue_stats.bytes, __ATOMIC_RELAXED);
+		high = queue_full();
+		low = (!queue_cfg->queue_high || depth <= (uint64_t)queue_cfg->queue_low)
+				&& (!queue_cfg->queue_high_bytes || bytes <= queue_cfg->queue_low_bytes);
+	}
+	p = __atomic_load_n(&paused, __ATOMIC_RELAXED);
+
+	if(!p){
+		if(high){
+
+			if(__atomic_compare_exchange_n(&paused, &p, true, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				__atomic_store_n(&paused_since, stats_now_ns(), __ATOMIC_RELAXED);
+				__atomic_add_fetch(&queue_stats.pauses, 1, __ATOMIC_RELAXED);
+			}
+			return true;
+		}
+	}else{
+		if(low){
+
+			if(__atomic_compare_exchange_n(&paused, &p, false, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				now = stats_now_ns();
+				__atomic_add_fetch(&queue_stats.paused_ns,
+						now - __atomic_load_n(&paused_since, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+			}
+			return false;
+		}
+	}
+	return p;
+}
+
+
+void queue_stop(queue_done_fn done)
+{
+	int i;
+
+	for(i=0; i<shard_count; i++){
+		pthread_mutex_lock(&shards[i].mutex);
+		shards[i].stop = true;
+		pthread_cond_signal(&shards[i].cond);
+		pthread_mutex_unlock(&shards[i].mutex);
+	}
+	for(i=0; i<shard_count; i++){
+		pthread_join(shards[i].thread, NULL);
+		pthread_mutex_destroy(&shards[i].mutex);
+		pthread_cond_destroy(&shards[i].cond);
+		if(shards[i].spill_fd >= 0){
+			close(shards[i].spill_fd);
+		}
+		free(shards[i].spill_buf);
+	}
+	queue_complete(done);
+
+	free(shards);
+	shards = NULL;
+	shard_count = 0;
+	close(notify_pipe[0]);
+	if(notify_pipe[1] != notify_pipe[0]){
+		close(notify_pipe[1]);
+	}
+	notify_pipe[0] = notify_pipe[1] = -1;
+}
+
+#endif
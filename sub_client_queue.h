@@ -0,0 +1,53 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#ifndef SUB_CLIENT_QUEUE_H
+#define SUB_CLIENT_QUEUE_H
+
+#include <stdbool.h>
+
+#include <mosquitto.h>
+#include "client_shared.h"
+
+/* Writer queue (--writers): messages are copied off the network thread and
+ * written by a pool of threads. Messages are sharded by topic, so records of
+ * one topic are written in the order they were received.
+ *
+ * Completed messages are handed back to the network thread, which calls the
+ * done function from queue_complete(), e.g. to acknowledge them. Each message
+ * carries the connection it was received on, mids are only valid there. */
+
+typedef int (*queue_write_fn)(struct mosq_config *cfg, const struct mosquitto_message *message);
+typedef void (*queue_done_fn)(const struct mosquitto_message *message, unsigned int conn, int rc);
+
+int queue_init(struct mosq_config *cfg, queue_write_fn write_fn);
+int queue_push(const struct mosquitto_message *message, unsigned int conn);
+
+/* fd that becomes readable when messages completed */
+int queue_notify_fd(void);
+int queue_complete(queue_done_fn done);
+void queue_wait(int timeout_ms);
+
+/* true once every queued or spilled message completed */
+bool queue_idle(void);
+
+/* true from the high watermark until the queue drained below the low one */
+bool queue_paused(void);
+
+/* write everything queued, then stop the writers */
+void queue_stop(queue_done_fn done);
+
+#endif
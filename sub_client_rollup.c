@@ -0,0 +1,381 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#include "config.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+#include <mosquitto.h>
+#include "client_shared.h"
+#include "sub_client_intern.h"
+#include "sub_client_rollup.h"
+#include "sub_client_stats.h"
+
+#define ROLLUP_NUMBER_MAX 64
+
+/* Aggregate of one topic, indexed by its interned id. */
+struct rollup_topic {
+	const struct rollup_rule *rule; /* NULL if no rule matched */
+	bool matched;                   /* rule looked up */
+	uint64_t window;                /* start of the window, ns since the epoch */
+	uint64_t count;
+	double min;
+	double max;
+	double sum;
+};
+
+static struct mosq_config *rollup_cfg = NULL;
+static rollup_write_fn rollup_write = NULL;
+static struct rollup_topic *states = NULL;
+static uint32_t state_count = 0;
+static uint64_t next_end = UINT64_MAX; /* earliest end of an open window */
+static char *field_key = NULL;         /* "\"field\"" */
+static size_t field_key_len = 0;
+static char *topic_buf = NULL;         /* "rollup/<topic>" */
+static size_t topic_buf_size = 0;
+#ifndef WIN32
+/* only the benchmark calls the message callback from several threads */
+static pthread_mutex_t states_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+static uint64_t rollup_now_ns(void)
+{
+#ifdef WIN32
+	return (uint64_t)time(NULL) * 1000000000ULL;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+/* The state of id, with its rule looked up on first sight. */
+static struct rollup_topic *rollup_state(uint32_t id, const char *topic)
+{
+	struct rollup_topic *s;
+	uint32_t count;
+	bool res;
+	int i;
+
+	if(id >= state_count){
+		count = state_count ? state_count : 256;
+		while(count <= id){
+			count *= 2;
+		}
+		s = realloc(states, count*sizeof(struct rollup_topic));
+		if(!s){
+			return NULL;
+		}
+		memset(s + state_count, 0, (count - state_count)*sizeof(struct rollup_topic));
+		states = s;
+		state_count = count;
+	}
+	s = &states[id];
+	if(!s->matched){
+		s->matched = true;
+		for(i=0; i<rollup_cfg->rollup_count; i++){
+			mosquitto_topic_matches_sub(rollup_cfg->rollups[i].filter, topic, &res);
+			if(res){
+				s->rule = &rollup_cfg->rollups[i];
+				__atomic_add_fetch(&rollup_stats.topics, 1, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+	}
+	return s;
+}
+
+
+/* Find the value of --rollup-field: the first "field" key followed by a
+ * colon, the JSON is not validated otherwise. */
+static const char *rollup_field(const char *payload, size_t len, size_t *value_len)
+{
+	const char *p = payload;
+	const char *end = payload + len;
+
+	while((size_t)(end - p) >= field_key_len){
+		p = memchr(p, '"', (size_t)(end - p) - field_key_len + 1);
+		if(!p){
+			return NULL;
+		}
+		if(!memcmp(p, field_key, field_key_len)){
+			p += field_key_len;
+			while(p < end && isspace((unsigned char)*p)) p++;
+			if(p < end && *p == ':'){
+				p++;
+				while(p < end && isspace((unsigned char)*p)) p++;
+				if(p < end && *p == '"'){
+					/* numbers sent as strings */
+					p++;
+				}
+				*value_len = (size_t)(end - p);
+				return p;
+			}
+		}else{
+			p++;
+		}
+	}
+	return NULL;
+}
+
+/* Parse a number at the start of str (not terminated), returns 0 on success. */
+static int rollup_number(const char *str, size_t len, double *value)
+{
+	char buf[ROLLUP_NUMBER_MAX];
+	char *end;
+	size_t n = 0;
+
+	while(len && isspace((unsigned char)*str)){
+		str++;
+		len--;
+	}
+	while(n < len && n < sizeof(buf)-1 && (isdigit((unsigned char)str[n])
+				|| str[n] == '-' || str[n] == '+' || str[n] == '.'
+				|| str[n] == 'e' || str[n] == 'E')){
+		buf[n] = str[n];
+		n++;
+	}
+	buf[n] = '\0';
+	*value = strtod(buf, &end);
+	if(n == 0 || *end != '\0' || !isfinite(*value)){
+		return 1;
+	}
+	if(!rollup_cfg->rollup_field){
+		/* a plain payload is the number only */
+		for(; n < len; n++){
+			if(!isspace((unsigned char)str[n])) return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* Write the record of a window and start over. */
+static void rollup_close(struct rollup_topic *s, const char *topic)
+{
+	struct mosquitto_message message;
+	char payload[256];
+	size_t size;
+	char *buf;
+	int len;
+
+	len = snprintf(payload, sizeof(payload),
+			"{\"start\":%llu,\"window\":%.3f,\"count\":%llu,\"min\":%.15g,\"max\":%.15g,\"avg\":%.15g}",
+			(unsigned long long)(s->window / 1000000000ULL),
+			s->rule->window / 1e9,
+			(unsigned long long)s->count,
+			s->min, s->max, s->sum / (double)s->count);
+	s->count = 0;
+
+	if(rollup_cfg->rollup_raw){
+		/* the raw messages keep the topic itself */
+		size = strlen("rollup/") + strlen(topic) + 1;
+		if(size > topic_buf_size){
+			buf = realloc(topic_buf, size);
+			if(!buf){
+				return;
+			}
+			topic_buf = buf;
+			topic_buf_size = size;
+		}
+		snprintf(topic_buf, size, "rollup/%s", topic);
+		topic = topic_buf;
+	}
+
+	memset(&message, 0, sizeof(message));
+	message.topic = (char *)topic;
+	message.payload = payload;
+	message.payloadlen = len;
+	__atomic_add_fetch(&rollup_stats.records, 1, __ATOMIC_RELAXED);
+	rollup_write(&message);
+}
+
+/* Close every window that ended by now (all with now == UINT64_MAX). */
+static void rollup_sweep(uint64_t now)
+{
+	uint64_t end;
+	uint32_t id;
+
+	next_end = UINT64_MAX;
+	for(id=0; id<state_count; id++){
+		if(!states[id].count){
+			continue;
+		}
+		end = states[id].window + states[id].rule->window;
+		if(end <= now){
+			rollup_close(&states[id], intern_name(id));
+		}else if(end < next_end){
+			next_end = end;
+		}
+	}
+}
+
+/* The id is about to be reused for another topic. */
+static void rollup_evict(uint32_t id, const char *topic)
+{
+	struct rollup_topic *s;
+
+#ifndef WIN32
+	pthread_mutex_lock(&states_mutex);
+#endif
+	if(id < state_count){
+		s = &states[id];
+		if(s->count){
+			/* the window ends early, next_end is at worst too soon */
+			rollup_close(s, topic);
+		}
+		if(s->rule){
+			__atomic_sub_fetch(&rollup_stats.topics, 1, __ATOMIC_RELAXED);
+		}
+		memset(s, 0, sizeof(struct rollup_topic));
+	}
+#ifndef WIN32
+	pthread_mutex_unlock(&states_mutex);
+#endif
+}
+
+
+int rollup_init(struct mosq_config *cfg, rollup_write_fn write_fn)
+{
+	rollup_cfg = cfg;
+	rollup_write = write_fn;
+	rollup_stats_enabled = (cfg->rollup_count > 0);
+	if(cfg->rollup_field){
+		field_key_len = strlen(cfg->rollup_field) + 2;
+		field_key = malloc(field_key_len + 1);
+		if(!field_key){
+			err_printf(cfg, "Error: Out of memory.\n");
+			return 1;
+		}
+		snprintf(field_key, field_key_len + 1, "\"%s\"", cfg->rollup_field);
+	}
+	if(cfg->rollup_count){
+		intern_on_evict(rollup_evict);
+	}
+	return 0;
+}
+
+
+bool rollup_message(const struct mosquitto_message *message, uint32_t id)
+{
+	struct rollup_topic *entry;
+	const char *value;
+	size_t value_len;
+	uint64_t now;
+	double v;
+	bool consumed = false;
+
+	if(id == INTERN_NONE){
+		return false;
+	}
+#ifndef WIN32
+	pthread_mutex_lock(&states_mutex);
+#endif
+	now = rollup_now_ns();
+	if(now >= next_end){
+		rollup_sweep(now);
+	}
+
+	entry = rollup_state(id, message->topic);
+	if(!entry || !entry->rule){
+		goto unlock;
+	}
+
+	value = message->payload;
+	value_len = (size_t)message->payloadlen;
+	if(rollup_cfg->rollup_field && value){
+		value = rollup_field(value, value_len, &value_len);
+	}
+	if(!value || rollup_number(value, value_len, &v)){
+		/* written as usual */
+		__atomic_add_fetch(&rollup_stats.invalid, 1, __ATOMIC_RELAXED);
+		goto unlock;
+	}
+	consumed = !rollup_cfg->rollup_raw;
+
+	if(entry->count == 0){
+		entry->window = now - now % entry->rule->window;
+		entry->min = entry->max = v;
+		entry->sum = 0.0;
+		if(entry->window + entry->rule->window < next_end){
+			next_end = entry->window + entry->rule->window;
+		}
+	}
+	if(v < entry->min) entry->min = v;
+	if(v > entry->max) entry->max = v;
+	entry->sum += v;
+	entry->count++;
+
+unlock:
+#ifndef WIN32
+	pthread_mutex_unlock(&states_mutex);
+#endif
+	return consumed;
+}
+
+
+void rollup_expire(void)
+{
+	uint64_t now;
+
+#ifndef WIN32
+	pthread_mutex_lock(&states_mutex);
+#endif
+	now = rollup_now_ns();
+	if(now >= next_end){
+		rollup_sweep(now);
+	}
+#ifndef WIN32
+	pthread_mutex_unlock(&states_mutex);
+#endif
+}
+
+
+void rollup_flush(void)
+{
+#ifndef WIN32
+	pthread_mutex_lock(&states_mutex);
+#endif
+	rollup_sweep(UINT64_MAX);
+#ifndef WIN32
+	pthread_mutex_unlock(&states_mutex);
+#endif
+}
+
+
+void rollup_cleanup(void)
+{
+	free(states);
+	states = NULL;
+	state_count = 0;
+	next_end = UINT64_MAX;
+	free(topic_buf);
+	topic_buf = NULL;
+	topic_buf_size = 0;
+	free(field_key);
+	field_key = NULL;
+}
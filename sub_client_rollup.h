@@ -0,0 +1,51 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#ifndef SUB_CLIENT_ROLLUP_H
+#define SUB_CLIENT_ROLLUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <mosquitto.h>
+#include "client_shared.h"
+
+/* Windowed numeric rollups (--rollup). The payload (or a JSON field of it)
+ * of matching topics is parsed as a number and folded into count, min, max
+ * and sum per topic. Windows are aligned to the wall clock; once one ended,
+ * a rollup record is handed to the write function as a QoS 0 message of the
+ * same topic ("rollup/<topic>" with --rollup-raw). The state is indexed by the
+ * interned topic id, an evicted topic has its window closed early. */
+
+typedef void (*rollup_write_fn)(const struct mosquitto_message *message);
+
+int rollup_init(struct mosq_config *cfg, rollup_write_fn write_fn);
+
+/* True if the message was folded into a rollup and is not written itself,
+ * messages that don't parse are. Writes the records of windows that ended
+ * first. */
+bool rollup_message(const struct mosquitto_message *message, uint32_t id);
+
+/* write the records of windows that ended, called from a timer so records
+ * are not held back by a quiet subscription */
+void rollup_expire(void);
+
+/* write the records of every window, ended or not, at exit */
+void rollup_flush(void);
+
+void rollup_cleanup(void);
+
+#endif
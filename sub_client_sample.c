@@ -0,0 +1,274 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+#include <mosquitto.h>
+#include "client_shared.h"
+#include "sub_client_intern.h"
+#include "sub_client_sample.h"
+#include "sub_client_stats.h"
+
+/* Window state of one topic, indexed by its interned id. */
+struct sample_topic {
+	const struct sample_rule *rule; /* NULL if no rule matched */
+	bool matched;                   /* rule looked up */
+	uint64_t window;                /* current window, or message count */
+	bool seen;
+	/* last-in-window copy, the buffer is kept and reused */
+	bool held;
+	void *payload;
+	int payloadlen;
+	size_t payload_size;
+	int mid;
+	int qos;
+	bool retain;
+};
+
+static struct mosq_config *sample_cfg = NULL;
+static sample_release_fn sample_release_cb = NULL;
+static struct sample_topic *states = NULL;
+static uint32_t state_count = 0;
+#ifndef WIN32
+/* only the benchmark calls the message callback from several threads */
+static pthread_mutex_t states_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/* The state of id, with its rule looked up on first sight. */
+static struct sample_topic *sample_state(uint32_t id, const char *topic)
+{
+	struct sample_topic *s;
+	uint32_t count;
+	bool res;
+	int i;
+
+	if(id >= state_count){
+		count = state_count ? state_count : 256;
+		while(count <= id){
+			count *= 2;
+		}
+		s = realloc(states, count*sizeof(struct sample_topic));
+		if(!s){
+			return NULL;
+		}
+		memset(s + state_count, 0, (count - state_count)*sizeof(struct sample_topic));
+		states = s;
+		state_count = count;
+	}
+	s = &states[id];
+	if(!s->matched){
+		s->matched = true;
+		for(i=0; i<sample_cfg->sample_count; i++){
+			mosquitto_topic_matches_sub(sample_cfg->samples[i].filter, topic, &res);
+			if(res){
+				s->rule = &sample_cfg->samples[i];
+				__atomic_add_fetch(&sample_stats.topics, 1, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+	}
+	return s;
+}
+
+/* Copy message into the state, reusing its buffer. */
+static int sample_hold(struct sample_topic *s, const struct mosquitto_message *message)
+{
+	void *payload;
+
+	if((size_t)message->payloadlen > s->payload_size){
+		payload = realloc(s->payload, (size_t)message->payloadlen);
+		if(!payload){
+			return 1;
+		}
+		s->payload = payload;
+		s->payload_size = (size_t)message->payloadlen;
+	}
+	if(message->payloadlen){
+		memcpy(s->payload, message->payload, (size_t)message->payloadlen);
+	}
+	s->payloadlen = message->payloadlen;
+	s->mid = message->mid;
+	s->qos = message->qos;
+	s->retain = message->retain;
+	s->held = true;
+	return 0;
+}
+
+static void sample_release(struct sample_topic *s, uint32_t id, const char *topic)
+{
+	struct mosquitto_message message;
+
+	memset(&message, 0, sizeof(message));
+	message.topic = (char *)topic;
+	message.payload = s->payloadlen ? s->payload : NULL;
+	message.payloadlen = s->payloadlen;
+	message.mid = s->mid;
+	message.qos = s->qos;
+	message.retain = s->retain;
+	s->held = false;
+	sample_release_cb(&message, id);
+}
+
+/* The id is about to be reused for another topic. */
+static void sample_evict(uint32_t id, const char *topic)
+{
+	struct sample_topic *s;
+
+#ifndef WIN32
+	pthread_mutex_lock(&states_mutex);
+#endif
+	if(id < state_count){
+		s = &states[id];
+		if(s->held){
+			sample_release(s, id, topic);
+		}
+		if(s->rule){
+			__atomic_sub_fetch(&sample_stats.topics, 1, __ATOMIC_RELAXED);
+		}
+		free(s->payload);
+		memset(s, 0, sizeof(struct sample_topic));
+	}
+#ifndef WIN32
+	pthread_mutex_unlock(&states_mutex);
+#endif
+}
+
+
+int sample_init(struct mosq_config *cfg, sample_release_fn release)
+{
+	sample_cfg = cfg;
+	sample_release_cb = release;
+	sample_stats_enabled = (cfg->sample_count > 0);
+	if(cfg->sample_count){
+		intern_on_evict(sample_evict);
+	}
+	return 0;
+}
+
+
+bool sample_message(const struct mosquitto_message *message, uint32_t id)
+{
+	struct sample_topic *s;
+	uint64_t window;
+	bool drop = false;
+
+	if(id == INTERN_NONE){
+		return false;
+	}
+#ifndef WIN32
+	pthread_mutex_lock(&states_mutex);
+#endif
+	s = sample_state(id, message->topic);
+	if(!s || !s->rule){
+		/* no rule (or out of memory), written as usual */
+		goto unlock;
+	}
+
+	switch(s->rule->mode){
+		case SAMPLE_FIRST:
+			window = stats_now_ns() / s->rule->arg;
+			drop = s->seen && s->window == window;
+			s->window = window;
+			break;
+		case SAMPLE_LAST:
+			window = stats_now_ns() / s->rule->arg;
+			if(s->held){
+				if(s->window != window){
+					sample_release(s, id, message->topic);
+				}else{
+					__atomic_add_fetch(&sample_stats.dropped, 1, __ATOMIC_RELAXED);
+				}
+			}
+			if(sample_hold(s, message)){
+				goto unlock;
+			}
+			s->window = window;
+			drop = true;
+			goto unlock;
+		case SAMPLE_NTH:
+			drop = (s->window % s->rule->arg) != 0;
+			s->window++;
+			break;
+	}
+	s->seen = true;
+	if(drop){
+		__atomic_add_fetch(&sample_stats.dropped, 1, __ATOMIC_RELAXED);
+	}
+
+unlock:
+#ifndef WIN32
+	pthread_mutex_unlock(&states_mutex);
+#endif
+	return drop;
+}
+
+
+void sample_expire(void)
+{
+	uint64_t now;
+	uint32_t id;
+
+	now = stats_now_ns();
+#ifndef WIN32
+	pthread_mutex_lock(&states_mutex);
+#endif
+	for(id=0; id<state_count; id++){
+		if(states[id].held && states[id].window != now / states[id].rule->arg){
+			sample_release(&states[id], id, intern_name(id));
+		}
+	}
+#ifndef WIN32
+	pthread_mutex_unlock(&states_mutex);
+#endif
+}
+
+
+void sample_flush(void)
+{
+	uint32_t id;
+
+#ifndef WIN32
+	pthread_mutex_lock(&states_mutex);
+#endif
+	for(id=0; id<state_count; id++){
+		if(states[id].held){
+			sample_release(&states[id], id, intern_name(id));
+		}
+	}
+#ifndef WIN32
+	pthread_mutex_unlock(&states_mutex);
+#endif
+}
+
+
+void sample_cleanup(void)
+{
+	uint32_t id;
+
+	for(id=0; id<state_count; id++){
+		free(states[id].payload);
+	}
+	free(states);
+	states = NULL;
+	state_count = 0;
+}
@@ -0,0 +1,49 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#ifndef SUB_CLIENT_SAMPLE_H
+#define SUB_CLIENT_SAMPLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <mosquitto.h>
+#include "client_shared.h"
+
+/* Per topic downsampling (--sample), evaluated in my_message_callback()
+ * before anything is rendered or written. The first matching rule of a
+ * topic is looked up once and kept with the topic's window state, indexed
+ * by the interned topic id. */
+
+typedef void (*sample_release_fn)(const struct mosquitto_message *message, uint32_t id);
+
+int sample_init(struct mosq_config *cfg, sample_release_fn release);
+
+/* True if the message is not to be written now. Last-in-window rules keep a
+ * copy of it instead, release is called with the copy kept for the previous
+ * window once a message of a later window arrives, or the topic is evicted
+ * from the intern table. */
+bool sample_message(const struct mosquitto_message *message, uint32_t id);
+
+/* release the messages kept for windows that ended, from a timer */
+void sample_expire(void);
+
+/* release every message still kept, at exit */
+void sample_flush(void);
+
+void sample_cleanup(void);
+
+#endif
@@ -0,0 +1,365 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef WIN32
+#include <windows.h>
+#  define THREAD_LOCAL __declspec(thread)
+#else
+#  define THREAD_LOCAL __thread
+#endif
+
+#include "sub_client_stats.h"
+
+bool latency_enabled = false;
+bool profile_enabled = false;
+bool queue_stats_enabled = false;
+struct queue_stats queue_stats;
+bool pool_stats_enabled = false;
+struct pool_stats pool_stats;
+bool ack_stats_enabled = false;
+struct ack_stats ack_stats;
+bool spill_stats_enabled = false;
+struct spill_stats spill_stats;
+bool dedup_stats_enabled = false;
+struct dedup_stats dedup_stats;
+bool sample_stats_enabled = false;
+struct sample_stats sample_stats;
+bool rollup_stats_enabled = false;
+struct rollup_stats rollup_stats;
+bool intern_stats_enabled = false;
+struct intern_stats intern_stats;
+volatile sig_atomic_t stats_dump_requested = 0;
+void (*stats_dump_topk)(FILE *fptr) = NULL;
+
+static struct latency_hist latency[LAT_STAGE_COUNT];
+static const char *latency_names[LAT_STAGE_COUNT] = {
+	"dispatch", "queue", "path", "write", "sync"
+};
+
+static struct profile_stage profile[PROF_STAGE_COUNT];
+static const char *profile_names[PROF_STAGE_COUNT] = {
+	"callback", "filter", "render", "mkdir", "open", "write", "sync", "close"
+};
+/* where the tick counter was calibrated from */
+static uint64_t profile_ticks0;
+static uint64_t profile_ns0;
+
+/* receive timestamp of the message being handled by this thread */
+static THREAD_LOCAL uint64_t latency_start;
+
+
+uint64_t stats_now_ns(void)
+{
+#ifdef WIN32
+	LARGE_INTEGER count, freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (uint64_t)(count.QuadPart / (double)freq.QuadPart * 1e9);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+/* Map a value to its bucket: values below 2^LAT_SUB_BITS get a bucket each,
+ * above that each power of two gets 2^LAT_SUB_BITS equally sized buckets. */
+static int latency_index(uint64_t v)
+{
+	int msb;
+	int shift;
+
+	if(v >= (1ULL << LAT_MAX_BITS)){
+		v = (1ULL << LAT_MAX_BITS) - 1;
+	}
+	if(v < (1ULL << LAT_SUB_BITS)){
+		return (int)v;
+	}
+	msb = 63 - __builtin_clzll(v);
+	shift = msb - LAT_SUB_BITS;
+	return ((shift + 1) << LAT_SUB_BITS) + (int)((v >> shift) - (1ULL << LAT_SUB_BITS));
+}
+
+
+/* Highest value that maps to the given bucket. */
+static uint64_t latency_value(int idx)
+{
+	int group;
+	int shift;
+
+	if(idx < (1 << LAT_SUB_BITS)){
+		return (uint64_t)idx;
+	}
+	group = idx >> LAT_SUB_BITS;
+	shift = group - 1;
+	return (((uint64_t)(idx - (group << LAT_SUB_BITS) + (1 << LAT_SUB_BITS))) << shift)
+			+ (1ULL << shift) - 1;
+}
+
+
+void latency_record(int stage, uint64_t ns)
+{
+	struct latency_hist *hist = &latency[stage];
+	uint64_t max;
+
+	__atomic_fetch_add(&hist->buckets[latency_index(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	while(ns > max){
+		if(__atomic_compare_exchange_n(&hist->max, &max, ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+			break;
+		}
+	}
+}
+
+
+void latency_begin(void)
+{
+	if(latency_enabled){
+		latency_start = stats_now_ns();
+	}
+}
+
+
+/* Lets a writer thread time a message received on another thread. */
+uint64_t latency_started(void)
+{
+	return latency_enabled ? latency_start : 0;
+}
+
+
+void latency_resume(uint64_t start)
+{
+	latency_start = start;
+}
+
+
+void latency_mark(int stage)
+{
+	if(latency_enabled && latency_start){
+		latency_record(stage, stats_now_ns() - latency_start);
+	}
+}
+
+
+/* The TSC where there is one (constant rate on anything recent), a few
+ * cycles instead of a clock_gettime() call. */
+static uint64_t profile_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return stats_now_ns();
+#endif
+}
+
+
+void profile_init(void)
+{
+	profile_enabled = true;
+	profile_ticks0 = profile_ticks();
+	profile_ns0 = stats_now_ns();
+}
+
+
+uint64_t profile_begin(void)
+{
+	return profile_enabled ? profile_ticks() : 0;
+}
+
+
+void profile_end(int stage, uint64_t start)
+{
+	if(profile_enabled){
+		__atomic_fetch_add(&profile[stage].ticks, profile_ticks() - start, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&profile[stage].count, 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+void profile_syscalls(int stage, int count)
+{
+	if(profile_enabled){
+		__atomic_fetch_add(&profile[stage].syscalls, (uint64_t)count, __ATOMIC_RELAXED);
+	}
+}
+
+
+uint64_t latency_percentile(const struct latency_hist *hist, double pct)
+{
+	uint64_t count;
+	uint64_t want;
+	uint64_t seen = 0;
+	int i;
+
+	count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	if(count == 0) return 0;
+
+	want = (uint64_t)(count * pct / 100.0 + 0.5);
+	if(want < 1) want = 1;
+	if(want > count) want = count;
+
+	for(i=0; i<LAT_BUCKETS; i++){
+		seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		if(seen >= want){
+			/* never report more than the exact maximum seen */
+			if(latency_value(i) > hist->max) return hist->max;
+			return latency_value(i);
+		}
+	}
+	return hist->max;
+}
+
+
+void stats_dump(FILE *fptr)
+{
+	int i;
+	const struct latency_hist *hist;
+	uint64_t drain_ns, drained_bytes;
+	uint64_t allocs;
+	const struct profile_stage *stage;
+	uint64_t elapsed, ticks, count, msgs, syscalls;
+	double ns_per_tick, ns;
+
+	if(latency_enabled){
+		fprintf(fptr, "%-10s %12s %12s %12s %12s %12s\n",
+				"latency", "count", "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+		for(i=0; i<LAT_STAGE_COUNT; i++){
+			hist = &latency[i];
+			if(hist->count == 0) continue;
+			fprintf(fptr, "%-10s %12llu %12.1f %12.1f %12.1f %12.1f\n",
+					latency_names[i],
+					(unsigned long long)hist->count,
+					latency_percentile(hist, 50.0) / 1000.0,
+					latency_percentile(hist, 99.0) / 1000.0,
+					latency_percentile(hist, 99.9) / 1000.0,
+					hist->max / 1000.0);
+		}
+	}
+	if(profile_enabled){
+		/* ticks to ns over the whole run so far */
+		elapsed = stats_now_ns() - profile_ns0;
+		ticks = profile_ticks() - profile_ticks0;
+		ns_per_tick = ticks ? (double)elapsed / ticks : 1.0;
+		msgs = __atomic_load_n(&profile[PROF_CALLBACK].count, __ATOMIC_RELAXED);
+		fprintf(fptr, "%-10s %12s %12s %12s %12s %12s %12s\n",
+				"profile", "count", "total(ms)", "avg(us)", "us/msg", "syscalls", "syscalls/msg");
+		for(i=0; i<PROF_STAGE_COUNT; i++){
+			stage = &profile[i];
+			count = __atomic_load_n(&stage->count, __ATOMIC_RELAXED);
+			if(count == 0) continue;
+			ns = __atomic_load_n(&stage->ticks, __ATOMIC_RELAXED) * ns_per_tick;
+			syscalls = __atomic_load_n(&stage->syscalls, __ATOMIC_RELAXED);
+			fprintf(fptr, "%-10s %12llu %12.1f %12.2f %12.2f %12llu %12.2f\n",
+					profile_names[i],
+					(unsigned long long)count,
+					ns / 1e6,
+					ns / count / 1e3,
+					msgs ? ns / msgs / 1e3 : 0.0,
+					(unsigned long long)syscalls,
+					msgs ? (double)syscalls / msgs : 0.0);
+		}
+	}
+	if(queue_stats_enabled){
+		fprintf(fptr, "%-10s %12s %12s %12s %12s %12s\n",
+				"writers", "depth", "bytes", "max depth", "max bytes", "pauses");
+		fprintf(fptr, "%-10s %12llu %12llu %12llu %12llu %12llu (%.3f s)\n", "",
+				(unsigned long long)__atomic_load_n(&queue_stats.depth, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&queue_stats.bytes, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&queue_stats.max_depth, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&queue_stats.max_bytes, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&queue_stats.pauses, __ATOMIC_RELAXED),
+				__atomic_load_n(&queue_stats.paused_ns, __ATOMIC_RELAXED) / 1e9);
+	}
+	if(pool_stats_enabled){
+		allocs = __atomic_load_n(&pool_stats.allocs, __ATOMIC_RELAXED);
+		fprintf(fptr, "%-10s %12s %12s %12s %12s %12s %12s\n",
+				"pool", "allocs", "hit rate(%)", "used", "max used", "bytes", "max bytes");
+		fprintf(fptr, "%-10s %12llu %12.1f %12llu %12llu %12llu %12llu\n", "",
+				(unsigned long long)allocs,
+				allocs ? 100.0 * __atomic_load_n(&pool_stats.hits, __ATOMIC_RELAXED) / allocs : 0.0,
+				(unsigned long long)__atomic_load_n(&pool_stats.used, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&pool_stats.max_used, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&pool_stats.bytes, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&pool_stats.max_bytes, __ATOMIC_RELAXED));
+	}
+	if(ack_stats_enabled){
+		fprintf(fptr, "%-10s %12s %12s\n", "ack", "acked", "unacked");
+		fprintf(fptr, "%-10s %12llu %12llu\n", "",
+				(unsigned long long)__atomic_load_n(&ack_stats.acked, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&ack_stats.unacked, __ATOMIC_RELAXED));
+	}
+	if(spill_stats_enabled){
+		drain_ns = __atomic_load_n(&spill_stats.drain_ns, __ATOMIC_RELAXED);
+		drained_bytes = __atomic_load_n(&spill_stats.drained_bytes, __ATOMIC_RELAXED);
+		fprintf(fptr, "%-10s %12s %12s %12s %12s %12s %12s\n",
+				"spill", "bytes", "max bytes", "spilled", "drained", "lag(ms)", "drain MB/s");
+		fprintf(fptr, "%-10s %12llu %12llu %12llu %12llu %12.1f %12.2f\n", "",
+				(unsigned long long)__atomic_load_n(&spill_stats.bytes, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&spill_stats.max_bytes, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&spill_stats.spilled, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&spill_stats.drained, __ATOMIC_RELAXED),
+				__atomic_load_n(&spill_stats.lag_ns, __ATOMIC_RELAXED) / 1e6,
+				drain_ns ? drained_bytes / (drain_ns / 1e9) / 1e6 : 0.0);
+		if(__atomic_load_n(&spill_stats.errors, __ATOMIC_RELAXED)){
+			fprintf(fptr, "%-10s %12llu write errors\n", "",
+					(unsigned long long)__atomic_load_n(&spill_stats.errors, __ATOMIC_RELAXED));
+		}
+	}
+	if(intern_stats_enabled){
+		fprintf(fptr, "%-10s %12s %12s %12s\n", "topics", "interned", "bytes", "evicted");
+		fprintf(fptr, "%-10s %12llu %12llu %12llu\n", "",
+				(unsigned long long)__atomic_load_n(&intern_stats.topics, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&intern_stats.bytes, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&intern_stats.evicted, __ATOMIC_RELAXED));
+	}
+	if(sample_stats_enabled){
+		fprintf(fptr, "%-10s %12s %12s\n", "sample", "dropped", "topics");
+		fprintf(fptr, "%-10s %12llu %12llu\n", "",
+				(unsigned long long)__atomic_load_n(&sample_stats.dropped, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&sample_stats.topics, __ATOMIC_RELAXED));
+	}
+	if(rollup_stats_enabled){
+		fprintf(fptr, "%-10s %12s %12s %12s\n", "rollup", "records", "invalid", "topics");
+		fprintf(fptr, "%-10s %12llu %12llu %12llu\n", "",
+				(unsigned long long)__atomic_load_n(&rollup_stats.records, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&rollup_stats.invalid, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&rollup_stats.topics, __ATOMIC_RELAXED));
+	}
+	if(dedup_stats_enabled){
+		fprintf(fptr, "%-10s %12s %12s\n", "dedup", "skipped", "entries");
+		fprintf(fptr, "%-10s %12llu %12llu\n", "",
+				(unsigned long long)__atomic_load_n(&dedup_stats.skipped, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&dedup_stats.entries, __ATOMIC_RELAXED));
+	}
+	if(stats_dump_topk){
+		stats_dump_topk(fptr);
+	}
+	fflush(fptr);
+}
@@ -0,0 +1,168 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#ifndef SUB_CLIENT_STATS_H
+#define SUB_CLIENT_STATS_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Pipeline stages timed by --latency, each measured from the moment the
+ * message entered my_message_callback(). */
+#define LAT_DISPATCH 0   /* handed over to the output stage */
+#define LAT_QUEUE 1      /* picked up by a writer thread (--writers) */
+#define LAT_PATH 2       /* --fmask output path resolved */
+#define LAT_WRITE 3      /* record written */
+#define LAT_SYNC 4       /* record fsync'ed (--fsync) */
+#define LAT_STAGE_COUNT 5
+
+/* Log-linear (HDR style) histogram: every power of two is split into
+ * 2^LAT_SUB_BITS linear buckets, giving ~1.6% relative precision.
+ * Values are in nanoseconds and are clamped to 2^LAT_MAX_BITS (~73 min). */
+#define LAT_SUB_BITS 6
+#define LAT_MAX_BITS 42
+#define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+/* Stages accounted by --profile, where the time goes per message (not since
+ * receipt like --latency) and the syscalls issued there. */
+#define PROF_CALLBACK 0  /* my_message_callback(), including what follows when
+                          * written from the network thread */
+#define PROF_FILTER 1    /* -T, topic interning, --rollup and --sample */
+#define PROF_RENDER 2    /* --fmask path, expanded or from the path cache */
+#define PROF_MKDIR 3     /* directories opened or created for the file */
+#define PROF_OPEN 4
+#define PROF_WRITE 5
+#define PROF_SYNC 6      /* --fsync */
+#define PROF_CLOSE 7
+#define PROF_STAGE_COUNT 8
+
+struct profile_stage {
+	uint64_t count;
+	uint64_t ticks;
+	uint64_t syscalls;
+};
+
+struct latency_hist {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[LAT_BUCKETS];
+};
+
+/* Writer queue counters (--writers), updated with atomics. */
+struct queue_stats {
+	uint64_t depth;      /* messages queued or being written */
+	uint64_t bytes;      /* topic and payload bytes of those */
+	uint64_t max_depth;
+	uint64_t max_bytes;
+	uint64_t pauses;     /* times reading stopped at the high watermark */
+	uint64_t paused_ns;  /* total time spent not reading */
+};
+
+/* Message buffer pool counters (--writers), updated with atomics. */
+struct pool_stats {
+	uint64_t allocs;
+	uint64_t hits;       /* served from a pool, without malloc() */
+	uint64_t used;       /* buffers in use */
+	uint64_t max_used;
+	uint64_t bytes;      /* allocated from the system, in use or pooled */
+	uint64_t max_bytes;
+};
+
+/* Spill file counters (--spill), updated with atomics. */
+struct spill_stats {
+	uint64_t bytes;      /* spilled and not yet written out */
+	uint64_t max_bytes;
+	uint64_t spilled;    /* messages */
+	uint64_t drained;
+	uint64_t drained_bytes;
+	uint64_t drain_ns;   /* time spent writing out spilled messages */
+	uint64_t lag_ns;     /* time the last drained message spent spilled */
+	uint64_t errors;
+};
+
+/* --ack-after-write counters, updated with atomics. */
+struct ack_stats {
+	uint64_t acked;
+	uint64_t unacked;    /* not written, held in flight for the session */
+};
+
+/* --dedup counters, updated with atomics. */
+struct dedup_stats {
+	uint64_t skipped;    /* writes skipped, content unchanged */
+	uint64_t entries;    /* topics (or files) remembered */
+};
+
+/* --sample counters, updated with atomics. */
+struct sample_stats {
+	uint64_t dropped;    /* messages sampled out */
+	uint64_t topics;     /* topics with a rule */
+};
+
+/* --rollup counters, updated with atomics. */
+struct rollup_stats {
+	uint64_t records;    /* rollup records written */
+	uint64_t invalid;    /* payloads that are not a number */
+	uint64_t topics;     /* topics with a rule */
+};
+
+/* Topic interning counters, updated with atomics. */
+struct intern_stats {
+	uint64_t topics;     /* interned now */
+	uint64_t bytes;      /* memory used for them */
+	uint64_t evicted;
+};
+
+extern bool latency_enabled;
+extern bool profile_enabled;
+extern bool ack_stats_enabled;
+extern struct ack_stats ack_stats;
+extern bool queue_stats_enabled;
+extern struct queue_stats queue_stats;
+extern bool pool_stats_enabled;
+extern struct pool_stats pool_stats;
+extern bool spill_stats_enabled;
+extern struct spill_stats spill_stats;
+extern bool dedup_stats_enabled;
+extern struct dedup_stats dedup_stats;
+extern bool sample_stats_enabled;
+extern struct sample_stats sample_stats;
+extern bool rollup_stats_enabled;
+extern struct rollup_stats rollup_stats;
+extern bool intern_stats_enabled;
+extern struct intern_stats intern_stats;
+extern volatile sig_atomic_t stats_dump_requested;
+/* --top-topics, dumped last when set */
+extern void (*stats_dump_topk)(FILE *fptr);
+
+uint64_t stats_now_ns(void);
+
+void latency_begin(void);
+uint64_t latency_started(void);
+void latency_resume(uint64_t start);
+void latency_mark(int stage);
+void latency_record(int stage, uint64_t ns);
+uint64_t latency_percentile(const struct latency_hist *hist, double pct);
+
+void profile_init(void);
+uint64_t profile_begin(void);
+void profile_end(int stage, uint64_t start);
+void profile_syscalls(int stage, int count);
+
+void stats_dump(FILE *fptr);
+
+#endif
@@ -0,0 +1,342 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+#include <mosquitto.h>
+#include "client_shared.h"
+#include "sub_client_dedup.h"
+#include "sub_client_stats.h"
+#include "sub_client_topk.h"
+
+#define TOPK_MESSAGES 0
+#define TOPK_BYTES 1
+#define TOPK_COUNT 2
+
+/* A heap entry, the topic buffer is kept and reused. */
+struct topk_entry {
+	uint64_t hash;
+	uint64_t count;
+	char *topic;
+	size_t topic_size;
+};
+
+struct topk {
+	struct topk_entry *heap;   /* min-heap on count */
+	int used;
+	uint64_t total;
+};
+
+/* Both counts of a cell side by side, one cache miss per row for both. */
+struct topk_cell {
+	uint64_t count[TOPK_COUNT];
+};
+
+static struct topk_cell *sketch = NULL; /* TOPK_DEPTH rows of TOPK_WIDTH */
+static struct topk tops[TOPK_COUNT];
+static const char *topk_names[TOPK_COUNT] = { "top msgs", "top bytes" };
+static int topk_size = 0;
+static uint64_t window_start = 0;
+static uint64_t window_ns = 0;   /* 0 for since startup */
+#ifndef WIN32
+/* only the benchmark calls the message callback from several threads */
+static pthread_mutex_t topk_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+static void heap_swap(struct topk *tk, int a, int b)
+{
+	struct topk_entry tmp = tk->heap[a];
+
+	tk->heap[a] = tk->heap[b];
+	tk->heap[b] = tmp;
+}
+
+static void heap_down(struct topk *tk, int i)
+{
+	int child;
+
+	while((child = 2*i + 1) < tk->used){
+		if(child + 1 < tk->used && tk->heap[child+1].count < tk->heap[child].count){
+			child++;
+		}
+		if(tk->heap[i].count <= tk->heap[child].count){
+			break;
+		}
+		heap_swap(tk, i, child);
+		i = child;
+	}
+}
+
+static void heap_up(struct topk *tk, int i)
+{
+	int parent;
+
+	while(i > 0){
+		parent = (i - 1) / 2;
+		if(tk->heap[parent].count <= tk->heap[i].count){
+			break;
+		}
+		heap_swap(tk, i, parent);
+		i = parent;
+	}
+}
+
+
+/* Conservative update: only the cells at the current minimum grow, which
+ * keeps the estimates of the colliding topics lower. Returns the new
+ * estimate of the topic. */
+static uint64_t sketch_add(struct topk_cell **cells, int k, uint64_t n)
+{
+	uint64_t est = UINT64_MAX;
+	int i;
+
+	for(i=0; i<TOPK_DEPTH; i++){
+		if(cells[i]->count[k] < est){
+			est = cells[i]->count[k];
+		}
+	}
+	est += n;
+	for(i=0; i<TOPK_DEPTH; i++){
+		if(cells[i]->count[k] < est){
+			cells[i]->count[k] = est;
+		}
+	}
+	return est;
+}
+
+static int entry_set(struct topk_entry *entry, uint64_t hash, const char *topic, size_t len)
+{
+	char *buf;
+
+	if(len + 1 > entry->topic_size){
+		buf = realloc(entry->topic, len + 1);
+		if(!buf){
+			return 1;
+		}
+		entry->topic = buf;
+		entry->topic_size = len + 1;
+	}
+	memcpy(entry->topic, topic, len + 1);
+	entry->hash = hash;
+	return 0;
+}
+
+static void topk_add(int k, struct topk_cell **cells, uint64_t hash, const char *topic, size_t len, uint64_t n)
+{
+	struct topk *tk = &tops[k];
+	uint64_t est;
+	int i;
+
+	tk->total += n;
+	est = sketch_add(cells, k, n);
+
+	/* the common case for all but the heavy topics */
+	if(tk->used == topk_size && est <= tk->heap[0].count){
+		return;
+	}
+	for(i=0; i<tk->used; i++){
+		if(tk->heap[i].hash == hash && !strcmp(tk->heap[i].topic, topic)){
+			tk->heap[i].count = est;
+			heap_down(tk, i);
+			return;
+		}
+	}
+	if(tk->used < topk_size){
+		i = tk->used;
+		if(entry_set(&tk->heap[i], hash, topic, len)){
+			return;
+		}
+		tk->heap[i].count = est;
+		tk->used++;
+		heap_up(tk, i);
+	}else{
+		/* pushes out the smallest */
+		if(entry_set(&tk->heap[0], hash, topic, len)){
+			return;
+		}
+		tk->heap[0].count = est;
+		heap_down(tk, 0);
+	}
+}
+
+static void topk_reset(void)
+{
+	int k;
+
+	memset(sketch, 0, TOPK_DEPTH*TOPK_WIDTH*sizeof(struct topk_cell));
+	for(k=0; k<TOPK_COUNT; k++){
+		tops[k].used = 0;
+		tops[k].total = 0;
+	}
+	__atomic_store_n(&window_start, stats_now_ns(), __ATOMIC_RELAXED);
+}
+
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct topk_entry *ea = *(const struct topk_entry * const *)a;
+	const struct topk_entry *eb = *(const struct topk_entry * const *)b;
+
+	if(ea->count != eb->count){
+		return ea->count < eb->count ? 1 : -1;
+	}
+	return strcmp(ea->topic, eb->topic);
+}
+
+/* Called with topk_mutex held. */
+static void topk_print(FILE *fptr)
+{
+	struct topk_entry *sorted[TOP_TOPICS_MAX];
+	const struct topk *tk;
+	double secs;
+	int i, k;
+
+	secs = (stats_now_ns() - window_start) / 1e9;
+	for(k=0; k<TOPK_COUNT; k++){
+		tk = &tops[k];
+		fprintf(fptr, "%-10s %12s %12s %12s  topic (%.1f s, %llu in total, estimates over by <= %llu)\n",
+				topk_names[k], "estimate", "share(%)", "per s", secs,
+				(unsigned long long)tk->total,
+				/* e/TOPK_WIDTH of the total, rounded up */
+				(unsigned long long)(tk->total * 2.718281828 / TOPK_WIDTH + 1));
+		for(i=0; i<tk->used; i++){
+			sorted[i] = &tk->heap[i];
+		}
+		qsort(sorted, tk->used, sizeof(sorted[0]), entry_cmp);
+		for(i=0; i<tk->used; i++){
+			fprintf(fptr, "%-10d %12llu %12.1f %12.1f  %s\n", i + 1,
+					(unsigned long long)sorted[i]->count,
+					tk->total ? 100.0 * sorted[i]->count / tk->total : 0.0,
+					secs > 0 ? sorted[i]->count / secs : 0.0,
+					sorted[i]->topic);
+		}
+	}
+	fflush(fptr);
+}
+
+
+int topk_init(struct mosq_config *cfg)
+{
+	int k;
+
+	topk_size = cfg->top_topics;
+	window_ns = (uint64_t)cfg->top_interval * 1000000000ULL;
+	sketch = calloc(TOPK_DEPTH*TOPK_WIDTH, sizeof(struct topk_cell));
+	for(k=0; k<TOPK_COUNT; k++){
+		tops[k].heap = calloc(topk_size, sizeof(struct topk_entry));
+		if(!sketch || !tops[k].heap){
+			err_printf(cfg, "Error: Out of memory.\n");
+			topk_cleanup();
+			return 1;
+		}
+	}
+	topk_reset();
+	stats_dump_topk = topk_dump;
+	return 0;
+}
+
+
+void topk_message(const struct mosquitto_message *message)
+{
+	struct topk_cell *cells[TOPK_DEPTH];
+	uint32_t h1, h2;
+	uint64_t hash;
+	size_t len;
+	int i;
+
+	len = strlen(message->topic);
+	hash = dedup_hash(message->topic, len, 0);
+	/* a column per row from two halves of one hash */
+	h1 = (uint32_t)hash;
+	h2 = (uint32_t)(hash >> 32) | 1;
+	for(i=0; i<TOPK_DEPTH; i++){
+		cells[i] = &sketch[i*TOPK_WIDTH + ((h1 + (uint32_t)i*h2) & (TOPK_WIDTH - 1))];
+	}
+#ifndef WIN32
+	pthread_mutex_lock(&topk_mutex);
+#endif
+	topk_add(TOPK_MESSAGES, cells, hash, message->topic, len, 1);
+	topk_add(TOPK_BYTES, cells, hash, message->topic, len, (uint64_t)message->payloadlen);
+#ifndef WIN32
+	pthread_mutex_unlock(&topk_mutex);
+#endif
+	if(window_ns){
+		/* where no timer calls it */
+		topk_expire();
+	}
+}
+
+
+void topk_expire(void)
+{
+	if(!window_ns || stats_now_ns() - __atomic_load_n(&window_start, __ATOMIC_RELAXED) < window_ns){
+		return;
+	}
+#ifndef WIN32
+	pthread_mutex_lock(&topk_mutex);
+#endif
+	/* another thread may have been first */
+	if(stats_now_ns() - window_start >= window_ns){
+		topk_print(stderr);
+		topk_reset();
+	}
+#ifndef WIN32
+	pthread_mutex_unlock(&topk_mutex);
+#endif
+}
+
+
+void topk_dump(FILE *fptr)
+{
+#ifndef WIN32
+	pthread_mutex_lock(&topk_mutex);
+#endif
+	topk_print(fptr);
+#ifndef WIN32
+	pthread_mutex_unlock(&topk_mutex);
+#endif
+}
+
+
+void topk_cleanup(void)
+{
+	int i, k;
+
+	stats_dump_topk = NULL;
+	for(k=0; k<TOPK_COUNT; k++){
+		if(tops[k].heap){
+			for(i=0; i<topk_size; i++){
+				free(tops[k].heap[i].topic);
+			}
+		}
+		free(tops[k].heap);
+		tops[k].heap = NULL;
+		tops[k].used = 0;
+		tops[k].total = 0;
+	}
+	free(sketch);
+	sketch = NULL;
+	topk_size = 0;
+}
@@ -0,0 +1,49 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#ifndef SUB_CLIENT_TOPK_H
+#define SUB_CLIENT_TOPK_H
+
+#include <stdio.h>
+
+#include <mosquitto.h>
+#include "client_shared.h"
+
+/* Heavy hitter topics (--top-topics), by messages and by payload bytes.
+ *
+ * Each is a count-min sketch with conservative update, so memory does not
+ * grow with the number of topics, and a min-heap of the K topics with the
+ * highest estimates. Estimates are never low, and high by at most
+ * e/TOPK_WIDTH of the window's total with probability 1 - e^-TOPK_DEPTH.
+ * A topic enters the heap once its estimate passes the smallest there. */
+
+#define TOPK_DEPTH 4
+#define TOPK_WIDTH 4096     /* power of two */
+
+int topk_init(struct mosq_config *cfg);
+
+/* Count a received message. */
+void topk_message(const struct mosquitto_message *message);
+
+/* Log and restart the window once --top-interval passed, from a timer. */
+void topk_expire(void);
+
+/* The heavy hitters of the current window, part of stats_dump(). */
+void topk_dump(FILE *fptr);
+
+void topk_cleanup(void);
+
+#endif
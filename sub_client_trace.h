@@ -0,0 +1,59 @@
+/*
+Copyright (c) 2015-2020 V.Krishn <vkrishn@insteps.net>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   V Krishn    - implement dirpub.
+*/
+
+#ifndef SUB_CLIENT_TRACE_H
+#define SUB_CLIENT_TRACE_H
+
+/* Static tracepoints (USDT) of the message pipeline, provider mqtt_dirpub,
+ * for bpftrace, perf or systemtap, e.g.
+ *
+ *   bpftrace -e 'usdt:./mosquitto_sub:mqtt_dirpub:write { printf("%s %d\n", str(arg2), arg3); }'
+ *
+ * Compiled in when <sys/sdt.h> (systemtap-sdt-dev) is found, unless
+ * WITHOUT_USDT is defined. A probe is a single nop until a tracer attaches.
+ *
+ * Every probe has the topic, the payload length and the path (NULL before
+ * it is resolved) as arg0-arg2, and arg3:
+ *   receive  mid
+ *   filter   TRACE_* verdict
+ *   fmask    1 if the path came from the path cache
+ *   mkdir    0, or errno (arg2 is the directory)
+ *   open     fd, or -errno
+ *   write    0, or 1 on failure
+ *   close    fd */
+
+#define TRACE_WRITE 0       /* written (or queued for the writers) */
+#define TRACE_NO_RETAIN 1   /* retained, with -R */
+#define TRACE_FILTER_OUT 2  /* matched a -T filter */
+#define TRACE_ROLLUP 3      /* folded into a --rollup window */
+#define TRACE_SAMPLE 4      /* sampled out or kept by --sample */
+#define TRACE_DEDUP 5       /* unchanged, --dedup (arg2 set for overwrite) */
+
+#if !defined(WITHOUT_USDT) && !defined(WIN32) && defined(__has_include)
+#  if __has_include(<sys/sdt.h>)
+#    include <sys/sdt.h>
+#    define WITH_USDT
+#  endif
+#endif
+
+#ifdef WITH_USDT
+#  define TRACE(probe, topic, len, path, arg) \
+	DTRACE_PROBE4(mqtt_dirpub, probe, topic, len, path, arg)
+#else
+#  define TRACE(probe, topic, len, path, arg) do{}while(0)
+#endif
+
+#endif